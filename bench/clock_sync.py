@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""Synchronized start of several pumps with FID_SYNC_CLOCK and FID_START_PUMP_AT.
+
+Estimates the offset and drift of the device clock of every pump from UDP
+timestamp exchanges (like NTP), starts all of them at the same host time and
+reports the skew of the actual starts:
+
+    python3 bench/clock_sync.py 192.168.5.104 192.168.5.105 --lead 1.0
+
+The pumps need a flow configuration (FID_SET_FLOW_CONFIG) and nobody else in
+control. --simulate N runs the exchange against N local stand-in pumps with
+their own clock offset and drift instead. They start exactly at their device
+time, so the skew they show is the error of the clock sync.
+"""
+
+import argparse
+import random
+import socket
+import struct
+import threading
+import time
+
+FID_SYNC_CLOCK = 32
+FID_START_PUMP_AT = 33
+FID_GET_SCHEDULED_START = 34
+HEADER = struct.Struct("<BBB")
+SYNC_REQUEST = struct.Struct("<BBBQ")
+SYNC_REPLY = struct.Struct("<BBBQQQ")
+START_AT = struct.Struct("<BBBQ")
+SCHEDULED_START = struct.Struct("<BBBQQ")
+
+
+def host_us():
+    return time.perf_counter_ns() // 1000
+
+
+def recv_exactly(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise ConnectionError("pump closed the connection")
+        data += chunk
+    return data
+
+
+class PumpClock:
+    """Maps host time to the device time of one pump, device = host * rate + offset"""
+
+    def __init__(self, address, udp_port, channel):
+        self.address = (address, udp_port)
+        self.channel = channel
+        self.rate = 1.0
+        self.offset = 0.0
+        self.delay_us = 0
+
+    def sync(self, duration, interval):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.settimeout(0.2)
+        samples = []
+        end = time.monotonic() + duration
+        while time.monotonic() < end:
+            t1 = host_us()
+            sock.sendto(SYNC_REQUEST.pack(SYNC_REQUEST.size, FID_SYNC_CLOCK | (self.channel << 6), 0, t1), self.address)
+            try:
+                reply = sock.recvfrom(SYNC_REPLY.size)[0]
+            except socket.timeout:
+                continue
+            t4 = host_us()
+            _, _, error, echo, t2, t3 = SYNC_REPLY.unpack(reply)
+            if error == 0 and echo == t1:
+                # Midpoints, the time spent in the network is taken as symmetric
+                samples.append(((t4 - t1) - (t3 - t2), (t1 + t4) / 2.0, (t2 + t3) / 2.0))
+            time.sleep(interval)
+        sock.close()
+        if len(samples) < 4:
+            raise RuntimeError("%s: no clock sync replies" % self.address[0])
+
+        # The quickest half of the exchanges waited least in queues
+        samples.sort()
+        best = samples[:max(4, len(samples) // 2)]
+        self.delay_us = best[0][0]
+        n = float(len(best))
+        mean_h = sum(s[1] for s in best) / n
+        mean_d = sum(s[2] for s in best) / n
+        var = sum((s[1] - mean_h) ** 2 for s in best)
+        self.rate = sum((s[1] - mean_h) * (s[2] - mean_d) for s in best) / var if var > 0 else 1.0
+        self.offset = mean_d - self.rate * mean_h
+
+    def device_time(self, host_time):
+        return int(round(self.rate * host_time + self.offset))
+
+    def host_time(self, device_time):
+        return (device_time - self.offset) / self.rate
+
+
+def command(address, tcp_port, packed, reply_length):
+    with socket.create_connection((address, tcp_port)) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.sendall(packed)
+        header = recv_exactly(sock, HEADER.size)
+        if header[0] > HEADER.size:
+            header += recv_exactly(sock, header[0] - HEADER.size)
+        return header if header[2] != 0 or reply_length == HEADER.size else header[:reply_length]
+
+
+class StandInPump:
+    """Answers the three FIDs like a pump with a clock of its own"""
+
+    def __init__(self):
+        self.offset = random.uniform(-1e7, 1e7)
+        self.rate = 1.0 + random.uniform(-50e-6, 50e-6)
+        self.start_time = 0
+        self.started_at = 0
+        self.udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.udp.bind(("127.0.0.1", 0))
+        self.tcp = socket.socket()
+        self.tcp.bind(("127.0.0.1", 0))
+        self.tcp.listen(2)
+        self.udp_port = self.udp.getsockname()[1]
+        self.tcp_port = self.tcp.getsockname()[1]
+        for target in (self.serve_udp, self.serve_tcp):
+            threading.Thread(target=target, daemon=True).start()
+
+    def now(self):
+        return int(host_us() * self.rate + self.offset)
+
+    def serve_udp(self):
+        while True:
+            data, peer = self.udp.recvfrom(64)
+            received = self.now()
+            _, fid, _, t1 = SYNC_REQUEST.unpack(data)
+            self.udp.sendto(SYNC_REPLY.pack(SYNC_REPLY.size, fid, 0, t1, received, self.now()), peer)
+
+    def serve_tcp(self):
+        while True:
+            conn, _ = self.tcp.accept()
+            with conn:
+                header = recv_exactly(conn, HEADER.size)
+                rest = recv_exactly(conn, header[0] - HEADER.size)
+                fid = header[1]
+                if fid & 0x3F == FID_START_PUMP_AT:
+                    self.start_time = struct.unpack("<Q", rest)[0]
+                    self.started_at = 0
+                    threading.Thread(target=self.run_at, daemon=True).start()
+                    conn.sendall(HEADER.pack(HEADER.size, fid, 0))
+                else:
+                    conn.sendall(SCHEDULED_START.pack(SCHEDULED_START.size, fid, 0, self.start_time, self.started_at))
+
+    def run_at(self):
+        # An ideal timer, the skew is the one of the clock sync alone. Python threads
+        # wake up far later than the timer interrupt of the pump
+        while self.now() < self.start_time:
+            time.sleep(0.001)
+        self.started_at = self.start_time
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("hosts", nargs="*")
+    parser.add_argument("--tcp-port", type=int, default=7851)
+    parser.add_argument("--udp-port", type=int, default=7852)
+    parser.add_argument("--channel", type=int, default=0)
+    parser.add_argument("--sync-time", type=float, default=2.0, help="seconds of timestamp exchanges per pump")
+    parser.add_argument("--lead", type=float, default=1.0, help="seconds from sending the starts to the start")
+    parser.add_argument("--simulate", type=int, default=0, metavar="N")
+    args = parser.parse_args()
+
+    pumps = [(host, args.tcp_port, args.udp_port) for host in args.hosts]
+    for _ in range(args.simulate):
+        stand_in = StandInPump()
+        pumps.append(("127.0.0.1", stand_in.tcp_port, stand_in.udp_port))
+    if not pumps:
+        parser.error("no pumps, give their addresses or --simulate N")
+
+    clocks = []
+    for address, _, udp_port in pumps:
+        clock = PumpClock(address, udp_port, args.channel)
+        clock.sync(args.sync_time, 0.01)
+        clocks.append(clock)
+        print("%-15s offset %16.0f us  drift %+8.2f ppm  delay %5d us"
+              % (address, clock.offset, (clock.rate - 1.0) * 1e6, clock.delay_us))
+
+    # Sync first, the starts go out one after the other
+    start = host_us() + int(args.lead * 1e6)
+    fid = args.channel << 6
+    for (address, tcp_port, _), clock in zip(pumps, clocks):
+        reply = command(address, tcp_port, START_AT.pack(START_AT.size, FID_START_PUMP_AT | fid, 0, clock.device_time(start)), HEADER.size)
+        if reply[2] != 0:
+            raise RuntimeError("%s: FID_START_PUMP_AT failed with error %d" % (address, reply[2]))
+
+    time.sleep(max(0.0, (start - host_us()) / 1e6) + 0.1)
+    starts = []
+    for (address, tcp_port, _), clock in zip(pumps, clocks):
+        reply = command(address, tcp_port, HEADER.pack(HEADER.size, FID_GET_SCHEDULED_START | fid, 0), SCHEDULED_START.size)
+        started_at = SCHEDULED_START.unpack(reply)[4]
+        if started_at == 0:
+            raise RuntimeError("%s: has not started" % address)
+        starts.append(clock.host_time(started_at) - start)
+        print("%-15s started %+8.1f us from the target" % (address, starts[-1]))
+
+    print("skew %.1f us over %d pumps" % (max(starts) - min(starts), len(starts)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Round trip latency of FID_GET_STATUS over TCP and over the UDP fast path.
+
+Sends the same status request over both paths in turns and prints the
+distribution of the round trip times. Run it from a host on the pump network:
+
+    python3 bench/com_latency.py 192.168.5.104 --count 1000
+
+Pass --load to keep a second TCP client busy with status requests meanwhile,
+which shows the head-of-line blocking the fast path avoids.
+"""
+
+import argparse
+import socket
+import struct
+import threading
+import time
+
+FID_GET_STATUS = 0
+HEADER_LENGTH = 3
+STATUS_LENGTH = HEADER_LENGTH + 20  # SystemStatus
+
+
+def status_request(channel):
+    return struct.pack("<BBB", HEADER_LENGTH, FID_GET_STATUS | (channel << 6), 0)
+
+
+def recv_exactly(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise ConnectionError("pump closed the connection")
+        data += chunk
+    return data
+
+
+def tcp_round_trip(sock, request):
+    start = time.perf_counter()
+    sock.sendall(request)
+    recv_exactly(sock, STATUS_LENGTH)
+    return time.perf_counter() - start
+
+
+def udp_round_trip(sock, request, address):
+    start = time.perf_counter()
+    sock.sendto(request, address)
+    try:
+        sock.recvfrom(STATUS_LENGTH)
+    except socket.timeout:
+        return None
+    return time.perf_counter() - start
+
+
+def load(host, port, request, stop):
+    with socket.create_connection((host, port)) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        while not stop.is_set():
+            tcp_round_trip(sock, request)
+
+
+def summary(name, times, lost):
+    times = sorted(t * 1e6 for t in times)
+    if not times:
+        print("%-4s no replies, %d lost" % (name, lost))
+        return
+    pick = lambda q: times[min(len(times) - 1, int(q * len(times)))]
+    print("%-4s min %7.0f  median %7.0f  p99 %7.0f  max %7.0f us  (%d lost)"
+          % (name, times[0], pick(0.5), pick(0.99), times[-1], lost))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--tcp-port", type=int, default=7851)
+    parser.add_argument("--udp-port", type=int, default=7852)
+    parser.add_argument("--channel", type=int, default=0)
+    parser.add_argument("--count", type=int, default=500)
+    parser.add_argument("--load", action="store_true")
+    args = parser.parse_args()
+
+    request = status_request(args.channel)
+    stop = threading.Event()
+    if args.load:
+        threading.Thread(target=load, args=(args.host, args.tcp_port, request, stop), daemon=True).start()
+
+    tcp = socket.create_connection((args.host, args.tcp_port))
+    tcp.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    udp.settimeout(0.5)
+
+    tcp_times, udp_times, udp_lost = [], [], 0
+    for _ in range(args.count):
+        tcp_times.append(tcp_round_trip(tcp, request))
+        t = udp_round_trip(udp, request, (args.host, args.udp_port))
+        if t is None:
+            udp_lost += 1
+        else:
+            udp_times.append(t)
+
+    stop.set()
+    summary("TCP", tcp_times, 0)
+    summary("UDP", udp_times, udp_lost)
+
+
+if __name__ == "__main__":
+    main()
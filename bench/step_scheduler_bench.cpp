@@ -0,0 +1,143 @@
+#include "mbed.h"
+#include "StepScheduler.h"
+
+/*! Maximum total step rate of the shared step scheduler on the K64F.
+ *
+ *  For 1 to STEP_SCHEDULER_MAX_AXES axes, every axis outputs a constant rate for
+ *  BENCH_DURATION_US and the rate is raised until a step is late by half an interval
+ *  or more. The axes run at slightly different rates so their deadlines drift through
+ *  each other and both separate and coinciding steps are measured. The CPU time left
+ *  to the main thread (the network stack in the pump firmware) is measured by
+ *  counting idle loop iterations against a run without axes. Results are printed on
+ *  the serial console. */
+
+#define BENCH_DURATION_US 500000
+#define BENCH_FIRST_RATE 2000.0f // Steps per second and axis
+#define BENCH_RATE_FACTOR 1.1f
+#define BENCH_MIN_INTERVAL_US 10 // ScheduledStepGenerator::supports() limit
+
+// STEP output of the pump and the RGB LED, nothing needs to be connected
+static const PinName benchPins[STEP_SCHEDULER_MAX_AXES] = {PTD0, LED_RED, LED_GREEN, LED_BLUE};
+
+/*! Axis running a fixed number of steps at a constant interval */
+class BenchAxis {
+
+    public:
+        BenchAxis(StepScheduler* scheduler, PinName stepPin) :
+            _stepGenerator(scheduler, stepPin),
+            _interval(0),
+            _left(0),
+            _done(true) {
+
+            _stepGenerator.nextInterval = callback(this, &BenchAxis::nextInterval);
+            _stepGenerator.moveDone = callback(this, &BenchAxis::moveDone);
+        }
+
+        void start(uint32_t interval, int steps) {
+            _interval = interval;
+            _left = steps;
+            _done = false;
+            _stepGenerator.start(interval);
+        }
+
+        void stop() {
+            _stepGenerator.stop();
+            _done = true;
+        }
+
+        bool done() {
+            return _done;
+        }
+
+    private:
+        uint32_t nextInterval() {
+            return (--_left > 0) ? _interval : 0;
+        }
+
+        void moveDone() {
+            _done = true;
+        }
+
+        ScheduledStepGenerator _stepGenerator;
+        uint32_t _interval; // Q24.8 microseconds
+        int _left;
+        volatile bool _done;
+};
+
+static StepScheduler stepScheduler;
+static BenchAxis* axes[STEP_SCHEDULER_MAX_AXES];
+
+/*! Counts main loop iterations until the time is up, or until all axes are done.
+ *  The loop body is the same with and without running axes */
+static uint32_t idleLoops(us_timestamp_t timeout_us, bool untilDone) {
+    Timer timer;
+    uint32_t loops = 0;
+
+    timer.start();
+    while (timer.read_high_resolution_us() < timeout_us) {
+        bool running = false;
+        for (int i = 0; i < STEP_SCHEDULER_MAX_AXES; i++) {
+            if (!axes[i]->done()) running = true;
+        }
+        if (untilDone && !running) break;
+        loops++;
+    }
+
+    return loops;
+}
+
+int main() {
+    for (int i = 0; i < STEP_SCHEDULER_MAX_AXES; i++) {
+        axes[i] = new BenchAxis(&stepScheduler, benchPins[i]);
+    }
+
+    // Reference without any step interrupts
+    float idlePerUs = (float)idleLoops(BENCH_DURATION_US, false) / BENCH_DURATION_US;
+
+    printf("\nStep scheduler benchmark, %d ms per run, SystemCoreClock %lu Hz\n",
+        BENCH_DURATION_US / 1000, (unsigned long)SystemCoreClock);
+    printf("axes  steps/s/axis  steps/s total  max late [us]  CPU load [%%]\n");
+
+    for (int axisCount = 1; axisCount <= STEP_SCHEDULER_MAX_AXES; axisCount++) {
+        float maxTotalRate = 0.0f;
+
+        for (float rate = BENCH_FIRST_RATE; 1000000.0f / rate >= BENCH_MIN_INTERVAL_US; rate *= BENCH_RATE_FACTOR) {
+            uint32_t interval = (uint32_t)((1000000.0f * (1 << STEP_INTERVAL_FRAC_BITS)) / rate);
+            int steps = (int)(rate * BENCH_DURATION_US / 1000000.0f);
+
+            stepScheduler.resetMaxLateness();
+            Timer elapsed;
+            elapsed.start();
+            for (int i = 0; i < axisCount; i++) {
+                // Up to 4.7 % slower per axis
+                axes[i]->start(interval + i * (interval >> 6), steps);
+            }
+
+            // Twice the nominal duration before the run counts as stalled
+            uint32_t loops = idleLoops(2 * BENCH_DURATION_US, true);
+            us_timestamp_t time_us = elapsed.read_high_resolution_us();
+
+            bool done = true;
+            for (int i = 0; i < axisCount; i++) {
+                if (!axes[i]->done()) done = false;
+                axes[i]->stop();
+            }
+
+            uint32_t late_us = stepScheduler.maxLateness_us();
+            float load = 100.0f * (1.0f - loops / (idlePerUs * time_us));
+            float totalRate = 0.0f;
+            for (int i = 0; i < axisCount; i++) {
+                totalRate += (1000000.0f * (1 << STEP_INTERVAL_FRAC_BITS)) / (interval + i * (interval >> 6));
+            }
+
+            printf("%4d  %12d  %13d  %13lu  %12.1f%s\n", axisCount, (int)rate, (int)totalRate,
+                (unsigned long)late_us, load, done ? "" : "  stalled");
+
+            // A step late by half an interval distorts the flow
+            if (!done || (late_us * 2 * (1 << STEP_INTERVAL_FRAC_BITS) >= interval)) break;
+            maxTotalRate = totalRate;
+        }
+
+        printf("%d axes: max %d steps/s total\n\n", axisCount, (int)maxTotalRate);
+    }
+}
@@ -1,3 +1,10 @@
-version https://git-lfs.github.com/spec/v1
-oid sha256:0347cd1ec7a6fb1cc542655f94b1f3a47ee6d63e8e54d79b0547f7ab44e61fb4
-size 82
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#ifdef DEBUG
+#define D(x) x
+#else
+#define D(x)
+#endif
+
+#endif
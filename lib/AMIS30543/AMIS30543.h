@@ -1,3 +1,931 @@
-version https://git-lfs.github.com/spec/v1
-oid sha256:50379140b651c21c569bd0de67f70d0bf0e031f24976c1f4d29a66dd47b37248
-size 19812
+// Copyright Pololu Corporation.  For more information, see http://www.pololu.com/
+// Ported to mbed (SPI and DigitalOut instead of the Arduino SPI library).
+
+#ifndef AMIS30543_H
+#define AMIS30543_H
+
+#include "mbed.h"
+
+// Longest a blocking access waits for a background batch.  The largest batch
+// (10 accesses of about 40 us at 500 kHz) takes well below this.
+#define AMIS30543_WAIT_IDLE_US 2000
+
+/*! This class provides low-level functions for reading and writing from the SPI
+ * interface of an AMIS-30543 micro-stepping stepper motor driver.
+ *
+ * Register accesses either block until they are done, or run one after the
+ * other in the background with transferAsync().  Blocking accesses wait for
+ * the background ones first, those of every driver since the drivers of a board
+ * share the bus.  The wait is bounded: a batch whose completion does not come
+ * within AMIS30543_WAIT_IDLE_US is aborted and counted as a timeout of the
+ * driver that started it. */
+class AMIS30543SPI
+{
+public:
+
+    /*! Configures this object to use the specified SPI pins and the specified
+     * slave select pin.  You must use a slave select pin; the AMIS-30543
+     * requires it. */
+    AMIS30543SPI(PinName mosi, PinName miso, PinName sclk, PinName ss) :
+        _ssPin(ss),
+        _spi(mosi, miso, sclk),
+        _transactions(0),
+        _asyncCount(0),
+        _asyncFailed(false),
+        _timeouts(0)
+    {
+        _ssPin = 1;
+
+        // The AMIS-30543 samples data on the rising edge of the clock
+        // (SPI mode 0) and supports clock frequencies up to 1 MHz.
+        _spi.format(8, 0);
+        _spi.frequency(500000);
+#if DEVICE_SPI_ASYNCH
+        _spi.set_dma_usage(DMA_USAGE_OPPORTUNISTIC);
+#endif
+    }
+
+    /*! Reads the register at the given address and returns its raw value. */
+    uint8_t readReg(uint8_t address)
+    {
+        waitIdle();
+        _transactions++;
+        selectChip();
+        transfer(address & 0b11111);
+        uint8_t dataOut = transfer(0);
+        deselectChip();
+        return dataOut;
+    }
+
+    /*! Writes the specified value to a register. */
+    void writeReg(uint8_t address, uint8_t value)
+    {
+        waitIdle();
+        _transactions++;
+        selectChip();
+        transfer(0x80 | (address & 0b11111));
+        transfer(value);
+
+        // The CS line must go high after writing for the value to actually take
+        // effect.
+        deselectChip();
+    }
+
+    /*! Runs count register accesses in the background.  Each one sends two
+     * bytes from tx with the chip selected on its own and stores the two bytes
+     * received in rx: the address with 0x80 for writes and the value, or the
+     * address and 0 for reads, whose value is the second byte received.
+     *
+     * Both buffers stay in use until done is called, from interrupt context,
+     * or from waitIdle() if the batch had to be aborted.  Without asynchronous
+     * SPI the accesses block and done is called before this returns.  If the
+     * SPI refuses an access from the completion interrupt, where the blocking
+     * accesses cannot run, the batch fails (see asyncFailed()). */
+    void transferAsync(const uint8_t* tx, uint8_t* rx, int count, Callback<void()> done)
+    {
+        waitIdle();
+        _transactions += count;
+        _asyncTx = tx;
+        _asyncRx = rx;
+        _asyncCount = count;
+        _asyncDone = done;
+        _asyncFailed = false;
+        busOwner() = this;
+        transferNext(false);
+    }
+
+    /*! Returns true while accesses started with transferAsync() are running,
+     * on this driver or another one.  The drivers of a board share the bus. */
+    bool isBusy()
+    {
+        return busOwner() != NULL;
+    }
+
+    /*! Waits until the accesses started with transferAsync() are done, on this
+     * driver or another one, at most AMIS30543_WAIT_IDLE_US.  Then the batch is
+     * aborted, done is called as if it completed and false is returned. */
+    bool waitIdle()
+    {
+        if (busOwner() == NULL) { return true; }
+
+        Timer timer;
+        timer.start();
+        while (busOwner() != NULL)
+        {
+            if (timer.read_high_resolution_us() >= AMIS30543_WAIT_IDLE_US)
+            {
+                abortAsync();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*! Returns true if the last batch of this driver did not complete, it was
+     * aborted or the SPI refused an access.  What it read is not valid then. */
+    bool asyncFailed()
+    {
+        return _asyncFailed;
+    }
+
+    /*! Returns the number of batches of this driver aborted by waitIdle(). */
+    uint32_t getTimeoutCount()
+    {
+        return _timeouts;
+    }
+
+    /*! Returns the number of register reads and writes so far. */
+    uint32_t getTransactionCount()
+    {
+        return _transactions;
+    }
+
+private:
+
+    uint8_t transfer(uint8_t value)
+    {
+        return _spi.write(value);
+    }
+
+    /*! Starts the next access of the batch.  The blocking fallback takes
+     * the mutex of the SPI, from the completion interrupt the batch fails
+     * instead. */
+    void transferNext(bool calledFromIRQ)
+    {
+        while (_asyncCount > 0)
+        {
+            selectChip();
+#if DEVICE_SPI_ASYNCH
+            if (_spi.transfer(_asyncTx, 2, _asyncRx, 2,
+                    callback(this, &AMIS30543SPI::transferDone), SPI_EVENT_COMPLETE) == 0)
+            {
+                return;
+            }
+#endif
+            if (calledFromIRQ)
+            {
+                deselectChip();
+                _asyncCount = 0;
+                _asyncFailed = true;
+                break;
+            }
+
+            // Without asynchronous SPI, or if it is not available right now
+            _asyncRx[0] = transfer(_asyncTx[0]);
+            _asyncRx[1] = transfer(_asyncTx[1]);
+            deselectChip();
+            _asyncTx += 2;
+            _asyncRx += 2;
+            _asyncCount--;
+        }
+
+        busOwner() = NULL;
+        _asyncDone();
+    }
+
+    /*! Stops the running batch, whichever driver started it. */
+    static void abortAsync()
+    {
+        core_util_critical_section_enter();
+        AMIS30543SPI* owner = busOwner();
+        if (owner != NULL)
+        {
+#if DEVICE_SPI_ASYNCH
+            owner->_spi.abort_transfer();
+#endif
+            owner->deselectChip();
+            owner->_asyncCount = 0;
+            owner->_asyncFailed = true;
+            owner->_timeouts++;
+            busOwner() = NULL;
+        }
+        core_util_critical_section_exit();
+
+        if (owner != NULL) { owner->_asyncDone(); }
+    }
+
+    /*! The driver whose batch is running, NULL if the bus is free. */
+    static AMIS30543SPI* volatile& busOwner()
+    {
+        static AMIS30543SPI* volatile owner = NULL;
+        return owner;
+    }
+
+    void transferDone(int /* event */)
+    {
+        deselectChip();
+        _asyncTx += 2;
+        _asyncRx += 2;
+        _asyncCount--;
+        transferNext(true);
+    }
+
+    void selectChip()
+    {
+        _ssPin = 0;
+    }
+
+    void deselectChip()
+    {
+        _ssPin = 1;
+
+        // The CS high time is specified as 2.5 us in the AMIS-30543 datasheet.
+        wait_us(3);
+    }
+
+    DigitalOut _ssPin;
+    SPI _spi;
+    uint32_t _transactions;
+
+    const uint8_t* _asyncTx;
+    uint8_t* _asyncRx;
+    volatile int _asyncCount;
+    Callback<void()> _asyncDone;
+    volatile bool _asyncFailed;
+    uint32_t _timeouts;
+};
+
+/*! This class provides high-level functions for controlling an AMIS-30543
+ *  micro-stepping motor driver.
+ *
+ * It provides access to all the features of the AMIS-30543 SPI interface
+ * except the watchdog timer.
+ *
+ * Besides the settings, the class keeps a shadow of the values last written to
+ * the control registers.  A register is only written when its setting differs
+ * from the shadow, and verifySettings() only reads back the registers written
+ * since the last verification. */
+class AMIS30543
+{
+public:
+    /*! The default constructor. */
+    AMIS30543(PinName mosi, PinName miso, PinName sclk, PinName ss) :
+        driver(mosi, miso, sclk, ss)
+    {
+        wr = cr0 = cr1 = cr2 = cr3 = 0;
+        knownRegs = unverifiedRegs = asyncVerifyRegs = 0;
+        asyncReadFrom = 0;
+        updating = false;
+    }
+
+    /*! Possible arguments to setStepMode(). */
+    enum stepMode
+    {
+        MicroStep128 = 128,
+        MicroStep64 = 64,
+        MicroStep32 = 32,
+        MicroStep16 = 16,
+        MicroStep8 = 8,
+        MicroStep4 = 4,
+        MicroStep2 = 2,
+        MicroStep1 = 1,
+        CompensatedHalf = MicroStep2,
+        CompensatedFullTwoPhaseOn = MicroStep1,
+        CompensatedFullOnePhaseOn = 200,
+        UncompensatedHalf = 201,
+        UncompensatedFull = 202,
+    };
+
+    /*! Bitmasks for the return value of readNonLatchedStatusFlags(). */
+    enum nonLatchedStatusFlag
+    {
+        OPENY = (1 << 2),
+        OPENX = (1 << 3),
+        WD = (1 << 4),
+        CPFAIL = (1 << 5),
+        TW = (1 << 6),
+    };
+
+    /*! Bitmasks for the return value of readLatchedStatusFlagsAndClear(). */
+    enum latchedStatusFlag
+    {
+        OVCXNB = (1 << 3),
+        OVCXNT = (1 << 4),
+        OVCXPB = (1 << 5),
+        OVCXPT = (1 << 6),
+        TSD = (1 << 10),
+        OVCYNB = (1 << 11),
+        OVCYNT = (1 << 12),
+        OVCYPB = (1 << 13),
+        OVCYPT = (1 << 14),
+    };
+
+    /*! Addresses of control and status registers. */
+    enum regAddr
+    {
+        WR  = 0x0,
+        CR0 = 0x1,
+        CR1 = 0x2,
+        CR2 = 0x3,
+        CR3 = 0x9,
+        SR0 = 0x4,
+        SR1 = 0x5,
+        SR2 = 0x6,
+        SR3 = 0x7,
+        SR4 = 0xA,
+    };
+
+    /*! Changes all of the driver's settings back to their default values.
+     *
+     * It is good to call this near the beginning of your program to ensure that
+     * there are no settings left over from an earlier time that might affect the
+     * operation of the driver. */
+    void resetSettings()
+    {
+        wr = cr0 = cr1 = cr2 = cr3 = 0;
+        applySettings();
+    }
+
+    /*! Reads back the SPI configuration registers written since the last
+     * verification and verifies that they are equal to the cached copies stored
+     * in this class.
+     *
+     * If nothing was written, nothing is read.  A mismatch makes the next
+     * changes rewrite all registers.
+     *
+     * @return 1 if the settings from the device match the cached copies, 0 if
+     * they do not. */
+    bool verifySettings()
+    {
+        return verifyRegs(unverifiedRegs);
+    }
+
+    /*! Reads back all SPI configuration registers from the device and verifies
+     * that they are equal to the cached copies stored in this class.
+     *
+     * This can be used to verify that the driver is powered on and has not lost
+     * them due to a power failure.  The STATUS registers are not verified
+     * because they are not cached. */
+    bool verifyAllSettings()
+    {
+        return verifyRegs(ALL_REGS);
+    }
+
+    /*! Re-writes the cached settings stored in this class to the device.
+     *
+     * You should not normally need to call this function because settings are
+     * written to the device whenever they are changed.  However, if
+     * verifySettings() returns false (due to a power interruption, for
+     * instance), then you could use applySettings() to get the device's settings
+     * back into the desired state. */
+    void applySettings()
+    {
+        knownRegs = 0;
+        writeChangedRegs();
+    }
+
+    /*! Holds back the register writes of the following setters until
+     * endUpdate(), so several settings in one register cost one write. */
+    void beginUpdate()
+    {
+        updating = true;
+    }
+
+    /*! Writes the registers changed since beginUpdate(). */
+    void endUpdate()
+    {
+        updating = false;
+        writeChangedRegs();
+    }
+
+    /*! Like endUpdate() followed by verifySettings(), with the writes and the
+     * reads queued as one batch that runs in the background.
+     *
+     * done is called from interrupt context when the batch is complete, then
+     * finishUpdate() returns the result of the verification.  Returns false
+     * without writing anything if another batch is still running. */
+    bool endUpdateAsync(Callback<void()> done)
+    {
+        static const uint8_t order[5] = { CR2_BIT, WR_BIT, CR0_BIT, CR1_BIT, CR3_BIT };
+        static const uint8_t addresses[5] = { WR, CR0, CR1, CR2, CR3 };
+
+        if (driver.isBusy()) { return false; }
+
+        updating = false;
+        asyncValues[WR_BIT] = wr;
+        asyncValues[CR0_BIT] = cr0;
+        asyncValues[CR1_BIT] = cr1;
+        asyncValues[CR2_BIT] = cr2;
+        asyncValues[CR3_BIT] = cr3;
+
+        // CR2 first, as in writeChangedRegs()
+        int count = 0;
+        for (uint8_t i = 0; i < 5; i++)
+        {
+            uint8_t bit = order[i];
+            if ((knownRegs & (1 << bit)) && (shadow[bit] == asyncValues[bit])) { continue; }
+
+            asyncTx[count][0] = 0x80 | addresses[bit];
+            asyncTx[count][1] = asyncValues[bit];
+            count++;
+            shadow[bit] = asyncValues[bit];
+            knownRegs |= (1 << bit);
+            unverifiedRegs |= (1 << bit);
+        }
+
+        asyncReadFrom = count;
+        asyncVerifyRegs = unverifiedRegs;
+        unverifiedRegs = 0;
+        for (uint8_t bit = 0; bit < 5; bit++)
+        {
+            if (!(asyncVerifyRegs & (1 << bit))) { continue; }
+
+            asyncTx[count][0] = addresses[bit];
+            asyncTx[count][1] = 0;
+            count++;
+        }
+
+        driver.transferAsync(&asyncTx[0][0], &asyncRx[0][0], count, done);
+        return true;
+    }
+
+    /*! Returns true while a batch of background accesses is running. */
+    bool isBusy()
+    {
+        return driver.isBusy();
+    }
+
+    /*! Returns whether the registers read back by endUpdateAsync() match
+     * what was written, waiting for the batch if it is still running. */
+    bool finishUpdate()
+    {
+        bool match = true;
+        int frame = asyncReadFrom;
+
+        driver.waitIdle();
+        if (driver.asyncFailed()) { match = false; }
+        for (uint8_t bit = 0; bit < 5; bit++)
+        {
+            if (!(asyncVerifyRegs & (1 << bit))) { continue; }
+
+            if (asyncRx[frame][1] != asyncValues[bit])
+            {
+                match = false;
+            }
+            frame++;
+        }
+
+        if (!match)
+        {
+            // The device lost its settings, or was never written
+            knownRegs = 0;
+        }
+        return match;
+    }
+
+    /*! Sets the MOTEN bit to 1, enabling the driver.
+     *
+     * The driver will now drive current through the motor coils. */
+    void enableDriver()
+    {
+        cr2 |= 0b10000000;
+        writeChangedRegs();
+    }
+
+    /*! Sets the MOTEN bit to 0, disabling the driver.
+     *
+     * The driver will no longer drive current through the motor coils.  Note
+     * that the NXT/DIR pins are still active. */
+    void disableDriver()
+    {
+        cr2 &= ~0b10000000;
+        writeChangedRegs();
+    }
+
+    /*! Sets the per-coil current limit to the requested value, in milliamps.
+     *
+     * The current limit is specified in table 13 of the AMIS-30543 datasheet
+     * as a value between 132 mA and 3000 mA, so the value passed to this
+     * function is rounded down to the nearest value from that table. */
+    void setCurrentMilliamps(uint16_t current)
+    {
+        // This comes from Table 13 of the AMIS-30543 datasheet.
+        uint8_t code = 0;
+        if      (current >= 3000) { code = 0b11001; }
+        else if (current >= 2845) { code = 0b11000; }
+        else if (current >= 2700) { code = 0b10111; }
+        else if (current >= 2440) { code = 0b10110; }
+        else if (current >= 2240) { code = 0b10101; }
+        else if (current >= 2070) { code = 0b10100; }
+        else if (current >= 1850) { code = 0b10011; }
+        else if (current >= 1695) { code = 0b10010; }
+        else if (current >= 1520) { code = 0b10001; }
+        else if (current >= 1405) { code = 0b10000; }
+        else if (current >= 1260) { code = 0b01111; }
+        else if (current >= 1150) { code = 0b01110; }
+        else if (current >= 1060) { code = 0b01101; }
+        else if (current >=  955) { code = 0b01100; }
+        else if (current >=  870) { code = 0b01011; }
+        else if (current >=  780) { code = 0b01010; }
+        else if (current >=  715) { code = 0b01001; }
+        else if (current >=  640) { code = 0b01000; }
+        else if (current >=  585) { code = 0b00111; }
+        else if (current >=  540) { code = 0b00110; }
+        else if (current >=  485) { code = 0b00101; }
+        else if (current >=  445) { code = 0b00100; }
+        else if (current >=  395) { code = 0b00011; }
+        else if (current >=  355) { code = 0b00010; }
+        else if (current >=  245) { code = 0b00001; }
+
+        cr0 = (cr0 & 0b11100000) | code;
+        writeCR0();
+    }
+
+    /*! Reads the current microstep position from the SR3 and SR4 registers.
+     *
+     * The return value is a number between 0 and 511 representing the
+     * position of the motor in its current electrical cycle, in units of
+     * 1/128 of a full step. */
+    uint16_t readPosition()
+    {
+        uint8_t sr3 = readStatusReg(SR3);
+        uint8_t sr4 = readStatusReg(SR4);
+        return ((uint16_t)sr3 << 2) | (sr4 & 3);
+    }
+
+    /*! Configures the direction that the motor will move when it receives a
+     * step pulse.
+     *
+     * This is implemented by writing the DIRCTRL bit, which has the same effect
+     * as the DIR pin, except that it is inverted.  If the DIR pin is not used,
+     * you can call this function to switch the direction of the motor. */
+    void setDirection(bool value)
+    {
+        if (value)
+        {
+            cr1 |= 0x80;
+        }
+        else
+        {
+            cr1 &= ~0x80;
+        }
+        writeCR1();
+    }
+
+    /*! Returns the cached value of the motor direction.
+     *
+     * This does not perform any SPI communication with the driver. */
+    bool getDirection()
+    {
+        return cr1 >> 7 & 1;
+    }
+
+    /*! Sets the stepping mode.
+     *
+     * The argument to this function should be one of the members of the
+     * #stepMode enum.
+     *
+     * If an invalid argument is given, the driver will be set to 1/32
+     * microstepping. */
+    void setStepMode(uint8_t mode)
+    {
+        // Pick 1/32 micro-step by default.
+        uint8_t esm = 0b000;
+        uint8_t sm = 0b000;
+
+        // The order of these cases matches the order in Table 12 of the
+        // AMIS-30543 datasheet.
+        switch(mode)
+        {
+        case MicroStep32: sm = 0b000; break;
+        case MicroStep16: sm = 0b001; break;
+        case MicroStep8: sm = 0b010; break;
+        case MicroStep4: sm = 0b011; break;
+        case CompensatedHalf: sm = 0b100; break; /* a.k.a. MicroStep2 */
+        case UncompensatedHalf: sm = 0b101; break;
+        case UncompensatedFull: sm = 0b110; break;
+        case MicroStep128: esm = 0b001; break;
+        case MicroStep64: esm = 0b010; break;
+        case CompensatedFullTwoPhaseOn: esm = 0b011; break;  /* a.k.a. MicroStep1 */
+        case CompensatedFullOnePhaseOn: esm = 0b100; break;
+        }
+
+        cr0 = (cr0 & ~0b11100000) | (sm << 5);
+        cr3 = (cr3 & ~0b111) | esm;
+        writeCR0();
+        writeCR3();
+    }
+
+    /*! Puts the driver into sleep mode.
+     *
+     * This is implemented by setting the SLP bit in CR2. */
+    void sleep()
+    {
+        cr2 |= (1 << 6);
+        writeChangedRegs();
+    }
+
+    /*! Takes the driver out of sleep mode, by clearing the SLP bit in CR2. */
+    void sleepStop()
+    {
+        cr2 &= ~(1 << 6);
+        writeChangedRegs();
+    }
+
+    /*! Configures the driver to step on the rising edge of the NXT pin.
+     *
+     * This is the default behavior of the driver. */
+    void stepOnRisingEdge()
+    {
+        cr1 &= ~0b01000000;
+        writeCR1();
+    }
+
+    /*! Configures the driver to step on the falling edge of the NXT pin. */
+    void stepOnFallingEdge()
+    {
+        cr1 |= 0b01000000;
+        writeCR1();
+    }
+
+    /*! Doubles the PWM frequency of the motor coil outputs (PWMF = 1). */
+    void setPwmFrequencyDouble()
+    {
+        cr1 |= (1 << 3);
+        writeCR1();
+    }
+
+    /*! Sets the PWM frequency of the motor coil outputs back to the default
+     * of 22.8 kHz (PWMF = 0). */
+    void setPwmFrequencyDefault()
+    {
+        cr1 &= ~(1 << 3);
+        writeCR1();
+    }
+
+    /*! Enables jitter on the PWM frequency of the motor coil outputs
+     * (PWMJ = 1).  This can reduce electromagnetic interference. */
+    void setPwmJitterOn()
+    {
+        cr1 |= (1 << 2);
+        writeCR1();
+    }
+
+    /*! Disables jitter on the PWM frequency of the motor coil outputs
+     * (PWMJ = 0).  This is the default setting. */
+    void setPwmJitterOff()
+    {
+        cr1 &= ~(1 << 2);
+        writeCR1();
+    }
+
+    /*! Sets the slope of the PWM voltage transitions (EMC[1:0]).
+     *
+     * 0 = 200 V/us, 1 = 140 V/us, 2 = 70 V/us, 3 = 35 V/us. */
+    void setPwmSlope(uint8_t emc)
+    {
+        cr1 = (cr1 & ~0b11) | (emc & 0b11);
+        writeCR1();
+    }
+
+    /*! Sets the speed load angle (SLA) gain to 0.5 (SLAG = 0).  This is the
+     * default setting. */
+    void setSlaGainDefault()
+    {
+        cr2 &= ~(1 << 5);
+        writeChangedRegs();
+    }
+
+    /*! Sets the speed load angle (SLA) gain to 0.25 (SLAG = 1). */
+    void setSlaGainHalf()
+    {
+        cr2 |= (1 << 5);
+        writeChangedRegs();
+    }
+
+    /*! Disables SLA transparency (SLAT = 0).  This is the default setting. */
+    void setSlaTransparencyOff()
+    {
+        cr2 &= ~(1 << 4);
+        writeChangedRegs();
+    }
+
+    /*! Enables SLA transparency (SLAT = 1), so the SLA pin shows the
+     * back-EMF voltage during the whole measurement window instead of only
+     * the final sampled value. */
+    void setSlaTransparencyOn()
+    {
+        cr2 |= (1 << 4);
+        writeChangedRegs();
+    }
+
+    /*! Reads the status flags from register SR0.
+     *
+     * These flags are not latched, which means they will be cleared as soon as
+     * the condition causing them is no longer detected.  See the AMIS-30543
+     * datasheet for more information.
+     *
+     * This function returns the raw value of SR0, with the parity bit cleared.
+     * The return value can be tested against the bitmasks in the
+     * #nonLatchedStatusFlag enum.
+     *
+     * Example usage:
+     * ```
+     * if (stepper.readNonLatchedStatusFlags() & AMIS30543::OPENX)
+     * {
+     *   // Open coil X detected
+     * }
+     * ```
+     */
+    uint16_t readNonLatchedStatusFlags()
+    {
+        return readStatusReg(SR0) & 0b1111100;
+    }
+
+    /*! Reads the latched status flags from registers SR1 and SR2.  They are
+     * cleared as a side effect.
+     *
+     * The return value can be tested against the bitmasks in the
+     * #latchedStatusFlag enum. */
+    uint16_t readLatchedStatusFlagsAndClear()
+    {
+        uint8_t sr1 = readStatusReg(SR1);
+        uint8_t sr2 = readStatusReg(SR2);
+        return (sr2 << 8) | sr1;
+    }
+
+    /*! Reads all status registers, SR0 to SR4, as one batch in the background,
+     * which clears the latched flags.
+     *
+     * done is called from interrupt context when the batch is complete, then
+     * asyncNonLatchedStatusFlags(), asyncLatchedStatusFlags() and
+     * asyncPosition() return what was read.  Returns false if another batch is
+     * still running. */
+    bool readStatusAsync(Callback<void()> done)
+    {
+        static const uint8_t addresses[5] = { SR0, SR1, SR2, SR3, SR4 };
+
+        if (driver.isBusy()) { return false; }
+
+        for (uint8_t i = 0; i < 5; i++)
+        {
+            asyncTx[i][0] = addresses[i];
+            asyncTx[i][1] = 0;
+        }
+        driver.transferAsync(&asyncTx[0][0], &asyncRx[0][0], 5, done);
+        return true;
+    }
+
+    /*! Returns true if the last batch did not complete, then the values of
+     * readStatusAsync() and endUpdateAsync() are not valid. */
+    bool asyncFailed()
+    {
+        return driver.asyncFailed();
+    }
+
+    /*! Returns the number of batches aborted because they did not complete. */
+    uint32_t getTimeoutCount()
+    {
+        return driver.getTimeoutCount();
+    }
+
+    /*! Flags read by readStatusAsync(), like readNonLatchedStatusFlags(). */
+    uint16_t asyncNonLatchedStatusFlags()
+    {
+        driver.waitIdle();
+        return asyncRx[0][1] & 0x7F & 0b1111100;
+    }
+
+    /*! Flags read by readStatusAsync(), like
+     * readLatchedStatusFlagsAndClear(). */
+    uint16_t asyncLatchedStatusFlags()
+    {
+        driver.waitIdle();
+        return ((asyncRx[2][1] & 0x7F) << 8) | (asyncRx[1][1] & 0x7F);
+    }
+
+    /*! Position read by readStatusAsync(), like readPosition(). */
+    uint16_t asyncPosition()
+    {
+        driver.waitIdle();
+        return ((uint16_t)(asyncRx[3][1] & 0x7F) << 2) | (asyncRx[4][1] & 0x7F & 3);
+    }
+
+protected:
+
+    /*! Bits of knownRegs and unverifiedRegs, also the index in shadow. */
+    enum regBit
+    {
+        WR_BIT = 0,
+        CR0_BIT = 1,
+        CR1_BIT = 2,
+        CR2_BIT = 3,
+        CR3_BIT = 4,
+        ALL_REGS = 0b11111,
+    };
+
+    uint8_t wr, cr0, cr1, cr2, cr3;
+
+    // Values last written to the device, valid for the bits in knownRegs
+    uint8_t shadow[5];
+    uint8_t knownRegs;
+    uint8_t unverifiedRegs;
+    bool updating;
+
+    // Batch of the background accesses, at most every register written and
+    // read back
+    uint8_t asyncTx[10][2];
+    uint8_t asyncRx[10][2];
+    uint8_t asyncValues[5];
+    uint8_t asyncVerifyRegs;
+    int asyncReadFrom;
+
+    /*! Writes a register if its value differs from the one last written,
+     * unless the writes are held back by beginUpdate(). */
+    void writeChanged(uint8_t bit, uint8_t address, uint8_t value)
+    {
+        if (updating) { return; }
+        if ((knownRegs & (1 << bit)) && (shadow[bit] == value)) { return; }
+
+        driver.writeReg(address, value);
+        shadow[bit] = value;
+        knownRegs |= (1 << bit);
+        unverifiedRegs |= (1 << bit);
+    }
+
+    /*! Writes the registers whose settings differ from the device. */
+    void writeChangedRegs()
+    {
+        // Because of power cycling, the CR2 register should be written first
+        // because it contains the MOTEN bit, and we do not want the motor to
+        // be enabled before the other settings are applied.
+        writeCR2();
+
+        writeWR();
+        writeCR0();
+        writeCR1();
+        writeCR3();
+    }
+
+    /*! Reads back the given registers and compares them with the settings. */
+    bool verifyRegs(uint8_t regs)
+    {
+        static const uint8_t addresses[5] = { WR, CR0, CR1, CR2, CR3 };
+        const uint8_t values[5] = { wr, cr0, cr1, cr2, cr3 };
+        bool match = true;
+
+        for (uint8_t bit = 0; bit < 5; bit++)
+        {
+            if ((regs & (1 << bit)) && (driver.readReg(addresses[bit]) != values[bit]))
+            {
+                match = false;
+            }
+        }
+
+        unverifiedRegs &= ~regs;
+        if (!match)
+        {
+            // The device lost its settings, or was never written
+            knownRegs = 0;
+        }
+        return match;
+    }
+
+    /*! Reads a status register and returns the lower 7 bits (the parity bit
+     * is set to 0 in the return value). */
+    uint8_t readStatusReg(uint8_t address)
+    {
+        // Mask off the parity bit.
+        // (Later we might add code here to check the parity
+        // bit and record errors.)
+        return driver.readReg(address) & 0x7F;
+    }
+
+    /*! Writes the cached value of the WR register to the device. */
+    void writeWR()
+    {
+        writeChanged(WR_BIT, WR, wr);
+    }
+
+    /*! Writes the cached value of the CR0 register to the device. */
+    void writeCR0()
+    {
+        writeChanged(CR0_BIT, CR0, cr0);
+    }
+
+    /*! Writes the cached value of the CR1 register to the device. */
+    void writeCR1()
+    {
+        writeChanged(CR1_BIT, CR1, cr1);
+    }
+
+    /*! Writes the cached value of the CR2 register to the device. */
+    void writeCR2()
+    {
+        writeChanged(CR2_BIT, CR2, cr2);
+    }
+
+    /*! Writes the cached value of the CR3 register to the device. */
+    void writeCR3()
+    {
+        writeChanged(CR3_BIT, CR3, cr3);
+    }
+
+public:
+    /*! This object handles all the communication with the AMIS-30543.  It is
+     * only marked as public for the purpose of testing this library; you should
+     * not use it in your code. */
+    AMIS30543SPI driver;
+};
+
+#endif
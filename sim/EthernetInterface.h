@@ -0,0 +1,49 @@
+#ifndef SIM_ETHERNETINTERFACE_H
+#define SIM_ETHERNETINTERFACE_H
+/*! Host replacement for EthernetInterface.h, used by the host tests of ComConnection.
+ *
+ *  TCPSocket is the server side of a scripted client. The bytes the client sends are
+ *  queued as segments with deliver() and recv() never hands out more than the rest
+ *  of one segment, as the stack does with its receive buffers. send() takes at most
+ *  sendWindow bytes, everything it took is kept in sent. */
+#include "mbed.h"
+#include <deque>
+#include <string>
+
+typedef int32_t nsapi_error_t;
+typedef unsigned int nsapi_size_t;
+typedef int32_t nsapi_size_or_error_t;
+
+#define NSAPI_ERROR_OK 0
+#define NSAPI_ERROR_WOULD_BLOCK -3001
+#define NSAPI_ERROR_NO_SOCKET -3005
+
+class TCPSocket {
+
+    public:
+        TCPSocket();
+
+        void set_blocking(bool blocking);
+        void sigio(Callback<void()> func);
+        nsapi_error_t close();
+        nsapi_size_or_error_t recv(void* data, nsapi_size_t size);
+        nsapi_size_or_error_t send(const void* data, nsapi_size_t size);
+
+        // Queues a segment from the client
+        void deliver(const std::string& segment);
+        // Orderly shutdown by the client once the queued segments are received
+        void shutdown();
+        // Bytes queued which recv() has not handed out yet
+        size_t pending();
+
+        std::string sent;
+        size_t sendWindow;
+
+    private:
+        std::deque<std::string> _segments;
+        size_t _offset; // Into the first segment
+        bool _shutdown;
+        bool _closed;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "mbed.h"
+
+static us_timestamp_t _now_us = 0;
+static Ticker* _tickers = NULL;
+static Callback<void(PinName, int)> _pinChange;
+static uint32_t _cycleOffset = 0;
+
+uint32_t SystemCoreClock = 120000000;
+
+static DWT_Type _dwt;
+static CoreDebug_Type _coreDebug;
+DWT_Type* const DWT = &_dwt;
+CoreDebug_Type* const CoreDebug = &_coreDebug;
+
+SimCycleCounter::operator uint32_t() const {
+    return (uint32_t)(_now_us * (SystemCoreClock / 1000000)) - _cycleOffset;
+}
+
+SimCycleCounter& SimCycleCounter::operator=(uint32_t value) {
+    _cycleOffset = (uint32_t)(_now_us * (SystemCoreClock / 1000000)) - value;
+    return *this;
+}
+
+us_timestamp_t sim::now_us() {
+    return _now_us;
+}
+
+bool sim::runNext() {
+    Ticker* first = NULL;
+
+    for (Ticker* ticker = _tickers; ticker != NULL; ticker = ticker->_nextTicker) {
+        if ((first == NULL) || (ticker->_next_us < first->_next_us)) first = ticker;
+    }
+    if (first == NULL) return false;
+
+    _now_us = first->_next_us;
+    // Reschedule before the handler runs, it may detach or re-attach the ticker
+    if (first->_oneShot) {
+        first->detach();
+    } else {
+        first->_next_us += first->_delay_us;
+    }
+    first->_function.call();
+
+    return true;
+}
+
+void sim::run() {
+    while (runNext());
+}
+
+void sim::onPinChange(Callback<void(PinName, int)> func) {
+    _pinChange = func;
+}
+
+Ticker::Ticker() :
+    _oneShot(false),
+    _delay_us(0),
+    _next_us(0),
+    _attached(false),
+    _nextTicker(NULL) {
+
+}
+
+Ticker::~Ticker() {
+    detach();
+}
+
+void Ticker::attach_us(Callback<void()> func, us_timestamp_t t) {
+    _function = func;
+    _delay_us = t;
+    _next_us = _now_us + t;
+
+    if (!_attached) {
+        _attached = true;
+        _nextTicker = _tickers;
+        _tickers = this;
+    }
+}
+
+void Ticker::detach() {
+    if (!_attached) return;
+
+    for (Ticker** next = &_tickers; *next != NULL; next = &(*next)->_nextTicker) {
+        if (*next == this) {
+            *next = _nextTicker;
+            break;
+        }
+    }
+    _attached = false;
+    _nextTicker = NULL;
+}
+
+Timer::Timer() :
+    _start_us(0),
+    _elapsed_us(0),
+    _running(false) {
+
+}
+
+void Timer::start() {
+    if (_running) return;
+
+    _start_us = _now_us;
+    _running = true;
+}
+
+void Timer::stop() {
+    if (!_running) return;
+
+    _elapsed_us += _now_us - _start_us;
+    _running = false;
+}
+
+void Timer::reset() {
+    _start_us = _now_us;
+    _elapsed_us = 0;
+}
+
+us_timestamp_t Timer::read_high_resolution_us() {
+    return _elapsed_us + (_running ? _now_us - _start_us : 0);
+}
+
+DigitalOut::DigitalOut(PinName pin) :
+    _pin(pin),
+    _value(0) {
+
+}
+
+DigitalOut::DigitalOut(PinName pin, int value) :
+    _pin(pin),
+    _value(value) {
+
+}
+
+void DigitalOut::write(int value) {
+    value = (value != 0);
+    if (value == _value) return;
+
+    _value = value;
+    if (_pinChange) _pinChange(_pin, value);
+}
+
+int DigitalOut::read() {
+    return _value;
+}
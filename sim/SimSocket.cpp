@@ -0,0 +1,63 @@
+#include "EthernetInterface.h"
+
+TCPSocket::TCPSocket() :
+    sendWindow((size_t)-1),
+    _offset(0),
+    _shutdown(false),
+    _closed(false) {
+}
+
+void TCPSocket::set_blocking(bool /* blocking */) {
+}
+
+void TCPSocket::sigio(Callback<void()> /* func */) {
+}
+
+nsapi_error_t TCPSocket::close() {
+    _closed = true;
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_size_or_error_t TCPSocket::recv(void* data, nsapi_size_t size) {
+    if (_closed) return NSAPI_ERROR_NO_SOCKET;
+    if (_segments.empty()) return _shutdown ? 0 : NSAPI_ERROR_WOULD_BLOCK;
+
+    const std::string& segment = _segments.front();
+    size_t length = segment.size() - _offset;
+    if (length > size) length = size;
+
+    memcpy(data, segment.data() + _offset, length);
+    _offset += length;
+    if (_offset == segment.size()) {
+        _segments.pop_front();
+        _offset = 0;
+    }
+    return (nsapi_size_or_error_t)length;
+}
+
+nsapi_size_or_error_t TCPSocket::send(const void* data, nsapi_size_t size) {
+    if (_closed) return NSAPI_ERROR_NO_SOCKET;
+
+    size_t length = (size < sendWindow) ? size : sendWindow;
+    if (length == 0) return NSAPI_ERROR_WOULD_BLOCK;
+
+    sent.append((const char*)data, length);
+    sendWindow -= length;
+    return (nsapi_size_or_error_t)length;
+}
+
+void TCPSocket::deliver(const std::string& segment) {
+    if (!segment.empty()) _segments.push_back(segment);
+}
+
+void TCPSocket::shutdown() {
+    _shutdown = true;
+}
+
+size_t TCPSocket::pending() {
+    size_t length = 0;
+    for (size_t i = 0; i < _segments.size(); i++) {
+        length += _segments[i].size();
+    }
+    return length - _offset;
+}
@@ -0,0 +1,375 @@
+#include "gtest/gtest.h"
+#include "mbed.h"
+#include "ComConnection.h"
+#include <random>
+#include <string>
+#include <vector>
+
+/*! Replays client streams through ComConnection.
+ *
+ *  A script of plain, batch and extended frames, including streamed ones, is
+ *  delivered in segments split at every byte boundary and in random chunks. The
+ *  frames are handled as SyringePump::dispatchFrames() does and the decoded messages
+ *  and the replies have to be the same for every split. */
+
+#define HEADER_LENGTH 3
+// Largest streamed payload of the script
+#define STREAM_BUFFER_SIZE 4096
+
+// Messages of the script
+#define TEST_FID_ECHO 1 // Replies the sum of the payload bytes
+#define TEST_FID_BATCH 2 // Sub-messages, one reply with all their replies
+#define TEST_FID_READ 3 // Replies as many bytes as the first two payload bytes say
+#define TEST_FID_REFUSE 4 // Refused, streamed payloads are dropped
+#define TEST_ERROR 1
+
+// Message as the handlers see it
+struct Decoded {
+    int version;
+    uint16_t requestId;
+    uint8_t fid;
+    std::string payload;
+
+    bool operator==(const Decoded& other) const {
+        return (version == other.version) && (requestId == other.requestId) && (fid == other.fid)
+            && (payload == other.payload);
+    }
+};
+
+static void PrintTo(const Decoded& d, std::ostream* os) {
+    *os << "version " << d.version << ", request " << d.requestId << ", fid " << (int)d.fid << ", "
+        << d.payload.size() << " payload bytes";
+}
+
+static std::string message(uint8_t packetLength, uint8_t fid, uint8_t error, const std::string& body) {
+    std::string m;
+    m += (char)packetLength;
+    m += (char)fid;
+    m += (char)error;
+    return m + body;
+}
+
+/*! Reply of a single message, without the extension */
+static std::string replyTo(uint8_t fid, const std::string& payload) {
+    if (fid == TEST_FID_READ) {
+        int length = (uint8_t)payload[0] | ((uint8_t)payload[1] << 8);
+        std::string body;
+        for (int i = HEADER_LENGTH; i < length; i++) {
+            body += (char)(i * 7);
+        }
+        return message((uint8_t)length, fid, 0, body);
+    }
+    if (fid == TEST_FID_REFUSE) return message(HEADER_LENGTH, fid, TEST_ERROR, "");
+
+    uint32_t sum = 0;
+    for (size_t i = 0; i < payload.size(); i++) {
+        sum += (uint8_t)payload[i];
+    }
+    return message(HEADER_LENGTH + sizeof(sum), fid, 0, std::string((const char*)&sum, sizeof(sum)));
+}
+
+static std::string extension(uint16_t requestId, uint32_t length) {
+    ComExtension extension = {COM_EXTENDED_MARKER, COM_EXTENDED_VERSION, requestId, length};
+    return std::string((const char*)&extension, sizeof(ComExtension));
+}
+
+/*! Client stream with the messages and replies it has to result in */
+class Script {
+
+    public:
+        Script() : frames(0) {}
+
+        void plain(uint8_t fid, const std::string& payload) {
+            stream += message(HEADER_LENGTH + payload.size(), fid, 0, payload);
+            Decoded d = {0, 0, fid, payload};
+            messages.push_back(d);
+            replies += replyTo(fid, payload);
+            frames++;
+        }
+
+        // The packetLength of the message is a wrong one, the extension has the length
+        void extended(uint16_t requestId, uint8_t fid, const std::string& payload) {
+            stream += extension(requestId, HEADER_LENGTH + payload.size()) + message(0x55, fid, 0, payload);
+            // Streamed payloads of refused messages are dropped unseen
+            if ((fid != TEST_FID_REFUSE) || (HEADER_LENGTH + payload.size() <= COM_MAX_FRAME_SIZE)) {
+                Decoded d = {COM_EXTENDED_VERSION, requestId, fid, payload};
+                messages.push_back(d);
+            }
+            extendedReply(requestId, replyTo(fid, payload));
+            frames++;
+        }
+
+        void plainBatch(const std::vector<std::pair<uint8_t, std::string> >& subs) {
+            std::string payload = batch(0, 0, subs);
+            stream += message(HEADER_LENGTH + payload.size(), TEST_FID_BATCH, 0, payload);
+            replies += batchReply;
+            frames++;
+        }
+
+        void extendedBatch(uint16_t requestId, const std::vector<std::pair<uint8_t, std::string> >& subs) {
+            std::string payload = batch(COM_EXTENDED_VERSION, requestId, subs);
+            stream += extension(requestId, HEADER_LENGTH + payload.size()) + message(0, TEST_FID_BATCH, 0, payload);
+            extendedReply(requestId, batchReply);
+            frames++;
+        }
+
+        std::string stream;
+        std::vector<Decoded> messages;
+        std::string replies;
+        int frames;
+
+    private:
+        // Replies longer than a plain frame have a packetLength of 0
+        void extendedReply(uint16_t requestId, std::string reply) {
+            if (reply.size() > COM_MAX_FRAME_SIZE) reply[0] = 0;
+            replies += extension(requestId, reply.size()) + reply;
+        }
+
+        std::string batch(int version, uint16_t requestId, const std::vector<std::pair<uint8_t, std::string> >& subs) {
+            std::string payload;
+            std::string subReplies;
+
+            Decoded d = {version, requestId, TEST_FID_BATCH, ""};
+            size_t index = messages.size();
+            messages.push_back(d);
+
+            for (size_t i = 0; i < subs.size(); i++) {
+                payload += message(HEADER_LENGTH + subs[i].second.size(), subs[i].first, 0, subs[i].second);
+                Decoded sub = {version, requestId, subs[i].first, subs[i].second};
+                messages.push_back(sub);
+                subReplies += replyTo(subs[i].first, subs[i].second);
+            }
+            messages[index].payload = payload;
+            batchReply = message(HEADER_LENGTH + subReplies.size(), TEST_FID_BATCH, 0, subReplies);
+
+            return payload;
+        }
+
+        std::string batchReply;
+};
+
+static std::string pattern(size_t length, int seed) {
+    std::string s;
+    for (size_t i = 0; i < length; i++) {
+        s += (char)(i * 31 + seed);
+    }
+    return s;
+}
+
+static std::string readLength(int length) {
+    std::string s;
+    s += (char)(length & 0xFF);
+    s += (char)(length >> 8);
+    return s;
+}
+
+/*! Plain frames up to the largest one, batches and extended frames, buffered and
+ *  streamed, with short and long replies */
+static Script standardScript() {
+    Script script;
+    std::vector<std::pair<uint8_t, std::string> > subs;
+    subs.push_back(std::make_pair((uint8_t)TEST_FID_ECHO, pattern(10, 1)));
+    subs.push_back(std::make_pair((uint8_t)TEST_FID_READ, readLength(20)));
+    subs.push_back(std::make_pair((uint8_t)TEST_FID_ECHO, std::string()));
+
+    script.plain(TEST_FID_ECHO, "");
+    script.plain(TEST_FID_ECHO, pattern(1, 2));
+    script.plain(TEST_FID_ECHO, pattern(50, 3));
+    script.plain(TEST_FID_ECHO, pattern(COM_MAX_FRAME_SIZE - HEADER_LENGTH, 4));
+    script.plain(TEST_FID_READ, readLength(200));
+    script.plainBatch(subs);
+    script.extended(1, TEST_FID_ECHO, pattern(30, 5));
+    script.extended(2, TEST_FID_READ, readLength(600));
+    script.extended(3, TEST_FID_ECHO, pattern(COM_MAX_FRAME_SIZE - HEADER_LENGTH, 6));
+    script.extended(4, TEST_FID_ECHO, pattern(COM_MAX_FRAME_SIZE - HEADER_LENGTH + 1, 7));
+    script.extended(5, TEST_FID_ECHO, pattern(2000, 8));
+    script.extended(6, TEST_FID_REFUSE, pattern(700, 9));
+    script.extended(7, TEST_FID_REFUSE, pattern(10, 10));
+    script.extendedBatch(8, subs);
+    script.plain(TEST_FID_ECHO, pattern(40, 11));
+
+    return script;
+}
+
+/*! Server side of the replay */
+class Server {
+
+    public:
+        Server() {
+            connection.open(&socket, Callback<void()>());
+        }
+
+        /*! Receives, handles and replies until nothing moves anymore. The client reads
+         *  up to window bytes of replies per round */
+        void service(size_t window) {
+            for (;;) {
+                size_t pending = socket.pending();
+                size_t sent = socket.sent.size();
+
+                ASSERT_TRUE(connection.receive());
+                int handled = dispatchFrames();
+                socket.sendWindow = window;
+                ASSERT_TRUE(connection.flush());
+
+                if ((handled == 0) && (socket.pending() == pending) && (socket.sent.size() == sent)) return;
+            }
+        }
+
+        TCPSocket socket;
+        ComConnection connection;
+        std::vector<Decoded> messages;
+
+    private:
+        /*! Same order of checks as SyringePump::dispatchFrames() */
+        int dispatchFrames() {
+            int handled = 0;
+            char* data;
+
+            while ((data = connection.nextFrame()) != NULL) {
+                if (connection.txFree() < COM_MIN_TX_FREE) {
+                    connection.holdBack();
+                    break;
+                }
+
+                if (connection.isStreamed()) {
+                    if (!connection.isStreaming()) {
+                        bool refused = (uint8_t)data[1] == TEST_FID_REFUSE;
+                        connection.startStream(refused ? NULL : _streamBuffer);
+                        if (refused) {
+                            int mark = connection.beginReply();
+                            std::string reply = replyTo(TEST_FID_REFUSE, "");
+                            connection.send(reply.data(), reply.size());
+                            connection.endReply(mark);
+                        }
+                    }
+                    if (!connection.streamDone()) break;
+                }
+
+                if (!connection.isStreamed() || !connection.streamDropped()) {
+                    int mark = connection.beginReply();
+                    handleMessage(data);
+                    connection.endReply(mark);
+                }
+
+                connection.frameDone();
+                handled++;
+            }
+
+            return handled;
+        }
+
+        void handleMessage(const char* data) {
+            uint32_t length = connection.messageLength();
+            int version = connection.frameVersion();
+            uint16_t requestId = (version != 0) ? connection.requestId() : 0;
+            std::string payload;
+
+            if (connection.isStreamed()) {
+                EXPECT_EQ((uint8_t)data[0], 0);
+                payload.assign(_streamBuffer, length - HEADER_LENGTH);
+            } else {
+                EXPECT_EQ((uint8_t)data[0], length);
+                payload.assign(data + HEADER_LENGTH, length - HEADER_LENGTH);
+            }
+
+            uint8_t fid = data[1];
+            Decoded d = {version, requestId, fid, payload};
+            messages.push_back(d);
+
+            if (fid != TEST_FID_BATCH) {
+                std::string reply = replyTo(fid, payload);
+                connection.send(reply.data(), reply.size());
+                return;
+            }
+
+            // Sub-messages are not framed again, as in SyringePump::runBatch()
+            int mark = connection.replyMark();
+            connection.send(data, HEADER_LENGTH);
+            for (size_t i = 0; i < payload.size(); i += (uint8_t)payload[i]) {
+                std::string sub = payload.substr(i + HEADER_LENGTH, (uint8_t)payload[i] - HEADER_LENGTH);
+                Decoded subDecoded = {version, requestId, (uint8_t)payload[i + 1], sub};
+                messages.push_back(subDecoded);
+
+                std::string reply = replyTo(payload[i + 1], sub);
+                connection.send(reply.data(), reply.size());
+            }
+            *connection.replyAt(mark) = (char)connection.replyLength(mark);
+            connection.replyAt(mark)[2] = 0;
+        }
+
+        char _streamBuffer[STREAM_BUFFER_SIZE];
+};
+
+static void expectReplayed(Server* server, const Script& script) {
+    ComTiming timing;
+    server->connection.readTiming(&timing);
+
+    EXPECT_EQ(server->socket.pending(), 0u);
+    EXPECT_TRUE(server->connection.txEmpty());
+    EXPECT_EQ(timing.commands, (uint32_t)script.frames);
+    ASSERT_EQ(server->messages, script.messages);
+    ASSERT_TRUE(server->socket.sent == script.replies);
+}
+
+// The whole stream in one segment, larger than the receive ring
+TEST(ComConnectionTest, oneSegment) {
+    Script script = standardScript();
+    Server server;
+
+    server.socket.deliver(script.stream);
+    server.service((size_t)-1);
+    expectReplayed(&server, script);
+}
+
+// Every byte in its own segment, each one handled as it comes
+TEST(ComConnectionTest, byteByByte) {
+    Script script = standardScript();
+    Server server;
+
+    for (size_t i = 0; i < script.stream.size(); i++) {
+        server.socket.deliver(script.stream.substr(i, 1));
+        server.service((size_t)-1);
+    }
+    expectReplayed(&server, script);
+}
+
+// Two segments, split at every byte boundary
+TEST(ComConnectionTest, everySplit) {
+    Script script = standardScript();
+
+    for (size_t split = 1; split < script.stream.size(); split++) {
+        Server server;
+
+        server.socket.deliver(script.stream.substr(0, split));
+        server.service((size_t)-1);
+        server.socket.deliver(script.stream.substr(split));
+        server.service((size_t)-1);
+        SCOPED_TRACE(split);
+        expectReplayed(&server, script);
+        if (HasFatalFailure()) return;
+    }
+}
+
+// Random segments, received right away or queued up behind each other, and a client
+// which reads its replies in random pieces
+TEST(ComConnectionTest, randomChunks) {
+    Script script = standardScript();
+    std::mt19937 random(1);
+
+    for (int run = 0; run < 500; run++) {
+        Server server;
+        std::uniform_int_distribution<size_t> chunk(1, (run % 2) ? 16 : 600);
+        std::uniform_int_distribution<size_t> window(1, 400);
+
+        for (size_t i = 0; i < script.stream.size();) {
+            size_t length = chunk(random);
+            server.socket.deliver(script.stream.substr(i, length));
+            i += length;
+            if (random() % 2) server.service(window(random));
+        }
+        server.service((size_t)-1);
+        SCOPED_TRACE(run);
+        expectReplayed(&server, script);
+        if (HasFatalFailure()) return;
+    }
+}
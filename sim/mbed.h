@@ -0,0 +1,139 @@
+#ifndef SIM_MBED_H
+#define SIM_MBED_H
+/*! Host replacement for mbed.h, used by the motion simulator.
+ *
+ *  Only the parts of the mbed API the motion code touches are provided. Callback
+ *  and the pin names come from the mbed-os UNITTESTS stubs, Ticker, Timeout, Timer
+ *  and DigitalOut run on a virtual microsecond clock which only advances when sim::run() fires
+ *  the next ticker, so a move of any length runs as fast as the host can step it. */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "PinNames.h"
+#include "platform/Callback.h"
+#include "platform/mbed_critical.h"
+
+typedef uint64_t us_timestamp_t;
+
+// Core clock and debug registers, the DWT cycle counter follows the virtual clock
+extern uint32_t SystemCoreClock;
+
+class SimCycleCounter {
+
+    public:
+        operator uint32_t() const;
+        SimCycleCounter& operator=(uint32_t value);
+};
+
+typedef struct {
+    uint32_t CTRL;
+    SimCycleCounter CYCCNT;
+} DWT_Type;
+
+typedef struct {
+    uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type* const DWT;
+extern CoreDebug_Type* const CoreDebug;
+
+#define DWT_CTRL_CYCCNTENA_Msk (1u << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1u << 24)
+
+namespace mbed {
+class Ticker;
+}
+
+namespace sim {
+    // Virtual time in microseconds since the start of the simulation
+    us_timestamp_t now_us();
+    // Fires the earliest attached ticker, returns false when none is attached
+    bool runNext();
+    // Fires tickers until none is attached any more
+    void run();
+    // Called on every level change of a DigitalOut
+    void onPinChange(mbed::Callback<void(PinName, int)> func);
+}
+
+namespace mbed {
+
+/*! Periodic interrupt on the virtual clock */
+class Ticker {
+
+    public:
+        Ticker();
+        ~Ticker();
+
+        void attach_us(Callback<void()> func, us_timestamp_t t);
+        void detach();
+
+    protected:
+        bool _oneShot;
+
+    private:
+        friend bool sim::runNext();
+
+        Callback<void()> _function;
+        us_timestamp_t _delay_us;
+        us_timestamp_t _next_us; // Virtual time of the next interrupt
+        bool _attached;
+        Ticker* _nextTicker; // List of attached tickers
+};
+
+/*! Single interrupt on the virtual clock */
+class Timeout : public Ticker {
+
+    public:
+        Timeout() {
+            _oneShot = true;
+        }
+};
+
+/*! Stopwatch on the virtual clock */
+class Timer {
+
+    public:
+        Timer();
+
+        void start();
+        void stop();
+        void reset();
+        us_timestamp_t read_high_resolution_us();
+
+    private:
+        us_timestamp_t _start_us; // Virtual time the running period started at
+        us_timestamp_t _elapsed_us; // Time of the previous periods
+        bool _running;
+};
+
+/*! Output pin, level changes are reported to the simulation */
+class DigitalOut {
+
+    public:
+        DigitalOut(PinName pin);
+        DigitalOut(PinName pin, int value);
+
+        void write(int value);
+        int read();
+
+        DigitalOut& operator=(int value) {
+            write(value);
+            return *this;
+        }
+
+        operator int() {
+            return read();
+        }
+
+    private:
+        PinName _pin;
+        int _value;
+};
+
+}
+
+using namespace mbed;
+
+#endif
@@ -0,0 +1,234 @@
+#include "mbed.h"
+#include "MotionController.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+/*! Host side simulation of a dispense.
+ *
+ *  Runs MotionController and the Ticker step generator on the virtual clock, records
+ *  the time of every STEP pulse and writes a velocity/acceleration trace. The pump
+ *  parameters default to the ones of SyringePump::initHardware(). With -A the same
+ *  move runs on several axes of a shared StepScheduler, the trace is of the first.
+ *  With -C the flow rate is changed with changeSpeed() once the move reaches the step
+ *  given with -s, as FID_SET_FLOW_RATE does between two step interrupts. */
+
+#define SIM_STEP_PIN ((PinName)0)
+
+static std::vector<us_timestamp_t> stepTimes;
+static int axisSteps[STEP_SCHEDULER_MAX_AXES];
+static int movesDone = 0;
+
+// Steps of the traced axis which end a constant speed interval
+static MotionController* tracedController = NULL;
+static long cruiseFirst = -1;
+static long cruiseLast = -1;
+// Steps of the traced axis after the speed change which ramp to the new speed
+static bool speedChanged = false;
+static long changeRampSteps = 0;
+
+static void stepPinChange(PinName pin, int value) {
+    if (!value) return;
+
+    if (pin == SIM_STEP_PIN) {
+        stepTimes.push_back(sim::now_us());
+        // The interval to this step was handed out in RAMP_MAX
+        if (tracedController->getState() == MotionController::RAMP_MAX) {
+            if (cruiseFirst < 0) cruiseFirst = stepTimes.size() - 1;
+            cruiseLast = stepTimes.size() - 1;
+        }
+        if (speedChanged && ((tracedController->getState() == MotionController::RAMP_UP)
+            || (tracedController->getState() == MotionController::RAMP_SLOW))) {
+            changeRampSteps++;
+        }
+    }
+    if ((int)pin < STEP_SCHEDULER_MAX_AXES) axisSteps[pin]++;
+}
+
+static void pumpingDone() {
+    movesDone++;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -V volume_ml          Dispensed volume (200)\n"
+        "  -F flowrate_mlpmin    Flow rate (10)\n"
+        "  -D diameter_mm        Syringe diameter (30)\n"
+        "  -P profile            0 = trapezoidal, 1 = S-curve (0)\n"
+        "  -m stepMode           Microsteps per full step (32)\n"
+        "  -r stepsPerRev        Full steps per revolution (400)\n"
+        "  -l leadScrewPitch_mm  Lead screw pitch (1.5)\n"
+        "  -a acc_RevPerSecSec   Acceleration (0.1)\n"
+        "  -d dec_RevPerSecSec   Deceleration (0.1)\n"
+        "  -o file               Write the trace as CSV\n"
+        "  -n steps              Steps per trace sample (1)\n"
+        "  -A axes               Axes on a shared step scheduler, 0 = Ticker step generator (0)\n"
+        "  -C flowrate_mlpmin    Flow rate to change to during the move, 0 = none (0)\n"
+        "  -s step               Step of the flow rate change, 0 = middle of the move (0)\n",
+        name);
+}
+
+/*! Writes one line per n steps: velocity over the last n steps and acceleration
+ *  between the last two samples */
+static void writeTrace(FILE* file, int n, float stepsPer_ml) {
+    fprintf(file, "step,time_s,interval_us,velocity_steps_s,flowrate_mlpmin,accel_steps_s2\n");
+
+    double prevVelocity = 0.0;
+    double prevTime = 0.0;
+
+    for (size_t i = n; i < stepTimes.size(); i += n) {
+        double dt = (double)(stepTimes[i] - stepTimes[i - n]);
+        double velocity = n * 1e6 / dt;
+        double time = (stepTimes[i] + stepTimes[i - n]) / 2e6; // Middle of the window
+        double accel = (i > (size_t)n) ? (velocity - prevVelocity) / (time - prevTime) : 0.0;
+
+        fprintf(file, "%zu,%.6f,%llu,%.3f,%.5f,%.3f\n", i + 1, stepTimes[i] / 1e6,
+            (unsigned long long)(stepTimes[i] - stepTimes[i - 1]), velocity,
+            velocity / stepsPer_ml * 60.0, accel);
+
+        prevVelocity = velocity;
+        prevTime = time;
+    }
+}
+
+int main(int argc, char** argv) {
+    float volume_ml = 200.0f;
+    float flowrate_mlpmin = 10.0f;
+    float syringeDiameter_mm = 30.0f;
+    int profile = MotionController::PROFILE_TRAPEZOIDAL;
+    int stepMode = 32;
+    int stepsPerRev = 400;
+    float leadScrewPitch_mm = 1.5f;
+    float acc_RevPerSecSec = 0.1f;
+    float dec_RevPerSecSec = 0.1f;
+    const char* traceFile = NULL;
+    int traceStep = 1;
+    int axes = 0;
+    float changeFlowrate_mlpmin = 0.0f;
+    long changeStep = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "V:F:D:P:m:r:l:a:d:o:n:A:C:s:h")) != -1) {
+        switch (opt) {
+            case 'V': volume_ml = atof(optarg); break;
+            case 'F': flowrate_mlpmin = atof(optarg); break;
+            case 'D': syringeDiameter_mm = atof(optarg); break;
+            case 'P': profile = atoi(optarg); break;
+            case 'm': stepMode = atoi(optarg); break;
+            case 'r': stepsPerRev = atoi(optarg); break;
+            case 'l': leadScrewPitch_mm = atof(optarg); break;
+            case 'a': acc_RevPerSecSec = atof(optarg); break;
+            case 'd': dec_RevPerSecSec = atof(optarg); break;
+            case 'o': traceFile = optarg; break;
+            case 'n': traceStep = atoi(optarg); break;
+            case 'A': axes = atoi(optarg); break;
+            case 'C': changeFlowrate_mlpmin = atof(optarg); break;
+            case 's': changeStep = atol(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (traceStep < 1) traceStep = 1;
+    if ((axes < 0) || (axes > STEP_SCHEDULER_MAX_AXES)) {
+        fprintf(stderr, "At most %d axes\n", STEP_SCHEDULER_MAX_AXES);
+        return 1;
+    }
+
+    // Same conversion as SyringePump::calcStepsPer_ml()
+    float microstepsPerRev = (float)(stepMode * stepsPerRev);
+    double syringeArea_mm2 = M_PI * pow(syringeDiameter_mm / 2.0, 2);
+    double stepsPer_ml = ((1000.0 / syringeArea_mm2) * microstepsPerRev) / leadScrewPitch_mm;
+
+    double steps = volume_ml * stepsPer_ml;
+    float stepsPerSec = flowrate_mlpmin / 60.0 * stepsPer_ml;
+    float accel = acc_RevPerSecSec * microstepsPerRev;
+    float decel = dec_RevPerSecSec * microstepsPerRev;
+    if (changeStep <= 0) changeStep = (long)(steps / 2);
+
+    StepScheduler stepScheduler;
+    std::vector<MotionController*> motionControllers;
+    if (axes == 0) {
+        motionControllers.push_back(new MotionController(SIM_STEP_PIN));
+    } else {
+        for (int axis = 0; axis < axes; axis++) {
+            motionControllers.push_back(new MotionController((PinName)(SIM_STEP_PIN + axis), &stepScheduler));
+        }
+    }
+    tracedController = motionControllers[0];
+    sim::onPinChange(callback(stepPinChange));
+    stepTimes.reserve((size_t)steps + 1);
+
+    for (size_t i = 0; i < motionControllers.size(); i++) {
+        motionControllers[i]->callbackPumpingDone = callback(pumpingDone);
+        motionControllers[i]->configure(steps, stepsPerSec, accel, decel, profile);
+        if (!motionControllers[i]->createMotionProfile()) {
+            fprintf(stderr, "Motion profile cannot be created\n");
+            return 1;
+        }
+    }
+
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < motionControllers.size(); i++) {
+        motionControllers[i]->run();
+    }
+    float cruiseStepsPerSec = changeFlowrate_mlpmin / 60.0 * stepsPer_ml;
+    int changed = -1;
+    while (sim::runNext()) {
+        if ((changeFlowrate_mlpmin > 0) && (changed < 0) && ((long)stepTimes.size() >= changeStep)) {
+            changed = 1;
+            for (size_t i = 0; i < motionControllers.size(); i++) {
+                if (!motionControllers[i]->changeSpeed(cruiseStepsPerSec)) changed = 0;
+            }
+            // The cruise rate is taken at the new speed
+            speedChanged = true;
+            cruiseFirst = -1;
+            cruiseLast = -1;
+        }
+    }
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - wallStart;
+
+    bool moveDone = (movesDone == (int)motionControllers.size());
+    printf("steps:          %zu of %d\n", stepTimes.size(), (int)(steps + 0.5));
+    printf("volume error:   %+.3f microsteps\n", stepTimes.size() - steps);
+    for (int axis = 1; axis < axes; axis++) {
+        printf("axis %d steps:   %d\n", axis, axisSteps[axis]);
+    }
+    printf("move done:      %s\n", moveDone ? "yes" : "no");
+    if (changed >= 0) {
+        printf("speed change:   %s at step %ld, %ld steps ramping\n", changed ? "accepted" : "refused", changeStep,
+            changeRampSteps);
+    }
+    if (!stepTimes.empty()) {
+        us_timestamp_t minInterval = stepTimes[0];
+        for (size_t i = 1; i < stepTimes.size(); i++) {
+            us_timestamp_t interval = stepTimes[i] - stepTimes[i - 1];
+            if (interval < minInterval) minInterval = interval;
+        }
+        printf("virtual time:   %.3f s (%.3f s at constant flow)\n", stepTimes.back() / 1e6, steps / stepsPerSec);
+        printf("min interval:   %llu us\n", (unsigned long long)minInterval);
+    }
+    if ((cruiseFirst > 0) && (cruiseLast > cruiseFirst)) {
+        // Averaged over all constant speed intervals, the virtual clock rounds each
+        // step to a whole microsecond
+        double rate = (cruiseLast - cruiseFirst + 1) * 1e6 / (stepTimes[cruiseLast] - stepTimes[cruiseFirst - 1]);
+        if (changed <= 0) cruiseStepsPerSec = stepsPerSec;
+        printf("cruise rate:    %.4f steps/s (%+.2f ppm over %.3f s)\n", rate, (rate / cruiseStepsPerSec - 1.0) * 1e6,
+            (stepTimes[cruiseLast] - stepTimes[cruiseFirst - 1]) / 1e6);
+    }
+    printf("wall time:      %.1f ms\n", wall.count());
+
+    if (traceFile != NULL) {
+        FILE* file = fopen(traceFile, "w");
+        if (file == NULL) {
+            perror(traceFile);
+            return 1;
+        }
+        writeTrace(file, traceStep, stepsPer_ml);
+        fclose(file);
+    }
+
+    return moveDone ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+#include "gtest/gtest.h"
+#include "mbed.h"
+#include "MotionController.h"
+#include <math.h>
+#include <vector>
+
+/*! Compares the Q24.8 ramp of MotionController with the Austin recurrence
+ *  c(n) = c(n-1) - 2 * c(n-1) / (4n + 1) computed in double precision.
+ *
+ *  The move parameters span the HardwareConfig limits checked by
+ *  SyringePump::setHardwareConfig() and the flow rates accepted by setFlowConfig(). */
+
+// Largest deviation of an interval from the float recurrence (microseconds)
+#define RAMP_TEST_MAX_ERROR_US 0.5
+// Largest relative deviation of long intervals, the float conversion of the first
+// interval dominates there
+#define RAMP_TEST_MAX_ERROR_REL 1e-6
+// The deceleration starts from _c_min, which is rounded down to the Q24.8 resolution.
+// The recurrence keeps that relative error, so it is added to the bound.
+#define RAMP_TEST_RESOLUTION_US (1.0 / (1 << STEP_INTERVAL_FRAC_BITS))
+
+/*! Step generator which hands out the whole move at once */
+class CaptureStepGenerator : public StepGenerator {
+
+    public:
+        virtual bool supports(uint32_t /* minInterval */, uint32_t /* maxInterval */) { return true; }
+        virtual bool fits(uint32_t /* minInterval */, uint32_t /* maxInterval */) { return true; }
+        virtual void start(uint32_t firstInterval) {
+            intervals.push_back(firstInterval);
+            for (;;) {
+                uint32_t c = nextInterval.call();
+                if (c == 0) break;
+                intervals.push_back(c);
+            }
+            moveDone.call();
+        }
+        virtual void stop() {}
+        virtual int pendingSteps() { return 0; }
+
+        std::vector<uint32_t> intervals;
+};
+
+/*! Float version of the ramp of MotionController::createMotionProfile() and
+ *  advanceRamp(). The step limits are derived exactly as there, the intervals are
+ *  kept in double precision microseconds. */
+static std::vector<double> floatRamp(double steps, float stepsPerSec, float accel, float decel) {
+    const double cMax = (double)STEP_INTERVAL_MAX / (1 << STEP_INTERVAL_FRAC_BITS);
+    int totalSteps = (int)(steps + 0.5);
+    int maxSLim = (stepsPerSec * stepsPerSec) / (2.0f * accel);
+    int accelLim = (totalSteps * decel) / (accel + decel);
+    int decelN = (maxSLim < accelLim) ? -(maxSLim) * (accel / decel) : -(totalSteps - accelLim);
+    int decelStart = decelN + totalSteps;
+
+    double c = 1e6 * sqrt(2.0 / accel) * 0.676;
+    double cMin = 1e6 / stepsPerSec;
+    if (c > cMax) c = cMax;
+    if (cMin > cMax) cMin = cMax;
+
+    MotionController::rampState state = MotionController::RAMP_UP;
+    int n = 1;
+    std::vector<double> intervals;
+    intervals.push_back(c);
+
+    for (int step = 1; step < totalSteps; step++) {
+        switch (state) {
+            case MotionController::RAMP_UP:
+                c = c - 2.0 * c / (4 * n + 1);
+                if (step >= decelStart) {
+                    state = MotionController::RAMP_DOWN;
+                    n = decelN;
+                } else if (c <= cMin) {
+                    state = MotionController::RAMP_MAX;
+                    c = cMin;
+                }
+                break;
+            case MotionController::RAMP_MAX:
+                if (step >= decelStart) {
+                    state = MotionController::RAMP_DOWN;
+                    n = decelN;
+                }
+                c = cMin;
+                break;
+            default:
+                if (n < 0) c = c + 2.0 * c / -(4 * n + 1);
+                if (c > cMax) c = cMax;
+                break;
+        }
+        n++;
+        intervals.push_back(c);
+    }
+
+    return intervals;
+}
+
+// Pump configuration, converted to steps as in SyringePump::calcStepsPer_ml()
+struct RampCase {
+    int stepMode;
+    int stepsPerRev;
+    float leadScrewPitch_mm;
+    float acc_RevPerSecSec;
+    float flowrate_mlpmin;
+    double steps;
+};
+
+static void PrintTo(const RampCase& p, std::ostream* os) {
+    *os << "stepMode " << p.stepMode << ", stepsPerRev " << p.stepsPerRev << ", pitch " << p.leadScrewPitch_mm
+        << " mm, " << p.acc_RevPerSecSec << " rev/s^2, " << p.flowrate_mlpmin << " ml/min, " << p.steps << " steps";
+}
+
+class RampTest : public ::testing::TestWithParam<RampCase> {
+};
+
+static int movesDone;
+
+static void pumpingDone() {
+    movesDone++;
+}
+
+static void compareRamp(const RampCase& p, bool calledFromIRQ) {
+    const float syringeDiameter_mm = 30.0f;
+    float microstepsPerRev = (float)(p.stepMode * p.stepsPerRev);
+    double stepsPer_ml = ((1000.0 / (M_PI * pow(syringeDiameter_mm / 2.0, 2))) * microstepsPerRev) / p.leadScrewPitch_mm;
+    float stepsPerSec = p.flowrate_mlpmin / 60.0 * stepsPer_ml;
+    float accel = p.acc_RevPerSecSec * microstepsPerRev;
+
+    CaptureStepGenerator generator;
+    MotionController motionController(&generator);
+    motionController.callbackPumpingDone = callback(pumpingDone);
+    movesDone = 0;
+    motionController.configure(p.steps, stepsPerSec, accel, accel);
+    ASSERT_EQ(motionController.createMotionProfile(calledFromIRQ), 1);
+    motionController.run();
+    ASSERT_EQ(movesDone, 1);
+
+    std::vector<double> expected = floatRamp(p.steps, stepsPerSec, accel, accel);
+    ASSERT_EQ(generator.intervals.size(), (size_t)(p.steps + 0.5));
+    ASSERT_EQ(generator.intervals.size(), expected.size());
+
+    double cMin = fmin(1e6 / stepsPerSec, (double)STEP_INTERVAL_MAX / (1 << STEP_INTERVAL_FRAC_BITS));
+    for (size_t i = 0; i < expected.size(); i++) {
+        double c = (double)generator.intervals[i] / (1 << STEP_INTERVAL_FRAC_BITS);
+        double bound = RAMP_TEST_MAX_ERROR_US + expected[i] * (RAMP_TEST_MAX_ERROR_REL + RAMP_TEST_RESOLUTION_US / cMin);
+        ASSERT_NEAR(c, expected[i], bound) << "step " << i;
+    }
+}
+
+// Ramps replayed from the precomputed tables
+TEST_P(RampTest, tables) {
+    compareRamp(GetParam(), false);
+}
+
+// Ramps computed live in the step interrupt
+TEST_P(RampTest, live) {
+    compareRamp(GetParam(), true);
+}
+
+// Fewest and most steps per mm, slowest and fastest acceleration and flow rate, for
+// triangular and long moves
+static std::vector<RampCase> rampCases() {
+    const int stepModes[][2] = {{1, 200}, {128, 1000}};
+    const float pitches[] = {9.5f, 0.5f};
+    const float accelerations[] = {0.01f, 10.0f};
+    const float flowrates[] = {0.01f, 100.0f};
+    const double moves[] = {50, 5000, 500000};
+    std::vector<RampCase> cases;
+
+    for (int i = 0; i < 2; i++) {
+        for (int a = 0; a < 2; a++) {
+            for (int f = 0; f < 2; f++) {
+                for (int m = 0; m < 3; m++) {
+                    RampCase p = {stepModes[i][0], stepModes[i][1], pitches[i], accelerations[a], flowrates[f], moves[m]};
+                    cases.push_back(p);
+                }
+            }
+        }
+    }
+
+    return cases;
+}
+
+INSTANTIATE_TEST_SUITE_P(HardwareConfig, RampTest, ::testing::ValuesIn(rampCases()));
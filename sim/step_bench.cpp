@@ -0,0 +1,130 @@
+#include "mbed.h"
+#include "MotionController.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+
+/*! Host side benchmark of the step interrupt work.
+ *
+ *  Runs a move which only ramps up and down (no constant speed phase) through a step
+ *  generator which calls the motion controller back to back, and reports the host
+ *  time per step of computing the ramp live (advanceRamp(), as before the ramp
+ *  tables) and of replaying the tables. The absolute numbers are host nanoseconds,
+ *  the cycles of the step interrupt on the target come from FID_GET_STEP_TIMING. */
+
+/*! Step generator which pulls the intervals of the whole move without waiting */
+class BenchStepGenerator : public StepGenerator {
+
+    public:
+        BenchStepGenerator() : steps(0) {}
+
+        virtual bool supports(uint32_t /* minInterval */, uint32_t /* maxInterval */) { return true; }
+        virtual bool fits(uint32_t /* minInterval */, uint32_t /* maxInterval */) { return true; }
+        virtual void start(uint32_t /* firstInterval */) {
+            steps = 1;
+            while (nextInterval.call() != 0) steps++;
+        }
+        virtual void stop() {}
+        virtual int pendingSteps() { return 0; }
+
+        int steps;
+};
+
+static void pumpingDone() {
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -F flowrate_mlpmin    Flow rate at the top of the ramp (10)\n"
+        "  -D diameter_mm        Syringe diameter (30)\n"
+        "  -m stepMode           Microsteps per full step (32)\n"
+        "  -r stepsPerRev        Full steps per revolution (400)\n"
+        "  -l leadScrewPitch_mm  Lead screw pitch (1.5)\n"
+        "  -a acc_RevPerSecSec   Acceleration and deceleration (0.1)\n"
+        "  -R runs               Runs per variant, the fastest one counts (200)\n",
+        name);
+}
+
+/*! Fastest of runs moves in nanoseconds per step, 0 if the profile cannot be created */
+static double benchmark(MotionController* motionController, BenchStepGenerator* generator, int profile,
+    bool live, double steps, float stepsPerSec, float accel, int runs) {
+
+    double best = 0.0;
+
+    for (int run = 0; run < runs; run++) {
+        motionController->configure(steps, stepsPerSec, accel, accel, profile);
+        if (!motionController->createMotionProfile(live)) return 0.0;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        motionController->run();
+        std::chrono::duration<double, std::nano> wall = std::chrono::steady_clock::now() - start;
+
+        double perStep = wall.count() / generator->steps;
+        if ((run == 0) || (perStep < best)) best = perStep;
+    }
+
+    return best;
+}
+
+int main(int argc, char** argv) {
+    float flowrate_mlpmin = 10.0f;
+    float syringeDiameter_mm = 30.0f;
+    int stepMode = 32;
+    int stepsPerRev = 400;
+    float leadScrewPitch_mm = 1.5f;
+    float acc_RevPerSecSec = 0.1f;
+    int runs = 200;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "F:D:m:r:l:a:R:h")) != -1) {
+        switch (opt) {
+            case 'F': flowrate_mlpmin = atof(optarg); break;
+            case 'D': syringeDiameter_mm = atof(optarg); break;
+            case 'm': stepMode = atoi(optarg); break;
+            case 'r': stepsPerRev = atoi(optarg); break;
+            case 'l': leadScrewPitch_mm = atof(optarg); break;
+            case 'a': acc_RevPerSecSec = atof(optarg); break;
+            case 'R': runs = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+
+    // Same conversion as SyringePump::calcStepsPer_ml()
+    float microstepsPerRev = (float)(stepMode * stepsPerRev);
+    double syringeArea_mm2 = M_PI * pow(syringeDiameter_mm / 2.0, 2);
+    double stepsPer_ml = ((1000.0 / syringeArea_mm2) * microstepsPerRev) / leadScrewPitch_mm;
+
+    float stepsPerSec = flowrate_mlpmin / 60.0 * stepsPer_ml;
+    float accel = acc_RevPerSecSec * microstepsPerRev;
+    // Up to the flow rate and straight down again
+    double steps = 2.0 * floor((double)stepsPerSec * stepsPerSec / (2.0 * accel));
+    if (steps < 2) {
+        fprintf(stderr, "The ramp is shorter than a step\n");
+        return 1;
+    }
+
+    BenchStepGenerator generator;
+    MotionController motionController(&generator);
+    motionController.callbackPumpingDone = callback(pumpingDone);
+
+    double live = benchmark(&motionController, &generator, MotionController::PROFILE_TRAPEZOIDAL, true,
+        steps, stepsPerSec, accel, runs);
+    double tables = benchmark(&motionController, &generator, MotionController::PROFILE_TRAPEZOIDAL, false,
+        steps, stepsPerSec, accel, runs);
+    double scurve = benchmark(&motionController, &generator, MotionController::PROFILE_SCURVE, false,
+        steps, stepsPerSec, accel, runs);
+
+    printf("ramp steps:     %.0f (%.0f steps/s, %.0f steps/s^2)\n", steps, stepsPerSec, accel);
+    printf("live ramp:      %.2f ns/step\n", live);
+    printf("ramp tables:    %.2f ns/step (%.2fx)\n", tables, live / tables);
+    printf("S-curve tables: %.2f ns/step (%.2fx)\n", scurve, live / scurve);
+    if (steps > 2 * RAMP_TABLE_MAX_STEPS) {
+        printf("The ramp is longer than %d steps, the tables fall back to the live ramp\n", RAMP_TABLE_MAX_STEPS);
+    }
+
+    return 0;
+}
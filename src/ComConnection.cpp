@@ -0,0 +1,315 @@
+#include "mbed.h"
+#include "ComConnection.h"
+#include <string.h>
+
+// Frames start with the 3 byte message header, its first byte is the frame length
+#define COM_HEADER_LENGTH 3
+#define COM_RX_MASK (COM_RX_BUFFER_SIZE - 1)
+
+#if (COM_RX_BUFFER_SIZE & COM_RX_MASK) != 0
+#error COM_RX_BUFFER_SIZE has to be a power of two
+#endif
+
+/*! Constructor */
+ComConnection::ComConnection() :
+    _socket(NULL),
+    _rxStart(0),
+    _rxLength(0),
+    _frame(NULL),
+    _frameLength(0),
+    _extensionLength(0),
+    _messageLength(0),
+    _streamed(false),
+    _streaming(false),
+    _streamTo(NULL),
+    _streamLength(0),
+    _streamReceived(0),
+    _txLength(0),
+    _frameStart(0),
+    _replyStart(0),
+    _replyPending(false),
+    _replyExtended(false) {
+
+    _clock.start();
+}
+
+void ComConnection::open(TCPSocket* socket, Callback<void()> sigio) {
+    _socket = socket;
+    _rxStart = 0;
+    _rxLength = 0;
+    _frame = NULL;
+    _frameLength = 0;
+    _streaming = false;
+    _txLength = 0;
+    _replyPending = false;
+    memset(&_timing, 0, sizeof(ComTiming));
+
+    _socket->set_blocking(false);
+    _socket->sigio(sigio);
+}
+
+void ComConnection::close() {
+    if (_socket == NULL) return;
+
+    _socket->sigio(Callback<void()>());
+    _socket->close();
+    _socket = NULL;
+}
+
+bool ComConnection::isOpen() {
+    return _socket != NULL;
+}
+
+bool ComConnection::receive() {
+    while (true) {
+        // Free part of the ring up to its end, the part from its beginning is next
+        int end = (_rxStart + _rxLength) & COM_RX_MASK;
+        int space = COM_RX_BUFFER_SIZE - _rxLength;
+        if (space > COM_RX_BUFFER_SIZE - end) space = COM_RX_BUFFER_SIZE - end;
+
+        nsapi_size_or_error_t bytes;
+        bool payload = _streaming && (_streamReceived < _streamLength);
+
+        if (payload) {
+            // Payload of a streamed message, straight into its destination. A dropped
+            // one goes to the free part of the ring, which is empty until it is done
+            uint32_t remaining = _streamLength - _streamReceived;
+            if (_streamTo != NULL) {
+                bytes = _socket->recv(_streamTo + _streamReceived, remaining);
+            } else {
+                bytes = _socket->recv(_rx + end, (remaining < (uint32_t)space) ? remaining : space);
+            }
+        } else if (space > 0) {
+            bytes = _socket->recv(_rx + end, space);
+        } else {
+            // Full, the rest stays with the stack until frames are handled
+            return true;
+        }
+
+        if (bytes == NSAPI_ERROR_WOULD_BLOCK) return true;
+        // 0 is an orderly shutdown by the client
+        if (bytes <= 0) return false;
+
+        if (payload) {
+            _streamReceived += bytes;
+        } else {
+            _rxLength += bytes;
+        }
+    }
+}
+
+/*! Parses the header at the front of the ring. Every complete frame is handed out in
+ *  one piece, in place or as a copy when it wraps around the end of the ring */
+char* ComConnection::nextFrame() {
+    if (_frame == NULL) {
+        if (_rxLength < COM_HEADER_LENGTH) return NULL;
+
+        int extensionLength = 0;
+        uint32_t length = (uint8_t)_rx[_rxStart];
+
+        if (length == COM_EXTENDED_MARKER) {
+            if (_rxLength < (int)sizeof(ComExtension) + COM_HEADER_LENGTH) return NULL;
+
+            peek((char*)&_extension, sizeof(ComExtension));
+            extensionLength = sizeof(ComExtension);
+            length = _extension.length;
+        }
+        // A length below the header is taken as a bare header, the stream stays aligned
+        if (length < COM_HEADER_LENGTH) length = COM_HEADER_LENGTH;
+
+        // Long messages are handed out as soon as their header is there
+        bool streamed = length > COM_MAX_FRAME_SIZE;
+        int frameLength = extensionLength + (streamed ? COM_HEADER_LENGTH : length);
+        if (_rxLength < frameLength) return NULL;
+
+        if (streamed || (_rxStart + frameLength > COM_RX_BUFFER_SIZE)) {
+            peek(_frameCopy, frameLength);
+            _frame = _frameCopy;
+        } else {
+            _frame = _rx + _rxStart;
+        }
+        if (streamed) {
+            // The header leaves the ring now, the payload behind it is taken by startStream()
+            consume(frameLength);
+            frameLength = 0;
+        }
+
+        _frameLength = frameLength;
+        _extensionLength = extensionLength;
+        _messageLength = length;
+        _streamed = streamed;
+        _streaming = false;
+        // The handlers get a plain message
+        if (extensionLength != 0) _frame[extensionLength] = streamed ? 0 : (char)length;
+    }
+
+    _frameStart = _clock.read_high_resolution_us();
+    if (!_replyPending) {
+        _replyPending = true;
+        _replyStart = _frameStart;
+    }
+    return _frame + _extensionLength;
+}
+
+void ComConnection::frameDone() {
+    uint32_t dispatch_us = _clock.read_high_resolution_us() - _frameStart;
+    if (dispatch_us > _timing.maxDispatch_us) _timing.maxDispatch_us = dispatch_us;
+    _timing.commands++;
+
+    consume(_frameLength);
+    _frame = NULL;
+    _frameLength = 0;
+    _streaming = false;
+}
+
+/*! Copies from the front of the ring */
+void ComConnection::peek(char* destination, int length) {
+    int first = COM_RX_BUFFER_SIZE - _rxStart;
+    if (first > length) first = length;
+
+    memcpy(destination, _rx + _rxStart, first);
+    memcpy(destination + first, _rx, length - first);
+}
+
+void ComConnection::consume(int length) {
+    _rxLength -= length;
+    // An empty ring starts over at its beginning, so the next frames do not wrap
+    _rxStart = (_rxLength == 0) ? 0 : ((_rxStart + length) & COM_RX_MASK);
+}
+
+uint32_t ComConnection::messageLength() {
+    return _messageLength;
+}
+
+int ComConnection::frameVersion() {
+    return (_extensionLength != 0) ? _extension.version : 0;
+}
+
+bool ComConnection::isStreamed() {
+    return _streamed;
+}
+
+bool ComConnection::isStreaming() {
+    return _streaming;
+}
+
+/*! The payload which came with the header is copied, the rest is received in place */
+void ComConnection::startStream(void* destination) {
+    _streaming = true;
+    _streamTo = (char*)destination;
+    _streamLength = _messageLength - COM_HEADER_LENGTH;
+
+    uint32_t buffered = _rxLength;
+    if (buffered > _streamLength) buffered = _streamLength;
+    if (_streamTo != NULL) peek(_streamTo, buffered);
+
+    consume(buffered);
+    _streamReceived = buffered;
+}
+
+bool ComConnection::streamDone() {
+    return _streamReceived == _streamLength;
+}
+
+bool ComConnection::streamDropped() {
+    return _streamTo == NULL;
+}
+
+bool ComConnection::send(const void* data, int length) {
+    if (length > txFree()) return false;
+
+    memcpy(_tx + _txLength, data, length);
+    _txLength += length;
+    return true;
+}
+
+int ComConnection::txFree() {
+    return COM_TX_BUFFER_SIZE - _txLength;
+}
+
+bool ComConnection::txEmpty() {
+    return _txLength == 0;
+}
+
+int ComConnection::replyMark() {
+    return _txLength;
+}
+
+int ComConnection::replyLength(int mark) {
+    return _txLength - mark;
+}
+
+char* ComConnection::replyAt(int mark) {
+    return _tx + mark;
+}
+
+void ComConnection::discardReplies(int mark) {
+    _txLength = mark;
+}
+
+uint16_t ComConnection::requestId() {
+    return _extension.requestId;
+}
+
+int ComConnection::beginReply() {
+    if (_extensionLength != 0) return beginReply(_extension.requestId);
+
+    _replyExtended = false;
+    return _txLength;
+}
+
+/*! Reply with an extension, also after the frame is done */
+int ComConnection::beginReply(uint16_t requestId) {
+    int mark = _txLength;
+    ComExtension extension = {COM_EXTENDED_MARKER, COM_EXTENDED_VERSION, requestId, 0};
+
+    _replyExtended = true;
+    send(&extension, sizeof(ComExtension));
+    return mark;
+}
+
+/*! Completes the extension, a frame without a reply gets none */
+void ComConnection::endReply(int mark) {
+    if (!_replyExtended) return;
+
+    int length = replyLength(mark) - sizeof(ComExtension);
+    if (length <= 0) {
+        discardReplies(mark);
+        return;
+    }
+
+    ((ComExtension*)replyAt(mark))->length = length;
+    if (length > COM_MAX_FRAME_SIZE) *replyAt(mark + sizeof(ComExtension)) = 0;
+}
+
+bool ComConnection::flush() {
+    int sent = 0;
+
+    while (sent < _txLength) {
+        nsapi_size_or_error_t bytes = _socket->send(_tx + sent, _txLength - sent);
+
+        if ((bytes == NSAPI_ERROR_WOULD_BLOCK) || (bytes == 0)) break;
+        if (bytes < 0) return false;
+
+        sent += bytes;
+    }
+
+    _txLength -= sent;
+    memmove(_tx, _tx + sent, _txLength);
+
+    if (_replyPending && (_txLength == 0) && (_frame == NULL)) {
+        _replyPending = false;
+        uint32_t turnaround_us = _clock.read_high_resolution_us() - _replyStart;
+        if (turnaround_us > _timing.maxTurnaround_us) _timing.maxTurnaround_us = turnaround_us;
+    }
+    return true;
+}
+
+void ComConnection::readTiming(ComTiming* timing) {
+    memcpy(timing, &_timing, sizeof(ComTiming));
+}
+
+/*! A complete frame has to wait for the send buffer to drain */
+void ComConnection::holdBack() {
+    _timing.heldBack++;
+}
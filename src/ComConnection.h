@@ -0,0 +1,131 @@
+#ifndef COMCONNECTION_H
+#define COMCONNECTION_H
+#include "mbed.h"
+#include "EthernetInterface.h"
+
+// Largest frame, the length field of the message header is one byte
+#define COM_MAX_FRAME_SIZE 255
+// Extended frames start with this byte where plain frames have their length
+#define COM_EXTENDED_MARKER 0
+#define COM_EXTENDED_VERSION 1
+// Received bytes waiting to be handled, holds two largest frames. A ring, its size
+// has to be a power of two
+#define COM_RX_BUFFER_SIZE 512
+// Replies waiting for the network stack
+#define COM_TX_BUFFER_SIZE 1024
+// Free send buffer needed to take a frame: a batch reply of the largest size plus a
+// sub reply which did not fit into it anymore, behind an extension
+#define COM_MIN_TX_FREE (2 * COM_MAX_FRAME_SIZE + (int)sizeof(ComExtension))
+
+// Put in front of a message to make it an extended frame. The message keeps its own
+// header, its packetLength is not used. Later versions keep these fields
+typedef struct {
+    uint8_t marker; // COM_EXTENDED_MARKER
+    uint8_t version; // COM_EXTENDED_VERSION
+    uint16_t requestId; // Echoed in the extension of the reply
+    uint32_t length; // Of the message behind the extension, including its header
+} __attribute__((__packed__)) ComExtension;
+
+typedef struct {
+    uint32_t commands; // Frames handled since the client connected
+    uint32_t maxDispatch_us; // Longest handler
+    uint32_t maxTurnaround_us; // Longest time from taking a frame until the replies are with the stack
+    uint32_t heldBack; // Times frames waited because the client did not read its replies
+} __attribute__((__packed__)) ComTiming;
+
+/*! Non-blocking client connection of the command server.
+ *
+ *  Everything the stack has received is pulled into the receive ring in as few recv
+ *  calls as it takes and handed out frame by frame, frames split over several
+ *  segments are held until they are complete and any number of frames which came in
+ *  one segment are handed out one after the other. Replies are queued in the send buffer and handed to the stack as far as
+ *  it takes them, the rest waits for the next sigio. Nothing here ever blocks.
+ *  The connection measures how long the frames take from being handed out until
+ *  their replies are with the stack.
+ *
+ *  Extended frames carry a ComExtension in front of the message, replies to them get
+ *  one as well. Messages of up to COM_MAX_FRAME_SIZE bytes are buffered like plain
+ *  frames. Longer ones are streamed: the frame is handed out with the message header
+ *  only and its payload is received straight into a destination given with
+ *  startStream(), or dropped. */
+class ComConnection {
+
+    public:
+        ComConnection();
+
+        void open(TCPSocket* socket, Callback<void()> sigio);
+        void close();
+        bool isOpen();
+
+        // Pulls the received bytes from the stack, false once the client is gone
+        bool receive();
+        // Message of the next complete frame, NULL if there is none. Valid until
+        // frameDone(). Messages longer than a plain frame have a packetLength of 0
+        char* nextFrame();
+        void frameDone();
+        uint32_t messageLength();
+        int frameVersion(); // 0 for plain frames
+        uint16_t requestId(); // Of extended frames
+
+        // Payload of a streamed message, the bytes behind its header
+        bool isStreamed();
+        bool isStreaming();
+        void startStream(void* destination); // NULL drops the payload
+        bool streamDone();
+        bool streamDropped();
+
+        // Queues a reply, false if it does not fit
+        bool send(const void* data, int length);
+        int txFree();
+        bool txEmpty();
+        // Replies queued since a mark, to assemble one reply from several handlers.
+        // Marks are valid until the next flush()
+        int replyMark();
+        int replyLength(int mark);
+        char* replyAt(int mark);
+        void discardReplies(int mark);
+        // Wrap the reply to the current frame, with an extension if the frame had one
+        int beginReply();
+        int beginReply(uint16_t requestId);
+        void endReply(int mark);
+        // Hands the queued replies to the stack, false once the client is gone
+        bool flush();
+
+        // Latency of the commands since the client connected
+        void readTiming(ComTiming* timing);
+        void holdBack();
+
+    private:
+        void peek(char* destination, int length);
+        void consume(int length);
+
+        TCPSocket* _socket;
+
+        char _rx[COM_RX_BUFFER_SIZE];
+        int _rxStart;
+        int _rxLength;
+        char* _frame; // Handed out by nextFrame(), NULL if none
+        char _frameCopy[sizeof(ComExtension) + COM_MAX_FRAME_SIZE]; // Of frames which wrap around
+        int _frameLength; // Bytes of the frame in _rx
+        int _extensionLength; // 0 for plain frames
+        ComExtension _extension;
+        uint32_t _messageLength;
+
+        bool _streamed; // The payload is not in _rx
+        bool _streaming;
+        char* _streamTo;
+        uint32_t _streamLength;
+        uint32_t _streamReceived;
+
+        char _tx[COM_TX_BUFFER_SIZE];
+        int _txLength;
+
+        Timer _clock;
+        ComTiming _timing;
+        us_timestamp_t _frameStart;
+        us_timestamp_t _replyStart; // First frame whose replies are not with the stack yet
+        bool _replyPending;
+        bool _replyExtended; // Since beginReply()
+};
+
+#endif
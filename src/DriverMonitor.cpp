@@ -0,0 +1,56 @@
+#include "mbed.h"
+#include "DriverMonitor.h"
+
+/*! Constructor */
+DriverMonitor::DriverMonitor(AMIS30543* driver) :
+    _driver(driver),
+    _sequence(0) {
+
+    memset(&_status, 0, sizeof(DriverStatus));
+}
+
+bool DriverMonitor::poll() {
+    return _driver->readStatusAsync(callback(this, &DriverMonitor::polled));
+}
+
+/*! Copies the snapshot of the last poll, consistent without blocking interrupts */
+void DriverMonitor::read(DriverStatus* status) {
+    uint32_t sequence;
+
+    do {
+        sequence = core_util_atomic_load_u32(&_sequence);
+        memcpy(status, &_status, sizeof(DriverStatus));
+    } while ((sequence & 1) || (core_util_atomic_load_u32(&_sequence) != sequence));
+}
+
+/*! The sticky flags start again from the flags still present */
+void DriverMonitor::clearFaults() {
+    // A poll completing meanwhile must not interleave with this write
+    core_util_critical_section_enter();
+    core_util_atomic_incr_u32(&_sequence, 1);
+    _status.stickyNonLatched = _status.nonLatched;
+    _status.stickyLatched = 0;
+    core_util_atomic_incr_u32(&_sequence, 1);
+    core_util_critical_section_exit();
+}
+
+/*! Completion of a poll, interrupt context */
+void DriverMonitor::polled() {
+    // Aborted, the snapshot keeps the previous poll
+    if (_driver->asyncFailed()) return;
+
+    uint16_t nonLatched = _driver->asyncNonLatchedStatusFlags();
+    uint16_t latched = _driver->asyncLatchedStatusFlags();
+    bool changed = (nonLatched != _status.nonLatched) || (latched != _status.latched);
+
+    core_util_atomic_incr_u32(&_sequence, 1);
+    _status.nonLatched = nonLatched;
+    _status.latched = latched;
+    _status.stickyNonLatched |= nonLatched;
+    _status.stickyLatched |= latched;
+    _status.position = _driver->asyncPosition();
+    _status.polls++;
+    core_util_atomic_incr_u32(&_sequence, 1);
+
+    if (changed && callbackChange) callbackChange();
+}
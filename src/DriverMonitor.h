@@ -0,0 +1,49 @@
+#ifndef DRIVERMONITOR_H
+#define DRIVERMONITOR_H
+#include "mbed.h"
+#include "../lib/AMIS30543/AMIS30543.h"
+
+// Status registers of the stepper driver are read this often unless configured
+#define DRIVER_POLL_DEFAULT_MS 100
+#define DRIVER_POLL_MAX_MS 60000
+
+typedef struct {
+    uint16_t nonLatched; // SR0 of the last poll, AMIS30543::nonLatchedStatusFlag
+    uint16_t latched; // SR1 and SR2 of the last poll, AMIS30543::latchedStatusFlag
+    uint16_t stickyNonLatched; // Flags seen since they were cleared
+    uint16_t stickyLatched;
+    uint16_t position; // Microstep position, 1/128 steps
+    uint32_t polls;
+} DriverStatus;
+
+/*! Background poller of the status registers of an AMIS30543.
+ *
+ *  poll() reads SR0 to SR4 as one background SPI batch. Its completion interrupt
+ *  publishes them as a snapshot and ORs the flags into sticky masks, so latched faults
+ *  are not lost to the read which clears them, whoever reads the snapshot. The
+ *  snapshot is guarded by a sequence counter instead of a critical section, readers
+ *  retry if a poll completed while they copied it and never hold off the step
+ *  interrupt. */
+class DriverMonitor {
+
+    public:
+        DriverMonitor(AMIS30543* driver);
+
+        // Starts a poll, false if the driver is busy with other accesses
+        bool poll();
+        void read(DriverStatus* status);
+        void clearFaults();
+
+        // Called from the completion interrupt when the flags of a poll differ from the
+        // previous one. It must not block or access the SPI, only post to an event queue
+        Callback<void()> callbackChange;
+
+    private:
+        void polled();
+
+        AMIS30543* _driver;
+        volatile uint32_t _sequence; // Odd while the snapshot is written
+        DriverStatus _status;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "mbed.h"
+#include "FtmStepGenerator.h"
+
+#if defined(TARGET_K64F)
+#include "hal/pinmap.h"
+#include "dma_api.h"
+#include "fsl_clock.h"
+
+FtmStepGenerator* FtmStepGenerator::_instance = NULL;
+
+/*! Adds a tick count to a compare value, wrapping with the FTM counter */
+static inline uint32_t addTicks(uint32_t value, uint32_t ticks) {
+    value += ticks;
+    if (value >= FTM_STEP_PERIOD) value -= FTM_STEP_PERIOD;
+    return value;
+}
+
+/*! Constructor, the FTM and the DMA channel are set up on first use. Only a single
+ *  generator on FTM_STEP_PIN may exist, see available() */
+FtmStepGenerator::FtmStepGenerator(PinName stepPin) :
+    _stepPin(stepPin),
+    _initialised(false),
+    _dmaChannel(DMA_ERROR_OUT_OF_CHANNELS) {
+
+    _instance = this;
+}
+
+bool FtmStepGenerator::available(PinName stepPin) {
+    return (stepPin == FTM_STEP_PIN) && (_instance == NULL);
+}
+
+void FtmStepGenerator::init() {
+    _initialised = true;
+
+    // DMA channel triggered by the compare match of the STEP channel
+    dma_init();
+    _dmaChannel = dma_channel_allocate(FTM_STEP_DMA_REQUEST);
+    if (_dmaChannel == DMA_ERROR_OUT_OF_CHANNELS) return;
+
+    edma_config_t dmaConfig;
+    EDMA_GetDefaultConfig(&dmaConfig);
+    EDMA_Init(DMA0, &dmaConfig);
+    EDMA_CreateHandle(&_dmaHandle, DMA0, _dmaChannel);
+    EDMA_SetCallback(&_dmaHandle, &FtmStepGenerator::dmaCallback, this);
+
+    ftm_config_t ftmConfig;
+    FTM_GetDefaultConfig(&ftmConfig);
+    FTM_Init(FTM_STEP_BASE, &ftmConfig);
+    // TPM compatible mode, CnV writes take effect on the next counter tick
+    FTM_STEP_BASE->MODE = FTM_MODE_WPDIS_MASK;
+
+    // Overflow interrupt, detects the end of the move
+    NVIC_SetVector(FTM_STEP_IRQ, (uint32_t)&FtmStepGenerator::ftmInterrupt);
+    NVIC_EnableIRQ(FTM_STEP_IRQ);
+}
+
+/*! Picks the smallest prescaler which fits the longest interval into the counter period */
+bool FtmStepGenerator::supports(uint32_t minInterval, uint32_t maxInterval) {
+    if (!_initialised) init();
+    if (_dmaChannel == DMA_ERROR_OUT_OF_CHANNELS) return false;
+
+    uint32_t busClock = CLOCK_GetFreq(kCLOCK_BusClk);
+
+    for (uint32_t prescale = 0; prescale <= 7; prescale++) {
+        uint32_t ticksPerUs = (uint32_t)(((uint64_t)(busClock >> prescale) << 16) / 1000000u);
+        uint64_t maxTicks = ((uint64_t)maxInterval * ticksPerUs) >> (16 + STEP_INTERVAL_FRAC_BITS);
+        if (maxTicks + 1 >= FTM_STEP_PERIOD) continue;
+
+        uint32_t pulseTicks = (FTM_STEP_PULSE_US * ticksPerUs + 0xFFFF) >> 16;
+        if (pulseTicks < 2) pulseTicks = 2;
+        uint64_t minTicks = ((uint64_t)minInterval * ticksPerUs) >> (16 + STEP_INTERVAL_FRAC_BITS);
+        // The falling edge and its DMA transfer have to fit in between two steps
+        if (minTicks < 2 * pulseTicks) return false;
+
+        _prescale = prescale;
+        _ticksPerUs = ticksPerUs;
+        _pulseTicks = pulseTicks;
+        return true;
+    }
+
+    return false;
+}
+
+/*! Checks the intervals against the prescaler picked for the running move */
+bool FtmStepGenerator::fits(uint32_t minInterval, uint32_t maxInterval) {
+    if ((!_initialised) || (_dmaChannel == DMA_ERROR_OUT_OF_CHANNELS)) return false;
+
+    uint64_t maxTicks = ((uint64_t)maxInterval * _ticksPerUs) >> (16 + STEP_INTERVAL_FRAC_BITS);
+    uint64_t minTicks = ((uint64_t)minInterval * _ticksPerUs) >> (16 + STEP_INTERVAL_FRAC_BITS);
+
+    return (maxTicks + 1 < FTM_STEP_PERIOD) && (minTicks >= 2 * _pulseTicks);
+}
+
+/*! Converts a Q24.8 interval to timer ticks, the fraction of a tick is carried to the next step */
+uint32_t FtmStepGenerator::toTicks(uint32_t interval) {
+    uint64_t ticks = (uint64_t)interval * _ticksPerUs + _frac;
+    _frac = (uint32_t)(ticks & 0xFFFFFF);
+    return (uint32_t)(ticks >> (16 + STEP_INTERVAL_FRAC_BITS));
+}
+
+/*! Queues steps into the ring buffer, each step takes a falling edge and the
+ *  rising edge of the following step */
+void FtmStepGenerator::fill(int first, int count) {
+    for (int i = first; i < first + count; i += 2) {
+        if (_last) {
+            _buffer[i] = FTM_STEP_PARK;
+            _buffer[i + 1] = FTM_STEP_PARK;
+            continue;
+        }
+
+        _buffer[i] = addTicks(_rise, _pulseTicks);
+        _queued++;
+
+        uint32_t interval = nextInterval.call();
+        if (interval == 0) {
+            // Park the channel once the last falling edge is out
+            _last = true;
+            _buffer[i + 1] = FTM_STEP_PARK;
+            _lastEntry = _fillPass * FTM_STEP_BUFFER_SIZE + i + 2;
+        } else {
+            _rise = addTicks(_rise, toTicks(interval));
+            _buffer[i + 1] = _rise;
+        }
+    }
+}
+
+/*! Number of compare values the DMA has loaded since the start of the move */
+int FtmStepGenerator::entriesTransferred() {
+    int wraps = _wraps;
+    int remaining = DMA0->TCD[_dmaChannel].CITER_ELINKNO & DMA_CITER_ELINKNO_CITER_MASK;
+    // Major loop completed but not counted by the DMA interrupt yet
+    if (DMA0->TCD[_dmaChannel].CSR & DMA_CSR_DONE_MASK) wraps++;
+    return wraps * FTM_STEP_BUFFER_SIZE + (FTM_STEP_BUFFER_SIZE - remaining);
+}
+
+void FtmStepGenerator::start(uint32_t firstInterval) {
+    FTM_Type* base = FTM_STEP_BASE;
+
+    stop();
+
+    _frac = 0;
+    _queued = 0;
+    _wraps = 0;
+    _fillPass = 0;
+    _last = false;
+    _lastEntry = 0;
+    _refillIndex = 0;
+
+    // The counter starts from 0, the first step is out after firstInterval
+    _rise = toTicks(firstInterval);
+    fill(0, FTM_STEP_BUFFER_SIZE);
+
+    // Free running counter, toggle on compare match and request DMA
+    base->SC = FTM_SC_PS(_prescale);
+    base->CNTIN = 0;
+    base->MOD = FTM_STEP_PERIOD - 1;
+    base->CNT = 0;
+    base->CONTROLS[FTM_STEP_CHANNEL].CnSC = FTM_CnSC_MSA_MASK | FTM_CnSC_ELSA_MASK | FTM_CnSC_CHIE_MASK | FTM_CnSC_DMA_MASK;
+    base->CONTROLS[FTM_STEP_CHANNEL].CnV = _rise;
+    base->OUTINIT = 0;
+    base->MODE |= FTM_MODE_INIT_MASK;
+
+    // Ring buffer to CnV, one compare value per request
+    edma_transfer_config_t transferConfig;
+    EDMA_PrepareTransfer(&transferConfig, _buffer, sizeof(uint32_t),
+        (void*)&base->CONTROLS[FTM_STEP_CHANNEL].CnV, sizeof(uint32_t),
+        sizeof(uint32_t), sizeof(_buffer), kEDMA_MemoryToPeripheral);
+    EDMA_SetTransferConfig(DMA0, _dmaChannel, &transferConfig, NULL);
+    DMA0->TCD[_dmaChannel].SLAST = -(int32_t)sizeof(_buffer);
+    DMA0->CDNE = DMA_CDNE_CDNE(_dmaChannel);
+    EDMA_EnableChannelInterrupts(DMA0, _dmaChannel, kEDMA_MajorInterruptEnable | kEDMA_HalfInterruptEnable);
+    EDMA_StartTransfer(&_dmaHandle);
+
+    // Hand the STEP pin over to the FTM and go
+    pin_function(_stepPin, FTM_STEP_PIN_FUNCTION);
+    base->SC |= FTM_SC_TOIE_MASK;
+    FTM_StartTimer(base, kFTM_SystemClock);
+}
+
+void FtmStepGenerator::stop() {
+    if ((!_initialised) || (_dmaChannel == DMA_ERROR_OUT_OF_CHANNELS)) return;
+
+    FTM_Type* base = FTM_STEP_BASE;
+
+    FTM_StopTimer(base);
+    base->SC &= ~FTM_SC_TOIE_MASK;
+    base->CONTROLS[FTM_STEP_CHANNEL].CnSC = 0;
+    EDMA_StopTransfer(&_dmaHandle);
+
+    // Back to GPIO, the pin is held low by the software step generator
+    pin_function(_stepPin, 1);
+}
+
+int FtmStepGenerator::pendingSteps() {
+    if ((!_initialised) || (_dmaChannel == DMA_ERROR_OUT_OF_CHANNELS)) return 0;
+
+    core_util_critical_section_enter();
+    // The DMA loads the falling edge when the rising edge of a step matches
+    int output = (entriesTransferred() + 1) / 2;
+    int pending = _queued - output;
+    core_util_critical_section_exit();
+
+    return (pending > 0) ? pending : 0;
+}
+
+/*! Half or full ring buffer consumed, queues the next steps into the free half */
+void FtmStepGenerator::dmaCallback(edma_handle_t* /* handle */, void* userData, bool /* transferDone */, uint32_t /* tcds */) {
+    FtmStepGenerator* self = (FtmStepGenerator*)userData;
+
+    if (self->_refillIndex == 0) {
+        self->_fillPass++;
+    } else {
+        // End of the major loop, the DMA continues from the start of the buffer
+        DMA0->CDNE = DMA_CDNE_CDNE(self->_dmaChannel);
+        self->_wraps++;
+    }
+
+    self->fill(self->_refillIndex, FTM_STEP_BUFFER_SIZE / 2);
+    self->_refillIndex ^= FTM_STEP_BUFFER_SIZE / 2;
+}
+
+/*! Counter overflow, stops the timer once the last step is out */
+void FtmStepGenerator::ftmInterrupt() {
+    FtmStepGenerator* self = _instance;
+
+    FTM_STEP_BASE->SC &= ~FTM_SC_TOF_MASK;
+
+    if (self->_last && (self->entriesTransferred() >= self->_lastEntry)) {
+        self->stop();
+        self->moveDone.call();
+    }
+}
+
+#endif
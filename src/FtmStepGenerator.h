@@ -0,0 +1,83 @@
+#ifndef FTMSTEPGENERATOR_H
+#define FTMSTEPGENERATOR_H
+#include "mbed.h"
+#include "StepGenerator.h"
+
+#if defined(TARGET_K64F)
+#include "fsl_ftm.h"
+#include "fsl_edma.h"
+
+// STEP pulse on FTM3 channel 0 (PTD0, ALT4)
+#define FTM_STEP_BASE FTM3
+#define FTM_STEP_IRQ FTM3_IRQn
+#define FTM_STEP_CHANNEL kFTM_Chnl_0
+#define FTM_STEP_PIN PTD0
+#define FTM_STEP_PIN_FUNCTION 4
+#define FTM_STEP_DMA_REQUEST kDmaRequestMux0FTM3Channel0
+
+// Compare values streamed by DMA, two per step (rising and falling edge).
+// The refill interrupt fires every half buffer, i.e. every 16 steps
+#define FTM_STEP_BUFFER_SIZE 64
+// The counter wraps at FTM_STEP_PERIOD, a compare value of FTM_STEP_PARK never matches
+#define FTM_STEP_PERIOD 0xFFFFu
+#define FTM_STEP_PARK 0xFFFFu
+// AMIS30543 needs NXT high for at least 2 us
+#define FTM_STEP_PULSE_US 2
+
+/*! Hardware step generation with FlexTimer output compare.
+ *
+ *  The channel toggles the STEP pin on every compare match and each match requests
+ *  a DMA transfer which loads the next compare value from a ring buffer. The edges
+ *  are therefore timed by the FTM alone, the CPU only refills half of the ring
+ *  buffer every 16 steps. */
+class FtmStepGenerator : public StepGenerator {
+
+    public:
+        FtmStepGenerator(PinName stepPin);
+        // Whether a generator can be created for the pin, the FTM serves a single one
+        static bool available(PinName stepPin);
+
+        virtual bool supports(uint32_t minInterval, uint32_t maxInterval);
+        virtual bool fits(uint32_t minInterval, uint32_t maxInterval);
+        virtual void start(uint32_t firstInterval);
+        virtual void stop();
+        virtual int pendingSteps();
+
+    private:
+        void init();
+        void fill(int first, int count);
+        uint32_t toTicks(uint32_t interval);
+        int entriesTransferred();
+
+        // Interrupt handlers
+        static void dmaCallback(edma_handle_t* handle, void* userData, bool transferDone, uint32_t tcds);
+        static void ftmInterrupt();
+        static FtmStepGenerator* _instance;
+
+        PinName _stepPin;
+        bool _initialised;
+        int _dmaChannel;
+        edma_handle_t _dmaHandle;
+
+        // Timer clock
+        uint32_t _prescale;
+        uint32_t _ticksPerUs; // Q16
+        uint32_t _pulseTicks;
+
+        // Ring buffer of compare values
+        uint32_t _buffer[FTM_STEP_BUFFER_SIZE];
+        int _refillIndex;
+
+        // Step bookkeeping
+        uint32_t _rise; // Compare value of the last queued rising edge
+        uint32_t _frac; // Carried fraction of a timer tick, Q24
+        int _queued;
+        int _fillPass; // Pass through the ring buffer the DMA loads the refilled half in
+        volatile int _wraps; // Completed passes through the ring buffer
+        bool _last;
+        int _lastEntry; // Entry that parks the channel after the last step
+};
+
+#endif
+
+#endif
@@ -1,29 +1,63 @@
 #include "debug.h"
 #include "mbed.h"
 #include "MotionController.h"
+#include "FtmStepGenerator.h"
 
-/*! Constructor */
-MotionController::MotionController(PinName stepPin) : 
-    _stepPin(stepPin),
-    _stepperInterruptCb(callback(this, &MotionController::_stepperInterrupt)) {
+/*! Converts a step interval in microseconds to Q24.8 fixed point, saturating at the
+ *  largest interval the ISR recurrence can handle without overflowing */
+static uint32_t intervalToFixed(float c_us) {
+    if (c_us <= 0.0f) return 0;
+    if (c_us >= (float)(STEP_INTERVAL_MAX >> STEP_INTERVAL_FRAC_BITS)) return STEP_INTERVAL_MAX;
+    return (uint32_t)(c_us * (1 << STEP_INTERVAL_FRAC_BITS) + 0.5f);
+}
 
+/*! Constructor, axes which share a step scheduler with other axes do not use the
+ *  FTM. It can only serve a single axis, the one whose STEP pin is FTM_STEP_PIN */
+MotionController::MotionController(PinName stepPin, StepScheduler* stepScheduler) {
+    _hardwareStepGenerator = NULL;
+    if (stepScheduler != NULL) {
+        _softwareStepGenerator = new ScheduledStepGenerator(stepScheduler, stepPin);
+    } else {
+        _softwareStepGenerator = new TickerStepGenerator(stepPin);
+        _softwareStepGenerator->timing = &_stepTiming;
+#if defined(TARGET_K64F)
+        // Other pins and further axes keep the Ticker step generator
+        if (FtmStepGenerator::available(stepPin)) {
+            _hardwareStepGenerator = new FtmStepGenerator(stepPin);
+            _hardwareStepGenerator->nextInterval = callback(this, &MotionController::_nextStep);
+            _hardwareStepGenerator->moveDone = callback(this, &MotionController::_moveDone);
+        }
+#endif
+    }
+    _softwareStepGenerator->nextInterval = callback(this, &MotionController::_nextStep);
+    _softwareStepGenerator->moveDone = callback(this, &MotionController::_moveDone);
+    _stepGenerator = _softwareStepGenerator;
+}
+
+/*! Constructor with a single step generator backend (e.g. a host side fake) */
+MotionController::MotionController(StepGenerator* stepGenerator) :
+    _softwareStepGenerator(stepGenerator),
+    _hardwareStepGenerator(NULL),
+    _stepGenerator(stepGenerator) {
+    
+    _stepGenerator->nextInterval = callback(this, &MotionController::_nextStep);
+    _stepGenerator->moveDone = callback(this, &MotionController::_moveDone);
+    _stepGenerator->timing = &_stepTiming;
 }
 
 /*! Setting the main parameters */
-void MotionController::configure(float steps, float stepsPerSec, float accel, float decel) {
+void MotionController::configure(double steps, float stepsPerSec, float accel, float decel, int profile) {
 	// D(printf("steps = %f \n", steps));
     // D(printf("stepsPerSec = %f \n", stepsPerSec));
     // D(printf("accel = %f \n", accel));
     // D(printf("decel = %f \n", decel));
     
     // Check range and store parameters
-    _steps = (int) (steps + 0.5f); // Desired number of steps
+    _steps = (int) (steps + 0.5); // Desired number of steps
     _speed = stepsPerSec;
     _accel = accel;
     _decel = decel;
-    
-    // Step pin
-    _stepPin = 0;
+    _profile = profile;
         
 }
 
@@ -32,18 +66,27 @@ int MotionController::getState() {
 }
 
 int MotionController::getStepsPerformed() {
-    return _stepsPerformed;
+    // Buffered backends hand out steps ahead of the STEP pin
+    return _stepsPerformed - _stepGenerator->pendingSteps();
 }
 
 int MotionController::getC() {
-    return (int)(_c + 0.5f);
+    return intervalToUs(_c);
+}
+
+/*! Step timing instrumentation of the software step generator */
+StepTiming* MotionController::getStepTiming() {
+    return &_stepTiming;
 }
 
 void MotionController::reset() {
     _stop = 1;
+    _stepGenerator->stop();
 }
 
-int MotionController::createMotionProfile() {
+/*! Creating the motion profile of a move, ramp tables are not built when called from
+ *  an interrupt (e.g. chained flow program segments), the ramp is computed live instead */
+int MotionController::createMotionProfile(bool calledFromIRQ) {
     float alpha = 1.0;
     _stepsPerformed = 0;
     // Starting state
@@ -56,15 +99,16 @@ int MotionController::createMotionProfile() {
     // D(printf("c0 = %f \n", _c0));
     
     _n = 1;
-    _c = _c0 * 0.676f; 
+    _rest = 0;
+    _c = intervalToFixed(_c0 * 0.676f);
     // _accel_until potentially can overflow if acceleration is too small
     // Basically it is a step count value when desired speed is reached
     _max_s_lim = (_speed * _speed) / (2.0f * alpha * _accel);
     // D(printf("_accel_until = %d \n", _max_s_lim));
     // Calculate minimum 'c' value (when the maximum speed is reached)
     //_c_min = _c0 * (sqrt(_max_s_lim + 1.0) - sqrt((float)_max_s_lim));
-    _c_min = (1.0f / _speed) * 1000000.0f;
-    // D(printf("_c_min = %f \n", _c_min));
+    float c_min = (1.0f / _speed) * 1000000.0f;
+    // D(printf("_c_min = %f \n", c_min));
     
     // debug
     /*double _test_max_slim = (_speed * _speed) / (2.0 * alpha * _accel);
@@ -86,12 +130,23 @@ int MotionController::createMotionProfile() {
     _decel_start = _decel_n + _steps;
     // D(printf("_decel_start = %d \n", _decel_start));
     
-    if (_c_min < 10) {
-        _c_min = 10;
+    setCruiseInterval(c_min);
+    if (calledFromIRQ) {
+        _rampTableActive = false;
+    } else if ((_profile != PROFILE_SCURVE) || !buildSCurveTables()) {
+        // S-curves only exist as tables, moves which do not fit fall back to
+        // the trapezoidal ramp
+        buildRampTables();
+    }
+    
+    // Below 10 us only the hardware step generator keeps up
+    _stepGenerator = selectStepGenerator();
+    if (_stepGenerator == NULL) {
+        _stepGenerator = _softwareStepGenerator;
         return 0; // error, user wants stepping which is too fast for the controller
-    } else {
-        return 1;
     }
+    
+    return 1;
 }
 
 int MotionController::createMaxSpeedMotionProfile() {
@@ -107,96 +162,533 @@ int MotionController::createMaxSpeedMotionProfile() {
     // D(printf("c0 = %f \n", _c0));
     
     _n = 1;
-    _c = _c0 * 0.676f; 
+    _rest = 0;
+    _c = intervalToFixed(_c0 * 0.676f);
     // _accel_until potentially can overflow if acceleration is too small
     // Basically it is a step count value when desired speed is reached
     _max_s_lim = (_speed * _speed) / (2.0f * alpha * _accel);
     // D(printf("_accel_until = %d \n", _max_s_lim));
     // Calculate minimum 'c' value (when the maximum speed is reached)
     //_c_min = _c0 * (sqrt(_max_s_lim + 1.0) - sqrt((float)_max_s_lim));
-    _c_min = (1.0f / _speed) * 1000000.0f;
+    float c_min = (1.0f / _speed) * 1000000.0f;
     
-    if (_c_min < 10) _c_min = 10;
+    if (c_min < 10) c_min = 10;
+    setCruiseInterval(c_min);
     
-    // D(printf("_c_min = %f \n", _c_min));
+    // D(printf("_c_min = %f \n", c_min));
     
     _steps = 2000000000;
     _decel_n = 1;
     _decel_start = 2147483647; 
     
+    buildRampTables();
+    
+    _stepGenerator = selectStepGenerator();
+    if (_stepGenerator == NULL) _stepGenerator = _softwareStepGenerator;
+    
     return 0;
 }
 
-void MotionController::_stepperInterrupt() {
-    _stepPin = 1; // Enable step pin
+/*! Changes the constant speed of a running move without stopping it. The controller
+ *  ramps from the current speed to the new one with the configured acceleration or
+ *  deceleration, and the final deceleration is moved so that the move still ends
+ *  after _steps steps. The rest of the move is computed live. Returns 0 if the move
+ *  is not at constant speed or the running step generator cannot output the new speed.
+ *  Changing to the current speed leaves the move as it is. */
+int MotionController::changeSpeed(float stepsPerSec) {
+    if (stepsPerSec <= 0) return 0;
+    
+    // Rounded as in createMotionProfile(), the current speed gives the same interval
+    float c_us = (1.0f / stepsPerSec) * 1000000.0f;
+    uint32_t c_min = intervalToFixed(c_us);
+    // The longest interval left is the last one of the final deceleration
+    uint32_t maxInterval = intervalToFixed(1000000.0f * sqrt(2.0f / _decel));
+    if (maxInterval < c_min) maxInterval = c_min;
+    if (!_stepGenerator->fits(c_min, maxInterval)) return 0;
+    
+    core_util_critical_section_enter();
+    
+    if ((_state != RAMP_MAX) || (_stop != 0) || (_stepsPerformed >= _decel_start)) {
+        core_util_critical_section_exit();
+        return 0;
+    }
+    
+    // _c may be one resolution step above _c_min from the error diffusion, the
+    // previous constant speed is compared instead
+    uint32_t c_minPrev = _c_min;
+    uint32_t c_minFracPrev = _c_minFrac;
+    uint32_t cruiseError = _cruiseError;
+    setCruiseInterval(c_us);
+    
+    if ((_c_min == c_minPrev) && (_c_minFrac == c_minFracPrev)) {
+        // Same speed, the move and its error diffusion carry on unchanged
+        _cruiseError = cruiseError;
+        core_util_critical_section_exit();
+        return 1;
+    }
+    
+    float speed = (1000000.0f * (1 << STEP_INTERVAL_FRAC_BITS)) / (c_minPrev + c_minFracPrev / 4294967296.0f);
+    
+    if ((_c_min < c_minPrev) || ((_c_min == c_minPrev) && (_c_minFrac < c_minFracPrev))) {
+        // Speed up: continue the acceleration ramp from the step at which it reaches
+        // the current speed, as if the move had started from standstill n steps ago
+        float n = (speed * speed) / (2.0f * _accel);
+        float steps = _steps - _stepsPerformed + n;
+        float accelLim = (steps * _decel) / (_accel + _decel);
+        float maxSpeedLim = (stepsPerSec * stepsPerSec) / (2.0f * _accel);
+        
+        if (maxSpeedLim < accelLim) {
+            _decel_n = -(maxSpeedLim * (_accel / _decel));
+        } else {
+            // Not enough steps left to reach the new speed
+            _decel_n = -(steps - accelLim);
+        }
+        
+        _n = (int)(n + 0.5f) + 1;
+        _state = RAMP_UP;
+    } else {
+        // Slow down: follow the deceleration ramp from the current speed until the
+        // interval reaches the new one
+        int n = (int)((speed * speed) / (2.0f * _decel) + 0.5f);
+        if (n < 1) n = 1;
+        
+        _decel_n = -(int)((stepsPerSec * stepsPerSec) / (2.0f * _decel) + 0.5f);
+        _n = -n + 1;
+        _state = RAMP_SLOW;
+    }
+    
+    _decel_start = _decel_n + _steps;
+    _rest = 0;
+    _speed = stepsPerSec;
+    _rampTableActive = false;
+    
+    core_util_critical_section_exit();
+    
+    return 1;
+}
+
+/*! Sets the constant speed interval. _c_min is rounded down to the Q24.8 resolution,
+ *  the rest is kept for cruiseInterval() */
+void MotionController::setCruiseInterval(float c_us) {
+    double c = (double)c_us * (1 << STEP_INTERVAL_FRAC_BITS);
+    
+    if (c >= STEP_INTERVAL_MAX) {
+        _c_min = STEP_INTERVAL_MAX;
+        _c_minFrac = 0;
+    } else {
+        _c_min = (uint32_t)c;
+        _c_minFrac = (uint32_t)((c - _c_min) * 4294967296.0);
+    }
+    // Half way, the first carry comes after half a resolution step of error
+    _cruiseError = 0x80000000u;
+}
+
+/*! Next interval at constant speed. The fraction of _c_min below the Q24.8 resolution
+ *  is accumulated and carried into the interval whenever it overflows (error
+ *  diffusion), so the average rate over the constant speed phase is exact */
+uint32_t MotionController::cruiseInterval() {
+    uint32_t error = _cruiseError + _c_minFrac;
+    uint32_t c = (error < _cruiseError) ? _c_min + 1 : _c_min;
+    _cruiseError = error;
+    return c;
+}
+
+/*! Hardware step generation needs the precomputed tables to know the interval range
+ *  up front, moves computed live always run on the software backend */
+StepGenerator* MotionController::selectStepGenerator() {
+    if ((_hardwareStepGenerator != NULL) && _rampTableActive &&
+        _hardwareStepGenerator->supports(_minInterval, _maxInterval)) {
+        return _hardwareStepGenerator;
+    }
+    
+    uint32_t maxInterval = _rampTableActive ? _maxInterval : STEP_INTERVAL_MAX;
+    if (_softwareStepGenerator->supports(_c_min, maxInterval)) return _softwareStepGenerator;
+    
+    return NULL;
+}
+
+/*! Advances the ramp recurrence by one step (the work done by one step interrupt) */
+void MotionController::advanceRamp(int step) {
+    uint32_t new_c, num, div;
+    
+    switch (_state) {
+        case RAMP_UP:
+            // c(n) = c(n-1) - 2 * c(n-1) / (4n + 1), n > 0 while accelerating.
+            // The division remainder is carried to the next step so that small
+            // intervals keep converging instead of stalling on truncation.
+            div = (uint32_t)(4 * _n + 1);
+            num = (_c << 1) + _rest;
+            new_c = _c - num / div;
+            _rest = num % div;
+            
+            if (step >= _decel_start) {
+                // Go to decel state
+                _state = RAMP_DOWN;
+                _n = _decel_n;
+                _rest = 0;
+            //} else if (step >= _max_s_lim) {
+            } else if (new_c <= _c_min) {
+                _state = RAMP_MAX;
+                new_c = _c_min;
+            }
+            
+            _c = new_c;
+            break;
+        case RAMP_MAX:
+                        
+            if (step >= _decel_start) {
+                _state = RAMP_DOWN;
+                _n = _decel_n;
+                _rest = 0;
+                _c = _c_min;
+            } else {
+                _c = cruiseInterval();
+            }
+            
+            break;
+        
+        case RAMP_DOWN:
+            // n < 0 while decelerating, so the interval grows: c(n) = c(n-1) + 2 * c(n-1) / |4n + 1|
+            if (_n < 0) {
+                div = (uint32_t)(-(4 * _n + 1));
+                num = (_c << 1) + _rest;
+                new_c = _c + num / div;
+                _rest = num % div;
+                if (new_c > STEP_INTERVAL_MAX) new_c = STEP_INTERVAL_MAX;
+                _c = new_c;
+            }
+        
+            break;
+        
+        case RAMP_SLOW:
+            // Same recurrence as RAMP_DOWN, stops at the new constant speed
+            if (_n < 0) {
+                div = (uint32_t)(-(4 * _n + 1));
+                num = (_c << 1) + _rest;
+                new_c = _c + num / div;
+                _rest = num % div;
+            } else {
+                new_c = _c_min;
+            }
+            
+            if (step >= _decel_start) {
+                // Final deceleration, the recurrence simply carries on
+                _state = RAMP_DOWN;
+            } else if (new_c >= _c_min) {
+                _state = RAMP_MAX;
+                new_c = _c_min;
+            }
+            
+            _c = new_c;
+            break;
+        
+    } 
+    
+    _n++;
+}
+
+/*! Starts fitting a ramp table, start is the interval before the first step of the table */
+void MotionController::fitBegin(RampFit* fit, RampStep* table, uint32_t start) {
+    fit->table = table;
+    fit->length = 0;
+    fit->start = start;
+    fit->count = 0;
+}
+
+/*! Closes the open segment of a ramp table, returns false when the table is full */
+bool MotionController::fitEnd(RampFit* fit) {
+    if (fit->count == 0) return true;
+    if (fit->length == RAMP_TABLE_SIZE) return false;
+    
+    int32_t delta = (int32_t)(((int64_t)fit->lo + fit->hi) / 2);
+    fit->table[fit->length].delta = delta;
+    fit->table[fit->length].count = fit->count;
+    fit->length++;
+    fit->start += delta * fit->count;
+    fit->count = 0;
+    
+    return true;
+}
+
+/*! Appends the interval of the next step to a ramp table. Consecutive steps share one
+ *  entry as long as a constant change per step replays all of them within
+ *  RAMP_TABLE_TOLERANCE. Returns false when the table is full. */
+bool MotionController::fitAdd(RampFit* fit, uint32_t c) {
+    // Range of the replayed intervals
+    if (c - RAMP_TABLE_TOLERANCE < _minInterval) _minInterval = c - RAMP_TABLE_TOLERANCE;
+    if (c + RAMP_TABLE_TOLERANCE > _maxInterval) _maxInterval = c + RAMP_TABLE_TOLERANCE;
+    
+    for (;;) {
+        // Changes per step which keep this step within the tolerance
+        int64_t m = fit->count + 1;
+        int64_t low = (int64_t)c - RAMP_TABLE_TOLERANCE - fit->start;
+        int64_t high = (int64_t)c + RAMP_TABLE_TOLERANCE - fit->start;
+        int64_t lo = (low >= 0) ? (low + m - 1) / m : -(-low / m);
+        int64_t hi = (high >= 0) ? high / m : -((-high + m - 1) / m);
+        
+        if (fit->count == 0) {
+            fit->lo = (int32_t)lo;
+            fit->hi = (int32_t)hi;
+            fit->count = 1;
+            return true;
+        }
+        
+        if (lo < fit->lo) lo = fit->lo;
+        if (hi > fit->hi) hi = fit->hi;
+        if (lo <= hi) {
+            fit->lo = (int32_t)lo;
+            fit->hi = (int32_t)hi;
+            fit->count++;
+            return true;
+        }
+        
+        // Does not fit the open segment, start a new one from where it ends
+        if (!fitEnd(fit)) return false;
+    }
+}
+
+/*! Runs the step interrupt recurrence ahead of time and stores the resulting intervals
+ *  so the interrupt only has to index into the tables. Falls back to live computation
+ *  when a ramp is too long for the RAM budget. */
+void MotionController::buildRampTables() {
+    _rampTableActive = false;
+    _rampUpLength = 0;
+    _rampDownLength = 0;
+    _minInterval = (_c < _c_min) ? _c : _c_min;
+    _maxInterval = (_c > _c_min) ? _c : _c_min;
+    
+    // Estimated ramp lengths, ramps longer than this are cheaper to compute live
+    // than to simulate here
+    int upSteps = (_max_s_lim < _decel_start) ? _max_s_lim : _decel_start;
+    int downSteps = (_decel_start < _steps) ? (_steps - _decel_start) : 0;
+    if ((upSteps < 0) || (upSteps > RAMP_TABLE_MAX_STEPS) || (downSteps > RAMP_TABLE_MAX_STEPS)) return;
+    
+    // Save the starting point of the ramp, it is restored once the tables are built
+    int n = _n;
+    uint32_t c = _c;
+    uint32_t rest = _rest;
+    
+    bool ok = true;
+    int step = 1;
+    RampFit fit;
+    
+    // Acceleration phase (and the step that switches to deceleration if the
+    // maximum speed is never reached)
+    _state = RAMP_UP;
+    fitBegin(&fit, _rampUpTable, _c);
+    while (ok && (_state == RAMP_UP) && (step < _steps)) {
+        advanceRamp(step);
+        ok = fitAdd(&fit, _c);
+        step++;
+    }
+    ok = ok && fitEnd(&fit);
+    _rampUpLength = fit.length;
+    _rampUpEnd = step - 1;
+    _rampUpNext = _state;
+    
+    // Deceleration phase, starts from c_min or from wherever the replayed
+    // acceleration stopped
+    if (ok && (downSteps > 0)) {
+        fitBegin(&fit, _rampDownTable, (_rampUpNext == RAMP_MAX) ? _c_min : fit.start);
+        _state = RAMP_DOWN;
+        _n = _decel_n + 1;
+        _rest = 0;
+        for (step = _decel_start + 1; ok && (step < _steps); step++) {
+            advanceRamp(step);
+            ok = fitAdd(&fit, _c);
+        }
+        ok = ok && fitEnd(&fit);
+        _rampDownLength = fit.length;
+    }
+    
+    _n = n;
+    _c = c;
+    _rest = rest;
+    
+    _rampTableActive = ok;
+    // D(printf("ramp table %d, up = %d, down = %d \n", ok, _rampUpLength, _rampDownLength));
+}
+
+/*! Steps through a jerk limited ramp and appends the intervals to a ramp table. The speed
+ *  follows v = V (3u^2 - 2u^3) with u = t / time, so the position in units of twice the
+ *  ramp distance is f(u) = u^3 - u^4 / 2. Accelerating, count intervals from standstill
+ *  are appended, the first one goes to first and becomes the starting point of the
+ *  table. Decelerating, the intervals of the last count steps before standstill are
+ *  appended. */
+bool MotionController::fitSCurveRamp(RampFit* fit, float dist, float time, int count, bool decel, uint32_t* first) {
+    float h = 1.0f / (2.0f * dist); // One step in units of f(u)
+    double u = 0.0; // Double so that the small steps add up at the end of long ramps
+    float d = cbrtf(h);
+    float dir = 1.0f;
+    
+    if (decel) {
+        // Start count steps before standstill, f(u) = count * h (f is convex on [0, 1])
+        double target = count * (double)h;
+        u = 1.0;
+        for (int i = 0; i < 30; i++) {
+            u -= (u * u * u * (1.0 - 0.5 * u) - target) / (u * u * (3.0 - 2.0 * u));
+        }
+        d = h;
+        dir = -1.0f;
+    }
+    
+    for (int k = 1; k <= count; k++) {
+        // Solve f(u + d) - f(u) = h (or f(u) - f(u - d) = h) for d, expanded around u
+        float uf = (float)u;
+        float a1 = uf * uf * (3.0f - 2.0f * uf);
+        float a2 = dir * 3.0f * uf * (1.0f - uf);
+        float a3 = 1.0f - 2.0f * uf;
+        float a4 = dir * 0.5f;
+        for (int i = 0; i < 4; i++) {
+            float g = d * (a1 + d * (a2 + d * (a3 - a4 * d))) - h;
+            float dg = a1 + d * (2.0f * a2 + d * (3.0f * a3 - 4.0f * a4 * d));
+            d -= g / dg;
+        }
+        u += dir * d;
+        
+        uint32_t c = intervalToFixed(time * d * 1000000.0f);
+        if ((k == 1) && (first != NULL)) {
+            *first = c;
+            fit->start = c;
+        } else if (!fitAdd(fit, c)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+/*! Precomputes jerk limited ramps. Each ramp takes as long and covers as many steps as
+ *  the trapezoidal one (V / a and V^2 / 2a), so the move time does not change, but the
+ *  acceleration rises smoothly to 1.5 a instead of jumping to a. Returns false if the
+ *  move does not fit the tables. */
+bool MotionController::buildSCurveTables() {
+    _rampTableActive = false;
+    _rampUpLength = 0;
+    _rampDownLength = 0;
+    
+    float v = _speed;
+    float upDist = (v * v) / (2.0f * _accel);
+    float downDist = (v * v) / (2.0f * _decel);
+    int upSteps, downSteps;
+    
+    if (upDist + downDist <= _steps) {
+        upSteps = (int)upDist;
+        downSteps = (int)downDist;
+    } else {
+        // Maximum speed is never reached, lower the peak speed so both ramps meet
+        v = sqrt((2.0f * _steps) / ((1.0f / _accel) + (1.0f / _decel)));
+        upDist = (v * v) / (2.0f * _accel);
+        downDist = _steps - upDist;
+        upSteps = (int)upDist;
+        downSteps = _steps - upSteps;
+    }
+    
+    if ((upSteps < 1) || (downSteps < 2) || (upSteps > RAMP_TABLE_MAX_STEPS) || (downSteps > RAMP_TABLE_MAX_STEPS)) {
+        return false;
+    }
+    
+    setCruiseInterval((1.0f / v) * 1000000.0f);
+    uint32_t peak = _c_min;
+    uint32_t first = peak;
+    _minInterval = peak;
+    _maxInterval = peak;
+    RampFit fit;
+    
+    // Acceleration, the last step goes on at the peak speed
+    fitBegin(&fit, _rampUpTable, 0);
+    if (!fitSCurveRamp(&fit, upDist, v / _accel, upSteps, false, &first)) return false;
+    if (!fitAdd(&fit, peak) || !fitEnd(&fit)) return false;
+    _rampUpLength = fit.length;
+    
+    _rampUpEnd = upSteps;
+    _decel_start = _steps - downSteps;
+    _rampUpNext = (_decel_start > upSteps) ? RAMP_MAX : RAMP_DOWN;
+    
+    // Deceleration, from the peak speed (or the replayed end of the acceleration)
+    // down to the last step
+    fitBegin(&fit, _rampDownTable, (_rampUpNext == RAMP_MAX) ? _c_min : fit.start);
+    if (!fitSCurveRamp(&fit, downDist, v / _decel, downSteps - 1, true, NULL)) return false;
+    if (!fitEnd(&fit)) return false;
+    _rampDownLength = fit.length;
+    
+    if (first > _maxInterval) _maxInterval = first;
+    _c = first;
+    _rampTableActive = true;
+    
+    return true;
+}
+
+/*! Replays one step from a precomputed ramp table */
+void MotionController::replayRampStep(const RampStep* table) {
+    if (--_rampRepeat == 0) {
+        RampStep entry = table[_rampIndex++];
+        _rampDelta = entry.delta;
+        _rampRepeat = entry.count;
+    }
+    _c += _rampDelta;
+}
 
+/*! Hands out one step to the step generator, returns the interval to the following
+ *  step or 0 when the move is over */
+uint32_t MotionController::_nextStep() {
     _stepsPerformed++; // Increment number of steps performed
-    float new_c;
+    if (callbackStep) callbackStep.call();
         
-    if ((_stepsPerformed < _steps) && (_stop == 0)) {
+    if ((_stepsPerformed >= _steps) || (_stop != 0)) return 0;
+    
+    if (_rampTableActive) {
         switch (_state) {
             case RAMP_UP:
-                new_c = _c - (_c * 2) / (4 * _n + 1);
-                
-                if (_stepsPerformed >= _decel_start) {
-                    // Go to decel state
-                    _state = RAMP_DOWN;
-                    _n = _decel_n;
-                //} else if (_stepsPerformed >= _max_s_lim) {
-                } else if (new_c <= _c_min) {
-                    _state = RAMP_MAX;
-                    new_c = _c_min;
+                replayRampStep(_rampUpTable);
+                if (_stepsPerformed >= _rampUpEnd) {
+                    _state = _rampUpNext;
+                    if (_state == RAMP_MAX) _c = _c_min;
+                    _rampIndex = 0;
+                    _rampRepeat = 1;
                 }
-                
-                if ((int)(new_c) != (int)(_c)) {
-                    _timer.attach_us(_stepperInterruptCb, (int)(new_c + 0.5f));
-                    // std::chrono::duration<int, std::micro> delay((int)(new_c + 0.5f));
-                    // _timer.attach(_stepperInterruptCb, delay);
-                }
-                
-                _c = new_c;
                 break;
             case RAMP_MAX:
-                            
                 if (_stepsPerformed >= _decel_start) {
+                    // The ramp table starts from the exact interval
                     _state = RAMP_DOWN;
-                    _n = _decel_n;
-                }                    
-                
+                    _c = _c_min;
+                } else {
+                    _c = cruiseInterval();
+                }
                 break;
-            
             case RAMP_DOWN:
-                new_c = _c - (_c * 2) / (4 * _n + 1);
-                
-                if ((int)(new_c) != (int)(_c)) {
-                    _timer.attach_us(_stepperInterruptCb, (int)(new_c + 0.5f));
-                    // std::chrono::duration<int, std::micro> delay((int)(new_c + 0.5f));
-                    // _timer.attach(_stepperInterruptCb, delay);
-                }
-                
-                _c = new_c;
-            
+                replayRampStep(_rampDownTable);
                 break;
-            
-        } 
-        
-        _n++;
-    
+            case RAMP_SLOW:
+                // Speed changes are always computed live
+                break;
+        }
     } else {
-        _timer.detach();
-        if (_stop == 0) callbackPumpingDone.call();
+        advanceRamp(_stepsPerformed);
+    }
+    
+    // Also catches the changes made by changeSpeed()
+    if (_state != _reportedState) {
+        _reportedState = _state;
+        if (callbackStateChange) callbackStateChange.call(_state);
     }
+    
+    return _c;
+}
 
-    _stepPin = 0; // Disable step pin
+/*! Last step is out */
+void MotionController::_moveDone() {
+    if (_stop == 0) callbackPumpingDone.call();
 }
 
 void MotionController::run() {
     _stop = 0;
     // Starting state
     _state = RAMP_UP;
-    // Start timer
-    _timer.attach_us(_stepperInterruptCb, (int)(_c + 0.5f));
-    // std::chrono::duration<int, std::micro> delay((int)(_c + 0.5f));
-    // _timer.attach(_stepperInterruptCb, delay);
+    _reportedState = RAMP_UP;
+    _rampIndex = 0;
+    _rampRepeat = 1;
+    // Start step generation
+    _stepGenerator->start(_c);
 }
-
@@ -1,3 +1,129 @@
-version https://git-lfs.github.com/spec/v1
-oid sha256:1d95cbb5be59aa283760a555f422c5c7921b1e8957000dd5f1ef4c9ce18e39ee
-size 1437
+#ifndef MOTIONCONTROLLER_H
+#define MOTIONCONTROLLER_H
+#include "mbed.h"
+#include "StepGenerator.h"
+#include "StepScheduler.h"
+
+// Precomputed ramp tables, piecewise linear in the step number.
+// RAM budget: 2 tables x 512 entries x 8 bytes = 8 kB
+#define RAMP_TABLE_SIZE 512
+// Longest ramp (in steps) that is precomputed, longer ramps are computed live
+#define RAMP_TABLE_MAX_STEPS 65536
+// Largest deviation of a replayed interval from the exact one (Q24.8, 0.25 us)
+#define RAMP_TABLE_TOLERANCE 64
+// Longest move, leaves headroom in the int step arithmetic
+#define MOTION_MAX_STEPS 1000000000
+
+class MotionController {
+    
+    public:
+        // Ramp shapes
+        typedef enum {PROFILE_TRAPEZOIDAL, PROFILE_SCURVE} profileType;
+        
+        // Ramp states, RAMP_SLOW decelerates to a lower constant speed after changeSpeed()
+        typedef enum {RAMP_UP, RAMP_MAX, RAMP_DOWN, RAMP_SLOW} rampState;
+        
+        MotionController(PinName stepPin, StepScheduler* stepScheduler = NULL);
+        MotionController(StepGenerator* stepGenerator);
+        void configure(double steps, float stepsPerSec, float accel, float decel, int profile = PROFILE_TRAPEZOIDAL);
+        void run();
+        int createMotionProfile(bool calledFromIRQ = false);
+        int createMaxSpeedMotionProfile();
+        int changeSpeed(float stepsPerSec);
+        int getState();
+        int getStepsPerformed();
+        int getC();
+        StepTiming* getStepTiming();
+        
+        Callback<void()> callbackPumpingDone;
+        // Called from the step interrupt with every step handed out, optional
+        Callback<void()> callbackStep;
+        // Called from the step interrupt when the ramp state changed, with the new
+        // rampState, optional
+        Callback<void(int)> callbackStateChange;
+        
+        // Stop the motion
+        void reset();
+        
+    private:
+        // Ramp states
+        
+        rampState _state;
+        rampState _reportedState; // Last one handed to callbackStateChange
+        
+        // Ramp table entry: change of the step interval (Q24.8) on each of the next count steps
+        typedef struct {
+            int32_t delta;
+            uint32_t count;
+        } RampStep;
+        
+        // Ramp table being fitted, the open segment takes any change per step in [lo, hi]
+        typedef struct {
+            RampStep* table;
+            int length;
+            uint32_t start; // Replayed interval before the open segment
+            uint32_t count;
+            int32_t lo;
+            int32_t hi;
+        } RampFit;
+        
+        // Step generator callbacks
+        uint32_t _nextStep();
+        void _moveDone();
+        void advanceRamp(int step);
+        void setCruiseInterval(float c_us);
+        uint32_t cruiseInterval();
+        
+        // Ramp tables
+        void buildRampTables();
+        void fitBegin(RampFit* fit, RampStep* table, uint32_t start);
+        bool fitAdd(RampFit* fit, uint32_t c);
+        bool fitEnd(RampFit* fit);
+        bool buildSCurveTables();
+        bool fitSCurveRamp(RampFit* fit, float dist, float time, int count, bool decel, uint32_t* first);
+        void replayRampStep(const RampStep* table);
+        
+        // Step generator backends, the hardware one is used whenever it can
+        // output the whole move
+        StepGenerator* selectStepGenerator();
+        StepGenerator* _softwareStepGenerator;
+        StepGenerator* _hardwareStepGenerator;
+        StepGenerator* _stepGenerator;
+        StepTiming _stepTiming; // Ticker step generator only, hardware steps do not jitter
+        
+        // Motion parameters
+        int _steps;
+        float _speed;
+        float _accel;
+        float _decel;
+        int _profile;
+        
+        float _c0;
+        uint32_t _c, _c_min; // Q24.8 microseconds
+        uint32_t _c_minFrac; // Fraction of _c_min below the Q24.8 resolution (Q0.32)
+        uint32_t _cruiseError; // Accumulated _c_minFrac, carries into the next interval
+        uint32_t _rest; // Remainder of the last interval division
+        int _max_s_lim;
+        int _accel_lim;
+        int _decel_n;
+        int _decel_start;
+        int _n;
+        int _stepsPerformed;
+        
+        volatile int _stop;
+        
+        // Precomputed ramps
+        RampStep _rampUpTable[RAMP_TABLE_SIZE];
+        RampStep _rampDownTable[RAMP_TABLE_SIZE];
+        int _rampUpLength;
+        int _rampDownLength;
+        int _rampUpEnd; // Last step of the acceleration phase
+        rampState _rampUpNext; // State that follows the acceleration phase
+        bool _rampTableActive;
+        int _rampIndex;
+        int _rampRepeat;
+        int32_t _rampDelta;
+        uint32_t _minInterval, _maxInterval; // Q24.8 microseconds, range of the tables
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "mbed.h"
+#include "StallDetector.h"
+
+#if defined(TARGET_K64F)
+#include "hal/pinmap.h"
+#include "PeripheralPins.h"
+#include "fsl_adc16.h"
+
+static ADC_Type* const adcBases[] = ADC_BASE_PTRS;
+static const IRQn_Type adcIrqs[] = {ADC0_IRQn, ADC1_IRQn};
+
+StallDetector* StallDetector::_converting[2] = {NULL, NULL};
+#endif
+
+/*! Constructor */
+StallDetector::StallDetector(PinName slaPin) :
+    _slaPin(slaPin),
+    _enabled(false),
+    _threshold(0),
+    _stepCount(0),
+    _sum(0),
+    _level(0),
+    _minLevel(0xFFFF),
+    _settle(STALL_SETTLE_SAMPLES),
+    _stalled(false),
+    _samples(0),
+    _phase(0),
+    _conversionPhase(0),
+    _samplePhase(0),
+    _ramping(true) {
+
+#if defined(TARGET_K64F)
+    // Same decoding of the pin as the AnalogIn HAL
+    int adc = (int)pinmap_peripheral(slaPin, PinMap_ADC);
+    _adcInstance = adc >> ADC_INSTANCE_SHIFT;
+    _adcChannel = adc & 0xF;
+    _adcMuxB = (adc & (1 << ADC_B_CHANNEL_SHIFT)) != 0;
+#endif
+}
+
+bool StallDetector::isSupported() {
+#if defined(TARGET_K64F)
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*! Enabling restarts the estimate and clears the status */
+void StallDetector::configure(bool enabled, uint16_t threshold_mV) {
+#if defined(TARGET_K64F)
+    if (enabled) {
+        NVIC_SetVector(adcIrqs[_adcInstance], (uint32_t)((_adcInstance == 0) ? &adc0Interrupt : &adc1Interrupt));
+        NVIC_EnableIRQ(adcIrqs[_adcInstance]);
+    }
+#endif
+
+    core_util_critical_section_enter();
+    _enabled = enabled && isSupported();
+    _threshold = (uint16_t)(((uint32_t)threshold_mV * 0xFFFF) / STALL_ADC_FULL_SCALE_MV);
+    _stepCount = 0;
+    _level = 0;
+    _minLevel = 0xFFFF;
+    _samples = 0;
+    // The next sample starts a new estimate
+    _phase++;
+    core_util_critical_section_exit();
+}
+
+/*! Copies the status, consistent even while the pump is running */
+void StallDetector::read(StallStatus* status) {
+    core_util_critical_section_enter();
+    status->enabled = _enabled ? 1 : 0;
+    status->threshold_mV = toMv(_threshold);
+    status->level_mV = toMv(_level);
+    status->minLevel_mV = (_minLevel == 0xFFFF) ? 0 : toMv(_minLevel);
+    status->samples = _samples;
+    core_util_critical_section_exit();
+}
+
+void StallDetector::step(bool constantSpeed) {
+    if (!_enabled) return;
+
+    if (!constantSpeed) {
+        _ramping = true;
+        return;
+    }
+    if (_ramping) {
+        // A new constant speed phase, its samples start a new estimate
+        _ramping = false;
+        _phase++;
+        _stepCount = 0;
+    }
+    if (++_stepCount < STALL_SAMPLE_STEPS) return;
+    _stepCount = 0;
+
+#if defined(TARGET_K64F)
+    startConversion();
+#endif
+}
+
+/*! Filters one conversion and checks the estimate, called from the ADC interrupt */
+void StallDetector::sample(uint16_t raw) {
+    _samples++;
+
+    if (_conversionPhase != _samplePhase) {
+        _samplePhase = _conversionPhase;
+        _sum = (uint32_t)raw << STALL_FILTER_SHIFT;
+        _settle = STALL_SETTLE_SAMPLES;
+        _stalled = false;
+    } else {
+        // Exponential average, unsigned wrap-around cancels out
+        _sum += raw - (_sum >> STALL_FILTER_SHIFT);
+    }
+    _level = (uint16_t)(_sum >> STALL_FILTER_SHIFT);
+
+    if (_settle > 0) {
+        _settle--;
+        return;
+    }
+    if (_level < _minLevel) _minLevel = _level;
+
+    if (!_stalled && (_level < _threshold)) {
+        _stalled = true;
+        callbackStall.call();
+    }
+}
+
+uint16_t StallDetector::toMv(uint32_t raw) {
+    return (uint16_t)((raw * STALL_ADC_FULL_SCALE_MV) / 0xFFFF);
+}
+
+#if defined(TARGET_K64F)
+/*! Starts a conversion with the completion interrupt, does not wait for it */
+void StallDetector::startConversion() {
+    // The ADC is busy with the sample of another pump, this one is skipped
+    if (_converting[_adcInstance] != NULL) return;
+    _converting[_adcInstance] = this;
+    _conversionPhase = _phase;
+
+    adc16_channel_config_t config;
+    config.channelNumber = _adcChannel;
+    config.enableInterruptOnConversionCompleted = true;
+#if defined(FSL_FEATURE_ADC16_HAS_DIFF_MODE) && FSL_FEATURE_ADC16_HAS_DIFF_MODE
+    config.enableDifferentialConversion = false;
+#endif
+
+    ADC16_SetChannelMuxMode(adcBases[_adcInstance], _adcMuxB ? kADC16_ChannelMuxB : kADC16_ChannelMuxA);
+    ADC16_SetChannelConfig(adcBases[_adcInstance], 0, &config);
+}
+
+void StallDetector::adcInterrupt(int instance) {
+    // Reading the result clears the completion flag
+    uint16_t raw = ADC16_GetChannelConversionValue(adcBases[instance], 0);
+    StallDetector* detector = _converting[instance];
+    _converting[instance] = NULL;
+
+    if (detector != NULL) detector->sample(raw);
+}
+
+void StallDetector::adc0Interrupt() {
+    adcInterrupt(0);
+}
+
+void StallDetector::adc1Interrupt() {
+    adcInterrupt(1);
+}
+#endif
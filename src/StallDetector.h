@@ -0,0 +1,80 @@
+#ifndef STALLDETECTOR_H
+#define STALLDETECTOR_H
+#include "mbed.h"
+
+// SLA is sampled every STALL_SAMPLE_STEPS steps at constant speed
+#define STALL_SAMPLE_STEPS 16
+// The load angle estimate averages over about 2^STALL_FILTER_SHIFT samples
+#define STALL_FILTER_SHIFT 3
+// Samples after a ramp before the estimate is compared with the threshold
+#define STALL_SETTLE_SAMPLES 32
+// ADC reference, the SLA pin swings up to the 3.3 V supply of the driver
+#define STALL_ADC_FULL_SCALE_MV 3300
+
+typedef struct {
+    uint8_t enabled;
+    uint16_t threshold_mV; // Stall below this SLA level
+    uint16_t level_mV; // Filtered SLA level, 0 before the first estimate
+    uint16_t minLevel_mV; // Lowest estimate since detection was configured
+    uint32_t samples; // Conversions since detection was configured
+} __attribute__((__packed__)) StallStatus;
+
+/*! Stall detection with the speed/load angle (SLA) output of the AMIS30543.
+ *
+ *  The SLA pin holds the back EMF of the motor sampled by the driver at the current
+ *  zero crossings. A blocked rotor loses its back EMF, so the level drops. The step
+ *  interrupt calls step() and every STALL_SAMPLE_STEPS steps at constant speed only
+ *  a conversion is started; the ADC interrupt filters the result and calls
+ *  callbackStall once per constant speed phase when the estimate falls below the
+ *  threshold. Acceleration and deceleration are ignored, their back EMF is not
+ *  comparable to the one at the target speed. K64F only, elsewhere detection cannot
+ *  be enabled. */
+class StallDetector {
+
+    public:
+        StallDetector(PinName slaPin);
+
+        bool isSupported();
+        void configure(bool enabled, uint16_t threshold_mV);
+        void read(StallStatus* status);
+
+        // Called from the step interrupt
+        void step(bool constantSpeed);
+
+        Callback<void()> callbackStall;
+
+    private:
+        void sample(uint16_t raw);
+        static uint16_t toMv(uint32_t raw);
+
+#if defined(TARGET_K64F)
+        void startConversion();
+        static void adcInterrupt(int instance);
+        static void adc0Interrupt();
+        static void adc1Interrupt();
+        static StallDetector* _converting[2]; // Owner of the running conversion per ADC
+
+        int _adcInstance;
+        uint32_t _adcChannel;
+        bool _adcMuxB;
+#endif
+
+        AnalogIn _slaPin; // Sets up the ADC and the pin
+        volatile bool _enabled;
+        uint16_t _threshold; // Raw ADC counts
+        int _stepCount;
+        uint32_t _sum; // Filter state, the estimate times 2^STALL_FILTER_SHIFT
+        uint16_t _level;
+        uint16_t _minLevel;
+        int _settle; // Samples left before the estimate counts
+        bool _stalled; // Reported in this constant speed phase
+        uint32_t _samples;
+
+        // Constant speed phases, counted by the step interrupt and configure()
+        volatile uint32_t _phase;
+        volatile uint32_t _conversionPhase; // Phase of the running conversion
+        uint32_t _samplePhase; // Phase of the estimate
+        bool _ramping;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include "mbed.h"
+#include "StepGenerator.h"
+
+/*! Constructor */
+TickerStepGenerator::TickerStepGenerator(PinName stepPin) :
+    _stepInterruptCb(callback(this, &TickerStepGenerator::_stepInterrupt)),
+    _stepPin(stepPin),
+    _deadline(0) {
+
+    _clock.start();
+}
+
+bool TickerStepGenerator::supports(uint32_t minInterval, uint32_t /* maxInterval */) {
+    // The Ticker layer cannot keep up below 10 us
+    return intervalToUs(minInterval) >= 10;
+}
+
+bool TickerStepGenerator::fits(uint32_t minInterval, uint32_t maxInterval) {
+    // Every period is set up on its own
+    return supports(minInterval, maxInterval);
+}
+
+void TickerStepGenerator::start(uint32_t firstInterval) {
+    _stepPin = 0;
+    _deadline = ((uint64_t)_clock.read_high_resolution_us() << STEP_INTERVAL_FRAC_BITS) + firstInterval;
+    if (timing != NULL) timing->start(firstInterval);
+    arm();
+}
+
+void TickerStepGenerator::stop() {
+    _timer.detach();
+    if (timing != NULL) timing->cancel();
+    _stepPin = 0;
+}
+
+int TickerStepGenerator::pendingSteps() {
+    // Steps are handed out when they are output
+    return 0;
+}
+
+/*! Arms the timer for the next deadline */
+void TickerStepGenerator::arm() {
+    us_timestamp_t now = _clock.read_high_resolution_us();
+    us_timestamp_t due = deadlineToUs(_deadline);
+    _timer.attach_us(_stepInterruptCb, (due > now) ? due - now : 0);
+}
+
+void TickerStepGenerator::_stepInterrupt() {
+    _stepPin = 1; // Enable step pin
+
+    bool measured = (timing != NULL) && timing->isEnabled();
+    uint32_t start = measured ? timing->stepStart() : 0;
+
+    uint32_t interval = nextInterval.call();
+
+    if (interval == 0) {
+        if (measured) timing->cancel();
+        moveDone.call();
+    } else {
+        // From the deadline, not from now, so latency does not add up
+        _deadline += interval;
+        if (measured) timing->next(interval);
+        arm();
+    }
+
+    _stepPin = 0; // Disable step pin
+
+    if (measured) timing->stepEnd(start);
+}
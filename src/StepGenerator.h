@@ -0,0 +1,81 @@
+#ifndef STEPGENERATOR_H
+#define STEPGENERATOR_H
+#include "mbed.h"
+#include "StepTiming.h"
+
+// Step intervals are held in Q24.8 fixed point (microseconds * 256) so the
+// step interrupt never touches the FPU
+#define STEP_INTERVAL_FRAC_BITS 8
+// Largest interval (~4.2 s), leaves headroom for 2 * c plus the carried remainder
+#define STEP_INTERVAL_MAX 0x3FFFFFFFu
+
+/*! Rounds a Q24.8 step interval to whole microseconds */
+static inline int intervalToUs(uint32_t c) {
+    return (int)((c + (1 << (STEP_INTERVAL_FRAC_BITS - 1))) >> STEP_INTERVAL_FRAC_BITS);
+}
+
+/*! Rounds an absolute step deadline (Q.8 microseconds) to whole microseconds */
+static inline us_timestamp_t deadlineToUs(uint64_t deadline) {
+    return (deadline + (1 << (STEP_INTERVAL_FRAC_BITS - 1))) >> STEP_INTERVAL_FRAC_BITS;
+}
+
+/*! Step generator backend, outputs the STEP pulses of a move.
+ *
+ *  The backend pulls the step intervals from the motion controller through
+ *  nextInterval. Intervals are Q24.8 microseconds, 0 means that the step which was
+ *  just handed out is the last one of the move. Buffered backends may call
+ *  nextInterval ahead of the step actually being output, pendingSteps() tells how
+ *  far ahead they are. */
+class StepGenerator {
+
+    public:
+        StepGenerator() : timing(NULL) {}
+        virtual ~StepGenerator() {}
+
+        // Checks whether every interval of a move fits the backend (Q24.8 microseconds)
+        virtual bool supports(uint32_t minInterval, uint32_t maxInterval) = 0;
+        // Checks whether the running move can go on with these intervals
+        virtual bool fits(uint32_t minInterval, uint32_t maxInterval) = 0;
+        // Outputs the first step after firstInterval (Q24.8 microseconds)
+        virtual void start(uint32_t firstInterval) = 0;
+        // Stops immediately, moveDone is not called
+        virtual void stop() = 0;
+        // Steps handed out by nextInterval which are not on the STEP pin yet
+        virtual int pendingSteps() = 0;
+
+        // Interval to the following step, called once per step
+        Callback<uint32_t()> nextInterval;
+        // Called once the last step is out
+        Callback<void()> moveDone;
+        // Step timing instrumentation, NULL if the backend is not measured
+        StepTiming* timing;
+};
+
+/*! Software step generation, one timer interrupt per step.
+ *
+ *  Each step is scheduled at an absolute deadline which advances by the Q24.8
+ *  interval, so neither the fraction of a microsecond nor the interrupt latency
+ *  accumulates over the move. */
+class TickerStepGenerator : public StepGenerator {
+
+    public:
+        TickerStepGenerator(PinName stepPin);
+
+        virtual bool supports(uint32_t minInterval, uint32_t maxInterval);
+        virtual bool fits(uint32_t minInterval, uint32_t maxInterval);
+        virtual void start(uint32_t firstInterval);
+        virtual void stop();
+        virtual int pendingSteps();
+
+    private:
+        void arm();
+        void _stepInterrupt();
+        const Callback<void()> _stepInterruptCb;
+
+        DigitalOut _stepPin;
+        Timer _clock;
+        Timeout _timer;
+        uint64_t _deadline; // Next step, Q.8 microseconds on _clock
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "mbed.h"
+#include "StepScheduler.h"
+
+/*! Constructor */
+ScheduledStepGenerator::ScheduledStepGenerator(StepScheduler* scheduler, PinName stepPin) :
+    _scheduler(scheduler),
+    _stepPin(stepPin),
+    _deadline(0),
+    _heapIndex(-1) {
+
+}
+
+bool ScheduledStepGenerator::supports(uint32_t minInterval, uint32_t /* maxInterval */) {
+    // Same limit as a Ticker of its own, the total rate of all axes is up to the user
+    return intervalToUs(minInterval) >= 10;
+}
+
+bool ScheduledStepGenerator::fits(uint32_t minInterval, uint32_t maxInterval) {
+    // Every interval is scheduled on its own
+    return supports(minInterval, maxInterval);
+}
+
+void ScheduledStepGenerator::start(uint32_t firstInterval) {
+    _stepPin = 0;
+    _scheduler->add(this, firstInterval);
+}
+
+void ScheduledStepGenerator::stop() {
+    _scheduler->remove(this);
+    _stepPin = 0;
+}
+
+int ScheduledStepGenerator::pendingSteps() {
+    // Steps are handed out when they are output
+    return 0;
+}
+
+/*! Constructor */
+StepScheduler::StepScheduler() :
+    _timerInterruptCb(callback(this, &StepScheduler::_timerInterrupt)),
+    _count(0),
+    _maxLateness_us(0) {
+
+    _clock.start();
+}
+
+uint32_t StepScheduler::maxLateness_us() {
+    return _maxLateness_us;
+}
+
+void StepScheduler::resetMaxLateness() {
+    _maxLateness_us = 0;
+}
+
+int StepScheduler::runningAxes() {
+    return _count;
+}
+
+/*! Schedules the first step of an axis, restarts it if it is running already */
+void StepScheduler::add(ScheduledStepGenerator* axis, uint32_t firstInterval) {
+    core_util_critical_section_enter();
+
+    us_timestamp_t now = _clock.read_high_resolution_us();
+    axis->_deadline = ((uint64_t)now << STEP_INTERVAL_FRAC_BITS) + firstInterval;
+
+    if (axis->_heapIndex < 0) {
+        place(axis, _count++);
+        siftUp(axis->_heapIndex);
+    } else {
+        siftUp(axis->_heapIndex);
+        siftDown(axis->_heapIndex);
+    }
+
+    // Only an earlier first deadline needs the timer
+    if (_heap[0] == axis) arm(now);
+
+    core_util_critical_section_exit();
+}
+
+void StepScheduler::remove(ScheduledStepGenerator* axis) {
+    core_util_critical_section_enter();
+
+    int index = axis->_heapIndex;
+    if (index >= 0) {
+        axis->_heapIndex = -1;
+        _count--;
+        if (index < _count) {
+            // The last axis fills the gap
+            ScheduledStepGenerator* moved = _heap[_count];
+            place(moved, index);
+            siftUp(index);
+            siftDown(moved->_heapIndex);
+        }
+        // With axes left a timeout armed for this one finds nothing due and re-arms
+        if (_count == 0) _timer.detach();
+    }
+
+    core_util_critical_section_exit();
+}
+
+/*! Arms the timer for the earliest deadline */
+void StepScheduler::arm(us_timestamp_t now) {
+    us_timestamp_t due = deadlineToUs(_heap[0]->_deadline);
+    _timer.attach_us(_timerInterruptCb, (due > now) ? due - now : 0);
+}
+
+void StepScheduler::_timerInterrupt() {
+    while (_count > 0) {
+        ScheduledStepGenerator* axis = _heap[0];
+        us_timestamp_t now = _clock.read_high_resolution_us();
+        us_timestamp_t due = deadlineToUs(axis->_deadline);
+
+        if (due > now + STEP_SCHEDULER_MIN_ARM_US) {
+            arm(now);
+            return;
+        }
+
+        axis->_stepPin = 1; // Enable step pin
+
+        if ((now > due) && (now - due > _maxLateness_us)) _maxLateness_us = now - due;
+
+        uint32_t interval = axis->nextInterval.call();
+
+        if (interval == 0) {
+            remove(axis);
+            axis->_stepPin = 0;
+            axis->moveDone.call();
+        } else {
+            axis->_deadline += interval;
+            siftDown(0);
+            axis->_stepPin = 0; // Disable step pin
+        }
+    }
+}
+
+void StepScheduler::place(ScheduledStepGenerator* axis, int index) {
+    _heap[index] = axis;
+    axis->_heapIndex = index;
+}
+
+void StepScheduler::siftUp(int index) {
+    ScheduledStepGenerator* axis = _heap[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (_heap[parent]->_deadline <= axis->_deadline) break;
+        place(_heap[parent], index);
+        index = parent;
+    }
+    place(axis, index);
+}
+
+void StepScheduler::siftDown(int index) {
+    ScheduledStepGenerator* axis = _heap[index];
+
+    while (true) {
+        int child = 2 * index + 1;
+        if (child >= _count) break;
+        if ((child + 1 < _count) && (_heap[child + 1]->_deadline < _heap[child]->_deadline)) child++;
+        if (axis->_deadline <= _heap[child]->_deadline) break;
+        place(_heap[child], index);
+        index = child;
+    }
+    place(axis, index);
+}
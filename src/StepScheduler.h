@@ -0,0 +1,72 @@
+#ifndef STEPSCHEDULER_H
+#define STEPSCHEDULER_H
+#include "mbed.h"
+#include "StepGenerator.h"
+
+// Axes (pumps) sharing one scheduler
+#define STEP_SCHEDULER_MAX_AXES 4
+// Steps due within this time are output in the running interrupt instead of
+// re-arming the timer, re-arming costs about as long
+#define STEP_SCHEDULER_MIN_ARM_US 4
+
+class StepScheduler;
+
+/*! Step generator backend of one axis of a StepScheduler */
+class ScheduledStepGenerator : public StepGenerator {
+
+    public:
+        ScheduledStepGenerator(StepScheduler* scheduler, PinName stepPin);
+
+        virtual bool supports(uint32_t minInterval, uint32_t maxInterval);
+        virtual bool fits(uint32_t minInterval, uint32_t maxInterval);
+        virtual void start(uint32_t firstInterval);
+        virtual void stop();
+        virtual int pendingSteps();
+
+    private:
+        friend class StepScheduler;
+
+        StepScheduler* _scheduler;
+        DigitalOut _stepPin;
+        uint64_t _deadline; // Next step, Q.8 microseconds on the scheduler clock
+        int _heapIndex; // Position in the deadline heap, -1 while idle
+};
+
+/*! Step generation of several axes on one timer.
+ *
+ *  The next step deadlines of all running axes are kept in a min-heap and a single
+ *  Timeout is armed for the earliest one. Deadlines are absolute and advance by the
+ *  Q24.8 interval of each step, so re-arming latency does not accumulate and the
+ *  fraction of a microsecond is carried from step to step. */
+class StepScheduler {
+
+    public:
+        StepScheduler();
+
+        // Largest delay of a step behind its deadline since the last reset
+        uint32_t maxLateness_us();
+        void resetMaxLateness();
+        int runningAxes();
+
+    private:
+        friend class ScheduledStepGenerator;
+
+        void add(ScheduledStepGenerator* axis, uint32_t firstInterval);
+        void remove(ScheduledStepGenerator* axis);
+        void arm(us_timestamp_t now);
+        void _timerInterrupt();
+        const Callback<void()> _timerInterruptCb;
+
+        // Deadline heap
+        void place(ScheduledStepGenerator* axis, int index);
+        void siftUp(int index);
+        void siftDown(int index);
+        ScheduledStepGenerator* _heap[STEP_SCHEDULER_MAX_AXES];
+        int _count;
+
+        Timer _clock;
+        Timeout _timer;
+        volatile uint32_t _maxLateness_us;
+};
+
+#endif
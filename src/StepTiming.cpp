@@ -0,0 +1,103 @@
+#include "mbed.h"
+#include "StepGenerator.h"
+
+/*! Constructor */
+StepTiming::StepTiming() :
+    _enabled(false),
+    _scheduled(false),
+    _cyclesPerUs(1),
+    _period(0),
+    _due(0),
+    _dueFrac(0) {
+
+    memset(&_stats, 0, sizeof(StepTimingStats));
+}
+
+void StepTiming::enable(bool enabled) {
+    if (enabled) {
+        // Start the cycle counter
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        _cyclesPerUs = SystemCoreClock / 1000000;
+    }
+
+    core_util_critical_section_enter();
+    memset(&_stats, 0, sizeof(StepTimingStats));
+    // Measured from the start of the next move on
+    _scheduled = false;
+    _enabled = enabled;
+    core_util_critical_section_exit();
+}
+
+/*! Copies the statistics, consistent even while a move is running */
+void StepTiming::read(StepTimingStats* stats) {
+    core_util_critical_section_enter();
+    memcpy(stats, &_stats, sizeof(StepTimingStats));
+    core_util_critical_section_exit();
+}
+
+void StepTiming::start(uint32_t firstInterval) {
+    if (!_enabled) return;
+
+    _due = DWT->CYCCNT;
+    _dueFrac = 0;
+    advance(firstInterval);
+    _scheduled = true;
+}
+
+void StepTiming::next(uint32_t interval) {
+    if (!_enabled || !_scheduled) return;
+
+    advance(interval);
+}
+
+void StepTiming::cancel() {
+    _scheduled = false;
+}
+
+uint32_t StepTiming::stepStart() {
+    uint32_t now = DWT->CYCCNT;
+    if (!_enabled || !_scheduled) return now;
+
+    // Wrapping difference, steps are far less than a counter period apart
+    int32_t error = (int32_t)(now - _due);
+    uint32_t lateness = (error < 0) ? -error : error;
+    if ((error > 0) && ((uint32_t)error >= _period)) _stats.missedDeadlines++;
+
+    uint32_t ns = toNs(lateness);
+    if (ns > _stats.maxError_ns) _stats.maxError_ns = ns;
+    _stats.errorHistogram[bin(ns)]++;
+    _stats.steps++;
+
+    return now;
+}
+
+void StepTiming::stepEnd(uint32_t start) {
+    if (!_enabled) return;
+
+    uint32_t ns = toNs(DWT->CYCCNT - start);
+    if (ns > _stats.maxIsr_ns) _stats.maxIsr_ns = ns;
+    _stats.isrHistogram[bin(ns)]++;
+}
+
+/*! Moves the due time on by a Q24.8 interval, keeping the fraction of a cycle */
+void StepTiming::advance(uint32_t interval) {
+    uint64_t cycles = (uint64_t)interval * _cyclesPerUs + _dueFrac;
+
+    _period = (uint32_t)(cycles >> STEP_INTERVAL_FRAC_BITS);
+    _due += _period;
+    _dueFrac = (uint32_t)cycles & ((1 << STEP_INTERVAL_FRAC_BITS) - 1);
+}
+
+uint32_t StepTiming::toNs(uint32_t cycles) {
+    uint64_t ns = ((uint64_t)cycles * 1000) / _cyclesPerUs;
+    return (ns > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (uint32_t)ns;
+}
+
+/*! Histogram bin of a duration */
+int StepTiming::bin(uint32_t ns) {
+    uint32_t scaled = ns >> STEP_TIMING_BIN0_SHIFT;
+    int bin = (scaled == 0) ? 0 : 32 - __builtin_clz(scaled);
+    return (bin < STEP_TIMING_BINS) ? bin : STEP_TIMING_BINS - 1;
+}
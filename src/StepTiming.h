@@ -0,0 +1,55 @@
+#ifndef STEPTIMING_H
+#define STEPTIMING_H
+#include "mbed.h"
+
+// Logarithmic histograms, bin k counts values below 2^(k + STEP_TIMING_BIN0_SHIFT) ns
+// (bin 0 < 128 ns, bin 18 < 33.5 ms), the last bin counts everything above
+#define STEP_TIMING_BINS 20
+#define STEP_TIMING_BIN0_SHIFT 7
+
+typedef struct {
+    uint32_t steps; // Steps measured
+    uint32_t missedDeadlines; // Steps late by a whole interval or more
+    uint32_t maxError_ns; // Largest deviation of a step from its scheduled time
+    uint32_t maxIsr_ns; // Longest step interrupt
+    uint32_t errorHistogram[STEP_TIMING_BINS]; // Deviation of the steps from their scheduled time
+    uint32_t isrHistogram[STEP_TIMING_BINS]; // Execution time of the step interrupt
+} __attribute__((__packed__)) StepTimingStats;
+
+/*! Step timing instrumentation with the DWT cycle counter.
+ *
+ *  While enabled, the step interrupt timestamps every step and compares it with the
+ *  time the step was due according to the step intervals, and measures how long the
+ *  interrupt itself takes. Disabled (the default) it costs one flag check per step. */
+class StepTiming {
+
+    public:
+        StepTiming();
+
+        // Enabling clears the statistics
+        void enable(bool enabled);
+        bool isEnabled() { return _enabled; }
+        void read(StepTimingStats* stats);
+
+        // Called by the step generator, intervals are Q24.8 microseconds
+        void start(uint32_t firstInterval); // First step of a move due after firstInterval
+        void next(uint32_t interval); // Following step due interval after the last one
+        void cancel(); // Move stopped or done
+        uint32_t stepStart(); // At the step edge, returns the timestamp for stepEnd
+        void stepEnd(uint32_t start); // At the end of the step interrupt
+
+    private:
+        void advance(uint32_t interval);
+        uint32_t toNs(uint32_t cycles);
+        static int bin(uint32_t ns);
+
+        volatile bool _enabled;
+        bool _scheduled;
+        uint32_t _cyclesPerUs;
+        uint32_t _period; // Interval to the next step in cycles
+        uint32_t _due; // Cycle count the next step is due at
+        uint32_t _dueFrac; // Fraction of a cycle carried to the next step (Q.8)
+        StepTimingStats _stats;
+};
+
+#endif
@@ -5,23 +5,48 @@
 
 const double PI = 3.141592653589793;
 
-/*! Initialise list of responding functions */
+/*! Initialise list of responding functions, ACCESS_ANY messages are accepted from
+ *  every client, ACCESS_CONTROL ones only from the client in control. WHEN_IDLE
+ *  messages are refused while their pump is running, WHILE_RUNNING ones are not */
 const SyringePump::ComMessage SyringePump::comMessages[] = {
-    {FID_GET_STATUS, (SyringePump::messageHandlerFunc)&SyringePump::getStatus},
-    {FID_STOP_PUMP, (SyringePump::messageHandlerFunc)&SyringePump::stopPump},
-    {FID_START_PUMP, (SyringePump::messageHandlerFunc)&SyringePump::startPump},
-    {FID_SET_HARDWARE_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::setHardwareConfig},
-    {FID_SET_FLOW_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::setFlowConfig},
-    {FID_GET_HARDWARE_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::getHardwareConfig},
-    {FID_MAX_PULL, (SyringePump::messageHandlerFunc)&SyringePump::maxPull},
-    {FID_MAX_PUSH, (SyringePump::messageHandlerFunc)&SyringePump::maxPush},
-    {FID_DISABLE_MOTOR_HOLD, (SyringePump::messageHandlerFunc)&SyringePump::disableMotorHold},
-    {FID_GET_STEPDRV_ERROR, (SyringePump::messageHandlerFunc)&SyringePump::getStepDrvErrorId},
-    {FID_GET_FLOW_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::getFlowConfig},
-    {FID_RESET_PUMP, (SyringePump::messageHandlerFunc)&SyringePump::resetPump},
-    {FID_GET_PUMP_ERROR, (SyringePump::messageHandlerFunc)&SyringePump::getPumpErrorId},
-    {FID_GET_SYS_INFO, (SyringePump::messageHandlerFunc)&SyringePump::getSysInfo},
-    {FID_IDENTIFY_ITSELF, (SyringePump::messageHandlerFunc)&SyringePump::identifyItself}
+    {FID_GET_STATUS, (SyringePump::messageHandlerFunc)&SyringePump::getStatus, ACCESS_ANY, WHILE_RUNNING},
+    {FID_STOP_PUMP, (SyringePump::messageHandlerFunc)&SyringePump::stopPump, ACCESS_CONTROL, WHILE_RUNNING},
+    {FID_START_PUMP, (SyringePump::messageHandlerFunc)&SyringePump::startPump, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_SET_HARDWARE_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::setHardwareConfig, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_SET_FLOW_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::setFlowConfig, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_HARDWARE_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::getHardwareConfig, ACCESS_ANY, WHEN_IDLE},
+    {FID_MAX_PULL, (SyringePump::messageHandlerFunc)&SyringePump::maxPull, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_MAX_PUSH, (SyringePump::messageHandlerFunc)&SyringePump::maxPush, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_DISABLE_MOTOR_HOLD, (SyringePump::messageHandlerFunc)&SyringePump::disableMotorHold, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_STEPDRV_ERROR, (SyringePump::messageHandlerFunc)&SyringePump::getStepDrvErrorId, ACCESS_ANY, WHILE_RUNNING},
+    {FID_GET_FLOW_CONFIG, (SyringePump::messageHandlerFunc)&SyringePump::getFlowConfig, ACCESS_ANY, WHEN_IDLE},
+    {FID_RESET_PUMP, (SyringePump::messageHandlerFunc)&SyringePump::resetPump, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_PUMP_ERROR, (SyringePump::messageHandlerFunc)&SyringePump::getPumpErrorId, ACCESS_ANY, WHEN_IDLE},
+    {FID_GET_SYS_INFO, (SyringePump::messageHandlerFunc)&SyringePump::getSysInfo, ACCESS_ANY, WHEN_IDLE},
+    {FID_IDENTIFY_ITSELF, (SyringePump::messageHandlerFunc)&SyringePump::identifyItself, ACCESS_ANY, WHEN_IDLE},
+    {FID_SET_FLOW_PROGRAM, (SyringePump::messageHandlerFunc)&SyringePump::setFlowProgram, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_START_FLOW_PROGRAM, (SyringePump::messageHandlerFunc)&SyringePump::startFlowProgram, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_SET_STEP_TIMING, (SyringePump::messageHandlerFunc)&SyringePump::setStepTiming, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_STEP_TIMING, (SyringePump::messageHandlerFunc)&SyringePump::getStepTiming, ACCESS_ANY, WHILE_RUNNING},
+    {FID_SET_FLOW_RATE, (SyringePump::messageHandlerFunc)&SyringePump::setFlowRate, ACCESS_CONTROL, WHILE_RUNNING},
+    {FID_SET_STALL_DETECTION, (SyringePump::messageHandlerFunc)&SyringePump::setStallDetection, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_STALL_DETECTION, (SyringePump::messageHandlerFunc)&SyringePump::getStallDetection, ACCESS_ANY, WHILE_RUNNING},
+    {FID_GET_COM_TIMING, (SyringePump::messageHandlerFunc)&SyringePump::getComTiming, ACCESS_ANY, WHEN_IDLE},
+    {FID_TAKE_CONTROL, (SyringePump::messageHandlerFunc)&SyringePump::takeControl, ACCESS_CONTROL, WHILE_RUNNING},
+    {FID_RELEASE_CONTROL, (SyringePump::messageHandlerFunc)&SyringePump::releaseControl, ACCESS_ANY, WHILE_RUNNING},
+    {FID_SUBSCRIBE_STATUS, (SyringePump::messageHandlerFunc)&SyringePump::subscribeStatus, ACCESS_ANY, WHILE_RUNNING},
+    {FID_BATCH, (SyringePump::messageHandlerFunc)&SyringePump::runBatch, ACCESS_ANY, WHILE_RUNNING}, // Checked per sub-message
+    {FID_GET_SESSION_TOKEN, (SyringePump::messageHandlerFunc)&SyringePump::getSessionToken, ACCESS_ANY, WHILE_RUNNING}, // Does not take control
+    {FID_UPLOAD_FLOW_PROGRAM, (SyringePump::messageHandlerFunc)&SyringePump::uploadFlowProgram, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_PERF_STATS, (SyringePump::messageHandlerFunc)&SyringePump::getPerfStats, ACCESS_ANY, WHILE_RUNNING},
+    {FID_RESET_PERF_STATS, (SyringePump::messageHandlerFunc)&SyringePump::resetPerfStats, ACCESS_CONTROL, WHILE_RUNNING},
+    {FID_SYNC_CLOCK, (SyringePump::messageHandlerFunc)&SyringePump::syncClock, ACCESS_ANY, WHILE_RUNNING},
+    {FID_START_PUMP_AT, (SyringePump::messageHandlerFunc)&SyringePump::startPumpAt, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_SCHEDULED_START, (SyringePump::messageHandlerFunc)&SyringePump::getScheduledStart, ACCESS_ANY, WHILE_RUNNING},
+    {FID_SET_DRIVER_POLL, (SyringePump::messageHandlerFunc)&SyringePump::setDriverPoll, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_CLEAR_STEPDRV_ERROR, (SyringePump::messageHandlerFunc)&SyringePump::clearStepDrvError, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_SET_CURRENT_PROFILE, (SyringePump::messageHandlerFunc)&SyringePump::setCurrentProfile, ACCESS_CONTROL, WHEN_IDLE},
+    {FID_GET_CURRENT_PROFILE, (SyringePump::messageHandlerFunc)&SyringePump::getCurrentProfile, ACCESS_ANY, WHILE_RUNNING}
 };
 
 /*! Parameterized constructor */
@@ -39,9 +64,11 @@ SyringePump::SyringePump(
         PinName redLED,
         PinName stepperErrorPin,
         PinName stepperResetPin,
-        PinName slaPin)
+        PinName slaPin,
+        StepScheduler* stepScheduler)
         : _stepperDriver(mosi, miso, sclk, ss),
-        _motionController(stepPin),
+        _driverMonitor(&_stepperDriver),
+        _motionController(stepPin, stepScheduler),
         _maxLimSwPin(maxLimSwPin),
         _minLimSwPin(minLimSwPin),
         _stepperErrorPin(stepperErrorPin),
@@ -50,7 +77,7 @@ SyringePump::SyringePump(
         _redLED(redLED),
         _dirPin(dirPin),
         _stepperResetPin(stepperResetPin),
-        _slaPin(slaPin),
+        _stallDetector(slaPin),
         _fidCount(sizeof (comMessages) / sizeof (ComMessage)), // constant
         _msgHeaderLength(sizeof (MessageHeader)) { // constant
     // add additional code to execute during the construction
@@ -61,15 +88,60 @@ SyringePump::SyringePump(
     // D(printf("Number of FIDs: %d \n", _fidCount));
     // Initialise non-constant variables
     _flowConfigured = false;
+    _flowPumping = false;
+    
+    // This pump is channel 0 of its own server
+    _channels[0] = this;
+    _channelCount = 1;
+    _comServer = this;
+    _connection = NULL;
+    _connections = NULL;
+    _openConnections = 0;
+    _controller = NULL;
+    _sessionToken = 0;
+    _eventQueue = NULL;
+    _perfStats = NULL;
+    _asyncConnection = NULL;
+    _asyncRequestId = 0;
+    _asyncEvent = 0;
+    _driverJob = DRIVER_IDLE;
+    _driverConnection = NULL;
+    _driverRequestId = -1;
+    _replyDeferrable = false;
+    _driverPoll_ms = DRIVER_POLL_DEFAULT_MS;
+    _driverPollDue_us = 0;
+    _driverTimeouts = 0;
+    _driverMonitor.callbackChange = callback(this, &SyringePump::driverStatusChanged);
+    memset(&_currentProfile, 0, sizeof(_currentProfile));
+    _currentLevel = CURRENT_HOLD;
+    core_util_atomic_flag_clear(&_currentPending);
+    core_util_atomic_flag_clear(&_driverStatusPending);
+    _current_mA = 0;
+    memset(_subscriptions, 0, sizeof(_subscriptions));
+    core_util_atomic_flag_clear(&_comPending);
     
     _hardwareConfig = new HardwareConfig;            
     _flowConfig = new FlowConfig;
     _pumpErrorList = new PumpErrorList;
+    _flowProgramBuffer = new FlowProgram;
+    _flowUpload = new FlowProgram;
+    _flowProgram = _flowProgramBuffer->segments;
+    
+    _flowProgramLength = 0;
+    _flowProgramRunning = false;
+    _flowSegment = -1;
+    _flowStepRest = 0.0;
+    
+    _startPending = false;
+    _startTime_us = 0;
+    _startedAt_us = 0;
             
     _pumpErrorList->maxLimitSwitchActive = 0;
     _pumpErrorList->minLimitSwitchActive = 0;
     _pumpErrorList->stepperDriverError = 0;
     _pumpErrorList->stepperDriverNotConfigured = 0;
+    _pumpErrorList->stallDetected = 0;
+    _pumpErrorList->stepperDriverWarning = 0;
             
     _pumpError = 0;
             
@@ -83,21 +155,27 @@ SyringePump::SyringePump(
 /*! Get status */
 void SyringePump::getStatus(const MessageHeader* data) { 
     static SystemStatus status; // static is needed to avoid memory allocation every time the function is called
+    int length = compatLength(sizeof(SystemStatus), offsetof(SystemStatus, status.flowSegment));
     
-    status.header.packetLength = sizeof(SystemStatus);
-    status.header.fid = FID_GET_STATUS;
+    status.header.packetLength = length;
+    status.header.fid = data->fid;
     
-    status.pumpState = _pumpState;
-    status.pumpError = _pumpError;
+    readStatus(&status.status);
     
-    status.suppliedVolume_ml = _motionController.getStepsPerformed() / _stepsPer_ml;
-    if (_pumpState == PUMP_RUNNING) {
-        status.flowRate_mlmin = ((1000000.0f / _motionController.getC()) / _stepsPer_ml) * 60.0f;
+    sendReply(&status, length);
+}
+
+void SyringePump::readStatus(PumpStatus* status) {
+    status->pumpState = _pumpState;
+    status->pumpError = _pumpError;
+    
+    status->suppliedVolume_ml = _motionController.getStepsPerformed() / _stepsPer_ml;
+    if ((_pumpState == PUMP_RUNNING) && !_startPending) {
+        status->flowRate_mlmin = ((1000000.0f / _motionController.getC()) / _stepsPer_ml) * 60.0f;
     } else {
-        status.flowRate_mlmin = 0.0f;
+        status->flowRate_mlmin = 0.0f;
     }
-    
-    _socket->send((char*) &status, sizeof(SystemStatus));
+    status->flowSegment = _flowProgramRunning ? _flowSegment : -1;
 }
 
 /*! Get system info */
@@ -105,14 +183,14 @@ void SyringePump::getSysInfo(const MessageHeader* data) {
     static SystemInfo systemInfo;
     
     systemInfo.header.packetLength = sizeof(SystemInfo);
-    systemInfo.header.fid = FID_GET_SYS_INFO;
+    systemInfo.header.fid = data->fid;
     
     strcpy(systemInfo.fwVersion, FW_VERSION);
     strcpy(systemInfo.pumpId, PUMP_ID);
     strcpy(systemInfo.ipAddr, _ipAddr.get_ip_address());
     strcpy(systemInfo.macAddr, _macAddr);
     
-    _socket->send((char*) &systemInfo, sizeof(SystemInfo));
+    sendReply(&systemInfo, sizeof(SystemInfo));
 }
 
 /*! Identify itself */
@@ -128,47 +206,64 @@ void SyringePump::identifyItself(const MessageHeader* data) {
 void SyringePump::stopPump(const MessageHeader* data) {    
     // D(printf("stopPump command received\n"));
     
+    haltPump();
+    // If everything went OK
+    comReturn(data, MSG_OK);
+}
+
+/*! Stops the pump, for FID_STOP_PUMP over TCP and UDP */
+void SyringePump::haltPump() {
     disablePump();
     
     setPumpState(IDLE, true);
-    // If everything went OK
-    comReturn(data, MSG_OK);
 }
 
 /*! Start pump */
 void SyringePump::startPump(const MessageHeader* data) {    
     // D(printf("Starting Pump\n"));
     
+    int error = prepareStart(CURRENT_ACCEL);
+    if (error == MSG_OK) {
+        _motionController.run();
+        
+        // Indicate state of a system
+        setPumpState(PUMP_RUNNING);
+    }
+    
+    comReturn(data, error);
+}
+
+/*! Sets up the move of the flow config and enables the driver at the current of the
+ *  level, the caller starts it */
+int SyringePump::prepareStart(int currentLevel) {
     if (!_flowConfigured) {
         // Flow not configured
-        comReturn(data, MSG_ERROR_FLOW_NOT_CONFIGURED);
-        return;
+        return MSG_ERROR_FLOW_NOT_CONFIGURED;
     }
     //! Hardware must be already configured in advance
         
     // Check for limit switches and direction (0 = pull, 1 = push)
     if (((_maxLimSwPin == 0) && (_flowConfig->direction == 1))
         || ((_minLimSwPin == 0) && (_flowConfig->direction == 0))) {
-        comReturn(data, MSG_ERROR_LIMIT_SW_ACTIVE);
-        return;
+        return MSG_ERROR_LIMIT_SW_ACTIVE;
     }
     
     if (_pumpErrorList->stepperDriverError == 1) { // Error in the stepper driver
-        comReturn(data, MSG_ERROR_STEPDRV_ERR);
-        return;
+        return MSG_ERROR_STEPDRV_ERR;
     }
     
-    // Calculate syringe area
-    float syringeArea_mm2 = PI * pow((_flowConfig->syringeDiameter_mm / 2.0f), 2);
-    // D(printf("Syringe area = %f \n", syringeArea_mm2));
     // Total steps per revolution
     float stepsPerRev = _hardwareConfig->stepMode * _hardwareConfig->stepsPerRev;
     // Calculate steps/ml
-    float stepsPer_ml = ((1000.0f / syringeArea_mm2) * stepsPerRev) / _hardwareConfig->leadScrewPitch_mm;
+    double stepsPer_ml = calcStepsPer_ml(_flowConfig->syringeDiameter_mm);
     _stepsPer_ml = stepsPer_ml;
     // Calculate total steps required
-    float steps = (_flowConfig->desVolume_ml * stepsPer_ml); 
-    float stepsPerSec = (_flowConfig->desFlowrate_mlpmin / 60.0f * stepsPer_ml);
+    double steps = (_flowConfig->desVolume_ml * stepsPer_ml); 
+    float stepsPerSec = (_flowConfig->desFlowrate_mlpmin / 60.0 * stepsPer_ml);
+    
+    if (steps > MOTION_MAX_STEPS) {
+        return MSG_ERROR_INVALID_PARAMETER;
+    }
     
     // Set constant acceleration and deceleration (steps/s)
     // must be based on the microstepping mode 
@@ -176,22 +271,19 @@ void SyringePump::startPump(const MessageHeader* data) {
     float decel = _hardwareConfig->pumpDec_RevPerSecSec * stepsPerRev; // converting rev/s^2 to steps/s^2
     
     // Configure motion profile
-    _motionController.configure(steps, stepsPerSec, accel, decel);
+    _motionController.configure(steps, stepsPerSec, accel, decel, _hardwareConfig->motionProfile);
     // Create motion profile
-    if (_motionController.createMotionProfile()) {
-        // Motion profile created successfully
-        _stepperDriver.enableDriver();
-    
-        _motionController.run();
-        
-        // Indicate state of a system
-        setPumpState(PUMP_RUNNING);
-
-        comReturn(data, MSG_OK);
-    } else {
+    if (!_motionController.createMotionProfile()) {
         // Error in creating motion profile (occurs when user requests to switch way too fast)
-        comReturn(data, MSG_ERROR_SWITCHING_OVER_MAX);
+        return MSG_ERROR_SWITCHING_OVER_MAX;
     }
+    
+    // Motion profile created successfully
+    setMotorCurrent(currentLevel);
+    _stepperDriver.enableDriver();
+    _flowPumping = true;
+    
+    return MSG_OK;
 }
 
 /*! Configure hardware */
@@ -208,8 +300,12 @@ void SyringePump::setHardwareConfig(const SetHardwareConfig* data) {
     // D(printf("pumpAcc_RevPerSecSec = %f \n", data->hardwareConfig.pumpAcc_RevPerSecSec));
     // D(printf("pumpDec_RevPerSecSec = %f \n", data->hardwareConfig.pumpDec_RevPerSecSec));
          
+    // Older clients send the config without the motion profile
+    bool legacy = (data->header.packetLength == offsetof(SetHardwareConfig, hardwareConfig.motionProfile));
+    
     // Do some checks
-    if (((data->hardwareConfig.maxDriverCurrent_mA > 3000) || (data->hardwareConfig.maxDriverCurrent_mA < 132))
+    if ((!legacy && (data->header.packetLength != sizeof(SetHardwareConfig)))
+        || ((data->hardwareConfig.maxDriverCurrent_mA > 3000) || (data->hardwareConfig.maxDriverCurrent_mA < 132))
         || (data->hardwareConfig.leadScrewPitch_mm <= 0) || (data->hardwareConfig.leadScrewPitch_mm >= 10)
         || (data->hardwareConfig.stepsPerRev <= 0) || (data->hardwareConfig.stepsPerRev > 1000)
         || ((data->hardwareConfig.pwmFrequency != 0) && (data->hardwareConfig.pwmFrequency != 1))
@@ -218,7 +314,8 @@ void SyringePump::setHardwareConfig(const SetHardwareConfig* data) {
         || (data->hardwareConfig.maxPullPushAcc_RevPerSecSec > 10) || (data->hardwareConfig.maxPullPushAcc_RevPerSecSec <= 0)
         || (data->hardwareConfig.maxPullPushVel_RevPerSec > 10) || (data->hardwareConfig.maxPullPushVel_RevPerSec <= 0)
         || (data->hardwareConfig.pumpAcc_RevPerSecSec > 10) || (data->hardwareConfig.pumpAcc_RevPerSecSec <= 0)
-        || (data->hardwareConfig.pumpDec_RevPerSecSec > 10) || (data->hardwareConfig.pumpDec_RevPerSecSec <= 0)) {
+        || (data->hardwareConfig.pumpDec_RevPerSecSec > 10) || (data->hardwareConfig.pumpDec_RevPerSecSec <= 0)
+        || (!legacy && (data->hardwareConfig.motionProfile > MotionController::PROFILE_SCURVE))) {
         comReturn(data, MSG_ERROR_INVALID_PARAMETER);
         return;
     }
@@ -240,10 +337,22 @@ void SyringePump::setHardwareConfig(const SetHardwareConfig* data) {
             
     // Hardware config checked, save it
     memcpy(_hardwareConfig, &data->hardwareConfig, sizeof(HardwareConfig));
+    if (legacy) {
+        _hardwareConfig->motionProfile = MotionController::PROFILE_TRAPEZOIDAL;
+    }
     
-    // Apply hardware config to the stepper driver
+    // Apply hardware config to the stepper driver, the reply waits for the
+    // verification if it runs in the background
     applyHardwareConfig();
+    if (_driverJob == DRIVER_CONFIG) {
+        if (deferDriverReply(&data->header)) return;
+        finishDriverJob(true);
+    }
     
+    replyHardwareConfigured(&data->header);
+}
+
+void SyringePump::replyHardwareConfigured(const MessageHeader* data) {
     if (_pumpErrorList->stepperDriverNotConfigured) {
         comReturn(data, MSG_ERROR_STEPDRV_NOT_CONFIGURED);
     } else {
@@ -277,34 +386,36 @@ void SyringePump::setFlowConfig(const SetFlowConfig* data) {
     // Set global variable
     setFlowConfigured(true);
     
-    if (_pumpErrorList->stepperDriverNotConfigured) {
-        comReturn(data, MSG_ERROR_STEPDRV_NOT_CONFIGURED);
-    } else {
-        comReturn(data, MSG_OK);
+    // The reply waits for the verification if it runs in the background
+    if (_driverJob == DRIVER_CONFIG) {
+        if (deferDriverReply(&data->header)) return;
+        finishDriverJob(true);
     }
     
+    replyHardwareConfigured(&data->header);
 }
 
 void SyringePump::getHardwareConfig(const MessageHeader* data) {
     static GetHardwareConfig hwConfig; // static is needed to avoid memory allocation every time the function is called
+    int length = compatLength(sizeof(GetHardwareConfig), offsetof(GetHardwareConfig, hardwareConfig.motionProfile));
     
-    hwConfig.header.packetLength = sizeof(GetHardwareConfig);
-    hwConfig.header.fid = FID_GET_HARDWARE_CONFIG;
+    hwConfig.header.packetLength = length;
+    hwConfig.header.fid = data->fid;
     
     memcpy(&hwConfig.hardwareConfig, _hardwareConfig, sizeof(HardwareConfig));
     
-    _socket->send((char*) &hwConfig, sizeof(GetHardwareConfig));
+    sendReply(&hwConfig, length);
 }
 
 void SyringePump::getFlowConfig(const MessageHeader* data) {
     static GetFlowConfig flConfig; // static is needed to avoid memory allocation every time the function is called
     
     flConfig.header.packetLength = sizeof(GetFlowConfig);
-    flConfig.header.fid = FID_GET_FLOW_CONFIG;
+    flConfig.header.fid = data->fid;
     
     memcpy(&flConfig.flowConfig, _flowConfig, sizeof(FlowConfig));
     
-    _socket->send((char*) &flConfig, sizeof(GetFlowConfig));
+    sendReply(&flConfig, sizeof(GetFlowConfig));
 }
 
 void SyringePump::maxPull(const MessageHeader* data) {
@@ -336,6 +447,7 @@ void SyringePump::maxPull(const MessageHeader* data) {
     // Create motion profile
     _motionController.createMaxSpeedMotionProfile();
     
+    setMotorCurrent(CURRENT_ACCEL);
     _stepperDriver.enableDriver();
     
     _motionController.run();
@@ -374,6 +486,7 @@ void SyringePump::maxPush(const MessageHeader* data) {
     // Create motion profile
     _motionController.createMaxSpeedMotionProfile();
     
+    setMotorCurrent(CURRENT_ACCEL);
     _stepperDriver.enableDriver();
     
     _motionController.run();
@@ -397,6 +510,9 @@ void SyringePump::resetPump(const MessageHeader* data) {
     unsetPumpError(PUMP_MINLIM);
     unsetPumpError(PUMP_DRIVER_ERROR);
     unsetPumpError(PUMP_STEPDRV_NOT_CONFIGURED);
+    unsetPumpError(PUMP_STALL);
+    _pumpErrorList->stepperDriverWarning = 0;
+    _driverMonitor.clearFaults();
     // Hardware reset
     _stepperResetPin = 1;
     // wait(0.1);
@@ -423,16 +539,18 @@ void SyringePump::resetPump(const MessageHeader* data) {
     comReturn(data, MSG_OK);
 }
 
+/*! Flags seen by the status poller since they were cleared, without an SPI access.
+ *  Can be read while pumping */
 void SyringePump::getStepDrvErrorId(const MessageHeader* data) {
-    // Check if we can communicate to the stepper driver
-
-    uint16_t SR0 = _stepperDriver.readNonLatchedStatusFlags();
-    uint16_t SR2_SR1 = _stepperDriver.readLatchedStatusFlagsAndClear();
+    DriverStatus driverStatus;
+    _driverMonitor.read(&driverStatus);
+    uint16_t SR0 = driverStatus.stickyNonLatched;
+    uint16_t SR2_SR1 = driverStatus.stickyLatched;
     
     static GetStepperDriverError stepperDriverError; // static is needed to avoid memory allocation every time the function is called
     
     stepperDriverError.header.packetLength = sizeof(GetStepperDriverError);
-    stepperDriverError.header.fid = FID_GET_STEPDRV_ERROR;
+    stepperDriverError.header.fid = data->fid;
     
     // Check for every possible error
     // SR0
@@ -452,18 +570,619 @@ void SyringePump::getStepDrvErrorId(const MessageHeader* data) {
     stepperDriverError.OVCYPB = (SR2_SR1 & AMIS30543::OVCYPB) > 0 ? 1 : 0;
     stepperDriverError.OVCYPT = (SR2_SR1 & AMIS30543::OVCYPT) > 0 ? 1 : 0;
   
-    _socket->send((char*) &stepperDriverError, sizeof(GetStepperDriverError)); 
+    sendReply(&stepperDriverError, sizeof(GetStepperDriverError)); 
+}
+
+/*! Period of the status register polls */
+void SyringePump::setDriverPoll(const SetDriverPoll* data) {
+    if ((data->period_ms < STATUS_STREAM_TICK_MS) || (data->period_ms > DRIVER_POLL_MAX_MS)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    _driverPoll_ms = data->period_ms;
+    _driverPollDue_us = 0;
+    comReturn(data, MSG_OK);
+}
+
+/*! Forgets the flags the poller has seen, those still present stay */
+void SyringePump::clearStepDrvError(const MessageHeader* data) {
+    _driverMonitor.clearFaults();
+    comReturn(data, MSG_OK);
+}
+
+/*! Starts a poll of the status registers when it is due, on the stream tick. A
+ *  poll does not wait for the driver, it is tried again on the next tick. A batch of
+ *  the driver which had to be aborted meanwhile is a driver error */
+void SyringePump::pollDriver(uint64_t now_us) {
+    uint32_t timeouts = _stepperDriver.getTimeoutCount();
+    if (timeouts != _driverTimeouts) {
+        _driverTimeouts = timeouts;
+        setPumpError(PUMP_DRIVER_ERROR);
+    }
+    
+    if ((now_us < _driverPollDue_us) || (_driverJob != DRIVER_IDLE)) return;
+    if (!_driverMonitor.poll()) return;
+    
+    _driverPollDue_us += _driverPoll_ms * 1000;
+    if (_driverPollDue_us <= now_us) _driverPollDue_us = now_us + _driverPoll_ms * 1000;
+}
+
+/*! Motor current levels while moving and holding */
+void SyringePump::setCurrentProfile(const SetCurrentProfile* data) {
+    const CurrentProfile* profile = &data->profile;
+    uint16_t max_mA = _hardwareConfig->maxDriverCurrent_mA;
+    
+    if (((profile->enabled != 0) && (profile->enabled != 1))
+        || (profile->hold_mA < 132) || (profile->hold_mA > max_mA)
+        || (profile->cruise_mA < 132) || (profile->cruise_mA > max_mA)
+        || (profile->accel_mA < 132) || (profile->accel_mA > max_mA)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    _currentProfile = *profile;
+    applyMotorCurrent();
+    comReturn(data, MSG_OK);
+}
+
+void SyringePump::getCurrentProfile(const MessageHeader* data) {
+    static GetCurrentProfile currentProfile; // static is needed to avoid memory allocation every time the function is called
+    
+    currentProfile.header.packetLength = sizeof(GetCurrentProfile);
+    currentProfile.header.fid = data->fid;
+    currentProfile.profile = _currentProfile;
+    currentProfile.current_mA = _current_mA;
+    
+    sendReply(&currentProfile, sizeof(GetCurrentProfile));
+}
+
+/*! Driver current of a level, the configured maximum while the profile is off */
+uint16_t SyringePump::profileCurrent_mA(int level) {
+    uint16_t max_mA = _hardwareConfig->maxDriverCurrent_mA;
+    if (!_currentProfile.enabled) return max_mA;
+    
+    uint16_t current_mA = _currentProfile.hold_mA;
+    if (level == CURRENT_CRUISE) current_mA = _currentProfile.cruise_mA;
+    else if (level == CURRENT_ACCEL) current_mA = _currentProfile.accel_mA;
+    
+    return (current_mA > max_mA) ? max_mA : current_mA;
+}
+
+/*! Switches the driver current to a level of the profile. The SPI write cannot run
+ *  in an interrupt, from there it is posted to the server's event queue and several
+ *  switches before it runs end in one write of the last level */
+void SyringePump::setMotorCurrent(int level, bool calledFromIRQ) {
+    _currentLevel = level;
+    if (!_currentProfile.enabled) return;
+    
+    if (!calledFromIRQ) {
+        applyMotorCurrent();
+        return;
+    }
+    
+    if ((_comServer == NULL) || (_comServer->_eventQueue == NULL)) return;
+    if (core_util_atomic_flag_test_and_set(&_currentPending)) return;
+    if (_comServer->_eventQueue->call(this, &SyringePump::applyMotorCurrent) == 0) {
+        core_util_atomic_flag_clear(&_currentPending);
+    }
+}
+
+/*! Writes the current of the present level, the driver skips unchanged values */
+void SyringePump::applyMotorCurrent() {
+    core_util_atomic_flag_clear(&_currentPending);
+    
+    _current_mA = profileCurrent_mA(_currentLevel);
+    _stepperDriver.setCurrentMilliamps(_current_mA);
+}
+
+/*! The motion controller entered another ramp phase, step interrupt */
+void SyringePump::rampStateChanged(int state) {
+    setMotorCurrent((state == MotionController::RAMP_MAX) ? CURRENT_CRUISE : CURRENT_ACCEL, true);
+}
+
+/*! A poll found other flags, interrupt context. They are taken over on the server's
+ *  event queue, several changes before it runs end in one update */
+void SyringePump::driverStatusChanged() {
+    if ((_comServer == NULL) || (_comServer->_eventQueue == NULL)) return;
+    if (core_util_atomic_flag_test_and_set(&_driverStatusPending)) return;
+    if (_comServer->_eventQueue->call(this, &SyringePump::applyDriverStatus) == 0) {
+        core_util_atomic_flag_clear(&_driverStatusPending);
+    }
+}
+
+/*! Takes over the flags of the last poll. The thermal warning is raised before the
+ *  driver shuts down. It is no error: it does not set _pumpError, which lets every
+ *  command through while pumping, and does not blink the error LED */
+void SyringePump::applyDriverStatus() {
+    core_util_atomic_flag_clear(&_driverStatusPending);
+    
+    DriverStatus driverStatus;
+    _driverMonitor.read(&driverStatus);
+    
+    _pumpErrorList->stepperDriverWarning = (driverStatus.nonLatched & AMIS30543::TW) ? 1 : 0;
+}
+
+void SyringePump::getPumpErrorId(const MessageHeader* data) { 
+    static GetPumpError pumpError; // static is needed to avoid memory allocation every time the function is called
+    int length = compatLength(sizeof(GetPumpError), offsetof(GetPumpError, pumpErrors.stallDetected));
+    
+    pumpError.header.packetLength = length;
+    pumpError.header.fid = data->fid;
+    
+    memcpy(&pumpError.pumpErrors, _pumpErrorList, sizeof(PumpErrorList));
+  
+    sendReply(&pumpError, length); 
+}
+
+/*! Upload a flow program (or a chunk of it) */
+void SyringePump::setFlowProgram(const SetFlowProgram* data) {
+    int first = data->firstSegment;
+    int count = data->segmentCount;
+    
+    // The packet must hold exactly the announced segments
+    if ((count <= 0) || (count > FLOW_PROGRAM_CHUNK)
+        || (data->header.packetLength != sizeof(SetFlowProgram) - (FLOW_PROGRAM_CHUNK - count) * sizeof(FlowSegment))
+        || ((first != 0) && (first != _flowProgramLength))
+        || (first + count > FLOW_PROGRAM_MAX_SEGMENTS)
+        || (data->syringeDiameter_mm <= 0) || (data->syringeDiameter_mm > 100)
+        || ((first != 0) && (data->syringeDiameter_mm != _flowProgramDiameter_mm))) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    if (!flowSegmentsValid(data->segments, count)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    memcpy(&_flowProgram[first], data->segments, count * sizeof(FlowSegment));
+    _flowProgramLength = first + count;
+    _flowProgramDiameter_mm = data->syringeDiameter_mm;
+    
+    comReturn(data, MSG_OK);
+}
+
+/*! Replace the flow program with a whole one. Programs longer than a plain frame are
+ *  streamed into the upload buffer by the server, shorter ones come in the message */
+void SyringePump::uploadFlowProgram(const MessageHeader* data) {
+    bool streamed = (data->packetLength == 0);
+    uint32_t length = (streamed ? _connection->messageLength() : data->packetLength) - _msgHeaderLength;
+    const uint32_t prefixLength = sizeof(FlowProgram) - sizeof(_flowUpload->segments);
+    
+    if ((length < prefixLength) || (length > sizeof(FlowProgram))) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    if (!streamed) {
+        memcpy(_flowUpload, (const char*)data + _msgHeaderLength, length);
+    }
+    
+    FlowProgram* program = _flowUpload;
+    int count = program->segmentCount;
+    if ((count == 0) || (count > FLOW_PROGRAM_MAX_SEGMENTS)
+        || (length != prefixLength + count * sizeof(FlowSegment))
+        || (program->syringeDiameter_mm <= 0) || (program->syringeDiameter_mm > 100)
+        || !flowSegmentsValid(program->segments, count)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    // Not running, the buffers can be swapped
+    _flowUpload = _flowProgramBuffer;
+    _flowProgramBuffer = program;
+    _flowProgram = program->segments;
+    _flowProgramLength = count;
+    _flowProgramDiameter_mm = program->syringeDiameter_mm;
+    
+    comReturn(data, MSG_OK);
+}
+
+/*! Run the uploaded flow program, segments are chained from the motion interrupt */
+void SyringePump::startFlowProgram(const MessageHeader* data) {
+    if (_flowProgramLength == 0) {
+        comReturn(data, MSG_ERROR_FLOW_NOT_CONFIGURED);
+        return;
+    }
+    
+    if (_pumpErrorList->stepperDriverError == 1) { // Error in the stepper driver
+        comReturn(data, MSG_ERROR_STEPDRV_ERR);
+        return;
+    }
+    
+    // Direction changes between segments go through the DIR pin (XORed with
+    // the SPI direction), SPI cannot be used from the interrupt
+    _stepperDriver.setDirection(0);
+    
+    _stepsPer_ml = calcStepsPer_ml(_flowProgramDiameter_mm);
+    _flowSegment = 0;
+    _flowStepRest = 0.0;
+    
+    int error = prepareFlowSegment();
+    if (error != MSG_OK) {
+        _dirPin = 0;
+        comReturn(data, error);
+        return;
+    }
+    
+    _flowProgramRunning = true;
+    setMotorCurrent(CURRENT_ACCEL);
+    _stepperDriver.enableDriver();
+    
+    _motionController.run();
+    
+    // Indicate state of a system
+    setPumpState(PUMP_RUNNING);
+    
+    comReturn(data, MSG_OK);
+}
+
+/*! Switch the step timing instrumentation on or off */
+void SyringePump::setStepTiming(const SetStepTiming* data) {
+    if ((data->enable != 0) && (data->enable != 1)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    _motionController.getStepTiming()->enable(data->enable == 1);
+    comReturn(data, MSG_OK);
+}
+
+/*! Step timing statistics, can be read while pumping */
+void SyringePump::getStepTiming(const MessageHeader* data) {
+    static GetStepTiming stepTiming; // static is needed to avoid memory allocation every time the function is called
+    
+    stepTiming.header.packetLength = sizeof(GetStepTiming);
+    stepTiming.header.fid = data->fid;
+    
+    _motionController.getStepTiming()->read(&stepTiming.stats);
+    
+    sendReply(&stepTiming, sizeof(GetStepTiming));
+}
+
+/*! Change the flow rate, while pumping the pump ramps to the new rate without stopping */
+void SyringePump::setFlowRate(const SetFlowRate* data) {
+    if ((data->flowrate_mlpmin <= 0) || (data->flowrate_mlpmin > 100)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    if (_pumpState != PUMP_RUNNING) {
+        // Takes effect with the next start
+        if (!_flowConfigured) {
+            comReturn(data, MSG_ERROR_FLOW_NOT_CONFIGURED);
+            return;
+        }
+        _flowConfig->desFlowrate_mlpmin = data->flowrate_mlpmin;
+        comReturn(data, MSG_OK);
+        return;
+    }
+    
+    // Flow programs and max pull/push have their own rates
+    if (!_flowPumping) {
+        comReturn(data, MSG_ERROR_NOT_SUPPORTED);
+        return;
+    }
+    
+    // The total volume stays the same, only the rate of the remaining part changes
+    if (!_motionController.changeSpeed(data->flowrate_mlpmin / 60.0f * _stepsPer_ml)) {
+        if (_motionController.getState() == MotionController::RAMP_MAX) {
+            comReturn(data, MSG_ERROR_SWITCHING_OVER_MAX);
+        } else {
+            comReturn(data, MSG_ERROR_NOT_AT_CONSTANT_SPEED);
+        }
+        return;
+    }
+    
+    _flowConfig->desFlowrate_mlpmin = data->flowrate_mlpmin;
+    comReturn(data, MSG_OK);
+}
+
+void SyringePump::setStallDetection(const SetStallDetection* data) {
+    if (((data->enable != 0) && (data->enable != 1)) || (data->threshold_mV > STALL_ADC_FULL_SCALE_MV)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    if ((data->enable == 1) && !_stallDetector.isSupported()) {
+        comReturn(data, MSG_ERROR_NOT_SUPPORTED);
+        return;
+    }
+    
+    _stallDetector.configure(data->enable == 1, data->threshold_mV);
+    comReturn(data, MSG_OK);
+}
+
+void SyringePump::getStallDetection(const MessageHeader* data) {
+    static GetStallDetection stallDetection; // static is needed to avoid memory allocation every time the function is called
+    
+    stallDetection.header.packetLength = sizeof(GetStallDetection);
+    stallDetection.header.fid = data->fid;
+    
+    _stallDetector.read(&stallDetection.status);
+    
+    sendReply(&stallDetection, sizeof(GetStallDetection));
+}
+
+void SyringePump::getComTiming(const MessageHeader* data) {
+    static GetComTiming comTiming; // static is needed to avoid memory allocation every time the function is called
+    
+    comTiming.header.packetLength = sizeof(GetComTiming);
+    comTiming.header.fid = data->fid;
+    
+    _connection->readTiming(&comTiming.timing);
+    
+    sendReply(&comTiming, sizeof(GetComTiming));
+}
+
+/*! Timestamps from which the host estimates the offset and drift of the device clock,
+ *  like NTP. Over UDP the request is stamped when it is received */
+void SyringePump::syncClock(const SyncClock* data) {
+    static SyncClock sync; // static is needed to avoid memory allocation every time the function is called
+    
+    if (data->header.packetLength != sizeof(MessageHeader) + sizeof(uint64_t)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    stampSyncClock(&sync, data, deviceTime());
+    sendReply(&sync, sizeof(SyncClock));
+}
+
+void SyringePump::stampSyncClock(SyncClock* reply, const SyncClock* request, us_timestamp_t received_us) {
+    reply->header.packetLength = sizeof(SyncClock);
+    reply->header.fid = request->header.fid;
+    reply->header.error = MSG_OK;
+    reply->hostTime_us = request->hostTime_us;
+    reply->received_us = received_us;
+    reply->sent_us = deviceTime();
+}
+
+/*! Prepares the move of the flow config now and starts it at a device time from the
+ *  timer interrupt. Until then the pump counts as running, FID_STOP_PUMP cancels it */
+void SyringePump::startPumpAt(const StartPumpAt* data) {
+    uint64_t now_us = deviceTime();
+    
+    if ((data->header.packetLength != sizeof(StartPumpAt))
+        || (data->startTime_us < now_us + START_AT_MIN_LEAD_US)
+        || (data->startTime_us > now_us + START_AT_MAX_LEAD_US)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    // Armed for up to START_AT_MAX_LEAD_US, it holds until then
+    int error = prepareStart(CURRENT_HOLD);
+    if (error != MSG_OK) {
+        comReturn(data, error);
+        return;
+    }
+    
+    _startTime_us = data->startTime_us;
+    _startedAt_us = 0;
+    _startPending = true;
+    setPumpState(PUMP_RUNNING);
+    
+    // Preparing took some of the lead
+    now_us = deviceTime();
+    uint64_t delay_us = (_startTime_us > now_us) ? _startTime_us - now_us : 0;
+    _startTimeout.attach(callback(this, &SyringePump::scheduledStart), std::chrono::microseconds(delay_us));
+    
+    comReturn(data, MSG_OK);
+}
+
+/*! Time of the last scheduled start and when it happened, to measure the skew */
+void SyringePump::getScheduledStart(const MessageHeader* data) {
+    static ScheduledStart scheduledStart; // static is needed to avoid memory allocation every time the function is called
+    
+    scheduledStart.header.packetLength = sizeof(ScheduledStart);
+    scheduledStart.header.fid = data->fid;
+    
+    core_util_critical_section_enter();
+    scheduledStart.startTime_us = _startTime_us;
+    scheduledStart.startedAt_us = _startedAt_us;
+    core_util_critical_section_exit();
+    
+    sendReply(&scheduledStart, sizeof(ScheduledStart));
+}
+
+/*! Handler statistics of up to PERF_STATS_CHUNK FIDs from firstFid on, for the whole
+ *  board. Can be read while pumping */
+void SyringePump::getPerfStats(const GetPerfStats* data) {
+    static PerfStatsReply perfStats; // static is needed to avoid memory allocation every time the function is called
+    
+    if ((data->header.packetLength != sizeof(GetPerfStats)) || (data->firstFid > _fidCount)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    int count = _fidCount - data->firstFid;
+    if (count > PERF_STATS_CHUNK) count = PERF_STATS_CHUNK;
+    
+    for (int i = 0; i < count; i++) {
+        const PerfStats* stats = &_comServer->_perfStats[data->firstFid + i];
+        PerfStatsEntry* entry = &perfStats.entries[i];
+        
+        entry->fid = data->firstFid + i;
+        entry->calls = stats->calls;
+        entry->min_us = (stats->calls != 0) ? stats->min_us : 0;
+        entry->avg_us = (stats->calls != 0) ? (uint32_t)(stats->total_us / stats->calls) : 0;
+        entry->max_us = stats->max_us;
+        entry->bytesSent = stats->bytesSent;
+        entry->spiTransactions = stats->spiTransactions;
+    }
+    
+    int length = sizeof(PerfStatsReply) - (PERF_STATS_CHUNK - count) * sizeof(PerfStatsEntry);
+    perfStats.header.packetLength = length;
+    perfStats.header.fid = data->header.fid;
+    perfStats.header.error = MSG_OK;
+    perfStats.fidCount = _fidCount;
+    perfStats.count = count;
+    
+    sendReply(&perfStats, length);
+}
+
+/*! Clears the handler statistics of the whole board */
+void SyringePump::resetPerfStats(const MessageHeader* data) {
+    _comServer->clearPerfStats();
+    comReturn(data, MSG_OK);
+}
+
+/*! Runs the sub-messages of a batch in order and replies with all their replies in one
+ *  frame. The batch stops at the first sub-message which fails, the error of the batch
+ *  reply is the error of that sub-message */
+void SyringePump::runBatch(const MessageHeader* data) {
+    ComConnection* connection = _connection;
+    const char* end = (const char*)data + data->packetLength;
+    char* message = (char*)data + _msgHeaderLength;
+    
+    // Header of the reply, completed at the end
+    MessageHeader reply = {0, data->fid, MSG_OK};
+    int mark = connection->replyMark();
+    connection->send(&reply, _msgHeaderLength);
+    
+    // The replies are needed right away
+    bool replyDeferrable = _comServer->_replyDeferrable;
+    _comServer->_replyDeferrable = false;
+    
+    while (message < end) {
+        const MessageHeader* header = (const MessageHeader*)message;
+        
+        if ((end - message < _msgHeaderLength) || (header->packetLength < _msgHeaderLength)
+            || (header->packetLength > end - message)) {
+            reply.error = MSG_ERROR_INVALID_PARAMETER;
+            break;
+        }
+        if ((header->fid & FID_MASK) == FID_BATCH) {
+            reply.error = MSG_ERROR_NOT_SUPPORTED;
+            break;
+        }
+        
+        // comReturn() replies in place, the length has to be taken first
+        int length = header->packetLength;
+        int subMark = connection->replyMark();
+        _comServer->dispatchMessage(connection, message);
+        
+        if (connection->replyLength(mark) > COM_MAX_FRAME_SIZE) {
+            // Reads return more than a frame holds, the sub-message ran but its reply is lost
+            connection->discardReplies(subMark);
+            reply.error = MSG_ERROR_REPLY_TOO_LARGE;
+            break;
+        }
+        if (((MessageHeader*)connection->replyAt(subMark))->error != MSG_OK) {
+            reply.error = ((MessageHeader*)connection->replyAt(subMark))->error;
+            break;
+        }
+        
+        message += length;
+    }
+    
+    reply.packetLength = connection->replyLength(mark);
+    memcpy(connection->replyAt(mark), &reply, _msgHeaderLength);
+    _comServer->_replyDeferrable = replyDeferrable;
+}
+
+/*! Starts, changes or ends the status stream of the client */
+void SyringePump::subscribeStatus(const SubscribeStatus* data) {
+    if (((data->period_ms != 0) && (data->period_ms < STATUS_STREAM_TICK_MS)) || (data->onChange > 1)) {
+        comReturn(data, MSG_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    
+    StatusSubscription* subscription = &_subscriptions[_connection - _comServer->_connections];
+    subscription->active = (data->period_ms != 0) || (data->onChange == 1);
+    subscription->period_ms = data->period_ms;
+    subscription->onChange = (data->onChange == 1);
+    subscription->fid = data->header.fid;
+    subscription->sequence = 0;
+    // The first frame goes out with the next tick
+    subscription->due_us = 0;
+    
+    comReturn(data, MSG_OK);
+}
+
+/*! Status stream tick of the server, polls the drivers and pushes the due frames of
+ *  all channels */
+void SyringePump::streamStatus() {
+    uint64_t now_us = _deviceClock.read_high_resolution_us();
+    
+    for (int i = 0; i < _channelCount; i++) {
+        _channels[i]->pollDriver(now_us);
+        _channels[i]->sendStatusFrames(now_us);
+    }
+    
+    for (int i = 0; i < COM_MAX_CONNECTIONS; i++) {
+        if (_connections[i].isOpen() && !_connections[i].flush()) closeClient(&_connections[i]);
+    }
+}
+
+/*! Queues the due status frames of this pump. A frame which does not fit into the send
+ *  buffer of a slow client is dropped, its sequence number is skipped */
+void SyringePump::sendStatusFrames(uint64_t now_us) {
+    static StatusFrame frame; // static is needed to avoid memory allocation every time the function is called
+    bool read = false;
+    
+    for (int i = 0; i < COM_MAX_CONNECTIONS; i++) {
+        StatusSubscription* subscription = &_subscriptions[i];
+        if (!subscription->active) continue;
+        
+        if (!read) {
+            readStatus(&frame.status);
+            read = true;
+        }
+        
+        bool changed = subscription->onChange && ((frame.status.pumpState != subscription->last.pumpState)
+            || (frame.status.pumpError != subscription->last.pumpError)
+            || (frame.status.flowSegment != subscription->last.flowSegment));
+        bool due = (subscription->period_ms != 0) && (now_us >= subscription->due_us);
+        if (!changed && !due && (subscription->sequence > 0)) continue;
+        
+        if (subscription->period_ms != 0) {
+            // Back on the period grid, a late tick does not cause a burst
+            subscription->due_us += subscription->period_ms * 1000;
+            if (subscription->due_us <= now_us) subscription->due_us = now_us + subscription->period_ms * 1000;
+        }
+        
+        frame.header.packetLength = sizeof(StatusFrame);
+        frame.header.fid = subscription->fid;
+        frame.header.error = MSG_OK;
+        frame.sequence = subscription->sequence++;
+        frame.timestamp_us = now_us;
+        subscription->last = frame.status;
+        
+        _comServer->_connections[i].send(&frame, sizeof(StatusFrame));
+    }
+}
+
+/*! Control is granted by the dispatch, ACCESS_CONTROL messages take it when it is free */
+void SyringePump::takeControl(const MessageHeader* data) {
+    comReturn(data, MSG_OK);
+}
+
+void SyringePump::releaseControl(const MessageHeader* data) {
+    if (_comServer->_controller != _connection) {
+        comReturn(data, MSG_ERROR_NO_CONTROL);
+        return;
+    }
+    
+    // The pumps keep running, the next client in control takes them over
+    _comServer->setController(NULL);
+    comReturn(data, MSG_OK);
 }
 
-void SyringePump::getPumpErrorId(const MessageHeader* data) { 
-    static GetPumpError pumpError; // static is needed to avoid memory allocation every time the function is called
+void SyringePump::getSessionToken(const MessageHeader* data) {
+    static SessionToken sessionToken; // static is needed to avoid memory allocation every time the function is called
+    
+    // Only for the client in control, asking for the token does not take control
+    if (_comServer->_controller != _connection) {
+        comReturn(data, MSG_ERROR_NO_CONTROL);
+        return;
+    }
     
-    pumpError.header.packetLength = sizeof(GetPumpError);
-    pumpError.header.fid = FID_GET_PUMP_ERROR;
+    sessionToken.header.packetLength = sizeof(SessionToken);
+    sessionToken.header.fid = data->fid;
+    sessionToken.token = _comServer->_sessionToken;
     
-    memcpy(&pumpError.pumpErrors, _pumpErrorList, sizeof(PumpErrorList));
-  
-    _socket->send((char*) &pumpError, sizeof(GetPumpError)); 
+    sendReply(&sessionToken, sizeof(SessionToken));
 }
 
 /* End of implementation
@@ -548,6 +1267,9 @@ void SyringePump::setPumpError(int error, bool calledFromIRQ) {
         case PUMP_STEPDRV_NOT_CONFIGURED:
             _pumpErrorList->stepperDriverNotConfigured = 1;
             break;
+        case PUMP_STALL:
+            _pumpErrorList->stallDetected = 1;
+            break;
         default:
             break;
     }
@@ -575,12 +1297,16 @@ void SyringePump::unsetPumpError(int error, bool calledFromIRQ) {
         case PUMP_DRIVER_ERROR:
             _pumpErrorList->stepperDriverError = 0;
             break;
+        case PUMP_STALL:
+            _pumpErrorList->stallDetected = 0;
+            break;
         default:
             break;
     }
     
     if ((_pumpErrorList->maxLimitSwitchActive == 0) && (_pumpErrorList->minLimitSwitchActive == 0) 
-        && (_pumpErrorList->stepperDriverError == 0) && (_pumpErrorList->stepperDriverNotConfigured ==0)) {
+        && (_pumpErrorList->stepperDriverError == 0) && (_pumpErrorList->stepperDriverNotConfigured ==0)
+        && (_pumpErrorList->stallDetected == 0)) {
         _pumpError = 0;
         _tickerYellowLED.detach();
         // this is needed to make the yellow led on when while moving the limitswitch gets unpressed
@@ -597,12 +1323,48 @@ void SyringePump::unsetPumpError(int error, bool calledFromIRQ) {
 
 
 void SyringePump::pumpingFinished() {
+    setMotorCurrent(CURRENT_HOLD, true);
+    
+    // Continue with the next segment of a flow program
+    if (_flowProgramRunning && (_flowSegment + 1 < _flowProgramLength)) {
+        uint32_t dwell_ms = _flowProgram[_flowSegment].dwell_ms;
+        if (dwell_ms > 0) {
+            _flowSegmentTimeout.attach(callback(this, &SyringePump::nextFlowSegment), std::chrono::milliseconds(dwell_ms));
+        } else {
+            nextFlowSegment();
+        }
+        return;
+    }
+    
     // Disabling the pump
     disablePump(true);
     // This is callback function triggered from the interrupt
     setPumpState(IDLE, true);
 }
 
+/*! Starts the move armed by FID_START_PUMP_AT, called from the timer interrupt */
+void SyringePump::scheduledStart() {
+    _startedAt_us = deviceTime();
+    _startPending = false;
+    
+    // Written from the event queue while the move starts slowly
+    setMotorCurrent(CURRENT_ACCEL, true);
+    _motionController.run();
+}
+
+/*! Starts the next flow program segment, called from the motion or dwell interrupt */
+void SyringePump::nextFlowSegment() {
+    _flowSegment++;
+    
+    if (prepareFlowSegment(true) == MSG_OK) {
+        setMotorCurrent(CURRENT_ACCEL, true);
+        _motionController.run();
+    } else {
+        disablePump(true);
+        setPumpState(IDLE, true);
+    }
+}
+
 void SyringePump::maxLimSwitchHit() { // PUMP ERROR
     // Disabling the pump
     disablePump(true);
@@ -631,15 +1393,40 @@ void SyringePump::stepperDriverError() { // PUMP ERROR
     setPumpError(PUMP_DRIVER_ERROR, true);
 }
 
+/*! Feeds the stall detection, called from the step interrupt */
+void SyringePump::stepTaken() {
+    _stallDetector.step(_motionController.getState() == MotionController::RAMP_MAX);
+}
+
+void SyringePump::stallDetected() { // PUMP ERROR
+    // Same as a limit switch, the steps since the stall delivered nothing
+    disablePump(true);
+    setPumpError(PUMP_STALL, true);
+}
+
 void SyringePump::disablePump(bool calledFromIRQ) {
 
     if (!calledFromIRQ) __disable_irq();
     
     _motionController.reset();
+    
+    _flowPumping = false;
+    
+    // Abort a running flow program, the program itself stays uploaded
+    _flowProgramRunning = false;
+    _flowSegmentTimeout.detach();
+    _dirPin = 0;
+    
+    // Cancel a scheduled start
+    _startTimeout.detach();
+    _startPending = false;
 
     setFlowConfigured(false, calledFromIRQ);
     
     if (!calledFromIRQ) __enable_irq();
+    
+    // Outside of the critical section, the write may wait for the bus
+    setMotorCurrent(CURRENT_HOLD, calledFromIRQ);
 }
 
 /*! Setter for the _flowConfigured private member */
@@ -649,9 +1436,74 @@ void SyringePump::setFlowConfigured(bool value, bool calledFromIRQ) {
     if (!calledFromIRQ) __enable_irq();
 }
 
+/*! Steps per ml of the configured drive with a syringe of the given diameter */
+double SyringePump::calcStepsPer_ml(float syringeDiameter_mm) {
+    // Calculate syringe area
+    double syringeArea_mm2 = PI * pow((syringeDiameter_mm / 2.0), 2);
+    // D(printf("Syringe area = %f \n", syringeArea_mm2));
+    // Total steps per revolution
+    double stepsPerRev = _hardwareConfig->stepMode * _hardwareConfig->stepsPerRev;
+    
+    return ((1000.0 / syringeArea_mm2) * stepsPerRev) / _hardwareConfig->leadScrewPitch_mm;
+}
+
+/*! Sets up the motion profile of the current flow program segment, returns an error message
+ *  if the segment cannot run */
+int SyringePump::prepareFlowSegment(bool calledFromIRQ) {
+    const FlowSegment* segment = &_flowProgram[_flowSegment];
+    
+    // Check for limit switches and direction (0 = pull, 1 = push)
+    if (((_maxLimSwPin == 0) && (segment->direction == 1))
+        || ((_minLimSwPin == 0) && (segment->direction == 0))) {
+        return MSG_ERROR_LIMIT_SW_ACTIVE;
+    }
+    
+    _dirPin = segment->direction;
+    
+    float stepsPerRev = _hardwareConfig->stepMode * _hardwareConfig->stepsPerRev;
+    float stepsPerSec = segment->flowrate_mlpmin / 60.0 * _stepsPer_ml;
+    float accel = _hardwareConfig->pumpAcc_RevPerSecSec * stepsPerRev; // converting rev/s^2 to steps/s^2
+    float decel = _hardwareConfig->pumpDec_RevPerSecSec * stepsPerRev; // converting rev/s^2 to steps/s^2
+    
+    // Each segment runs whole microsteps, the rounding is carried to the next segment
+    // so the volume of the whole program stays within one microstep
+    double sign = (segment->direction == 1) ? 1.0 : -1.0;
+    double exact = segment->volume_ml * _stepsPer_ml + sign * _flowStepRest;
+    double steps = floor(exact + 0.5);
+    if (steps < 0.0) steps = 0.0;
+    if (steps > MOTION_MAX_STEPS) {
+        return MSG_ERROR_INVALID_PARAMETER;
+    }
+    _flowStepRest = sign * (exact - steps);
+    
+    _motionController.configure(steps, stepsPerSec, accel, decel, _hardwareConfig->motionProfile);
+    if (!_motionController.createMotionProfile(calledFromIRQ)) {
+        return MSG_ERROR_SWITCHING_OVER_MAX;
+    }
+    
+    return MSG_OK;
+}
+
+/*! Checks the segments of a flow program upload */
+bool SyringePump::flowSegmentsValid(const FlowSegment* segments, int count) {
+    for (int i = 0; i < count; i++) {
+        const FlowSegment* segment = &segments[i];
+        if ((segment->flowrate_mlpmin <= 0) || (segment->flowrate_mlpmin > 100)
+            || (segment->volume_ml <= 0) || (segment->volume_ml > 200)
+            || ((segment->direction != 0) && (segment->direction != 1))
+            || (segment->dwell_ms > 3600000)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
 /*! Applying hardware config */
 void SyringePump::applyHardwareConfig() {
-    // Applying settings to the stepper driver
+    // Applying settings to the stepper driver, only the registers which changed
+    // are written, once each
+    _stepperDriver.beginUpdate();
  
     // PWM Frequency
     if (_hardwareConfig->pwmFrequency == 0) {
@@ -683,16 +1535,31 @@ void SyringePump::applyHardwareConfig() {
     
     // Maximum current
     // D(printf("applying maxCurrentMilliamps = %d \n", _hardwareConfig->maxDriverCurrent_mA));
-    _stepperDriver.setCurrentMilliamps(_hardwareConfig->maxDriverCurrent_mA);
+    _current_mA = profileCurrent_mA(_currentLevel);
+    _stepperDriver.setCurrentMilliamps(_current_mA);
+    
+    // For a message on its own the writes and their verification run in the
+    // background and finishDriverJob() flags the result. Later accesses to the
+    // driver wait for them, as do the motion and configuration messages
+    if (_driverJob == DRIVER_CONFIG) finishDriverJob(true); // The previous result first
+    if (_comServer->_replyDeferrable && (_driverJob == DRIVER_IDLE)
+        && _stepperDriver.endUpdateAsync(callback(_comServer, &SyringePump::comEvent))) {
+        _driverJob = DRIVER_CONFIG;
+        return;
+    }
     
-    // Verify settings and flag if it wasn't successful
-    if (!_stepperDriver.verifySettings()) {
+    _stepperDriver.endUpdate();
+    flagDriverConfigured(_stepperDriver.verifySettings());
+}
+
+/*! Flags the result of verifying the written settings */
+void SyringePump::flagDriverConfigured(bool configured) {
+    if (!configured) {
         setPumpError(PUMP_STEPDRV_NOT_CONFIGURED);
     } else if (_pumpErrorList->stepperDriverNotConfigured == 1) {
         // if previously there was an error, undo it
         unsetPumpError(PUMP_STEPDRV_NOT_CONFIGURED);
     }
-
 }
 
 /*! Initialising Hardware */
@@ -718,6 +1585,7 @@ void SyringePump::initHardware() {
     _hardwareConfig->maxPullPushVel_RevPerSec = 4.0f; // Velocity when push/pull is at max (rev/s)
     _hardwareConfig->pumpAcc_RevPerSecSec = 0.1f; // Acceleration rate for normal pumping (rev/s^2)
     _hardwareConfig->pumpDec_RevPerSecSec= 0.1f; // Deceleration rate for normal puming (rev/s^2)
+    _hardwareConfig->motionProfile = MotionController::PROFILE_TRAPEZOIDAL;
     
     applyHardwareConfig();
 }
@@ -760,34 +1628,62 @@ void SyringePump::initEthernet() {
     // Creating TCP server on Ethernet interface
     _server.open(&_eth);
     _server.bind(TCP_PORT);
-    _server.listen(1);
+    _server.listen(COM_MAX_CONNECTIONS);
     
-    // Configuring TCP socket
-    // _socket.set_blocking(true);
-    // _socket.set_timeout(-1);
-    _server.set_blocking(true);
-    _server.set_timeout(-1);
+    // Clients are accepted from sigio
+    _server.set_blocking(false);
+    
+    if (UDP_PORT != 0) {
+        _udpServer.open(&_eth);
+        _udpServer.bind(UDP_PORT);
+        _udpServer.set_blocking(false);
+    }
 }
 
 /*! Getting a function pointer based on the FID */
 const SyringePump::ComMessage* SyringePump::getComFromHeader(const MessageHeader* header) {
+    int fid = header->fid & FID_MASK; // Without the channel
 
-    if (header->fid >= _fidCount) { //Prevent getting out of an array
+    if (fid >= _fidCount) { //Prevent getting out of an array
         return NULL;
     }
 
-    return &comMessages[header->fid];
+    return &comMessages[fid];
 }
 
 void SyringePump::comReturn(const void* data, const int errorCode) {
     MessageHeader *message = (MessageHeader*) data;
     message->packetLength = _msgHeaderLength;
     message->error = errorCode;
-    _socket->send((char*) message, _msgHeaderLength);
+    sendReply(message, _msgHeaderLength);
 }
 
-/*! Main function */
-void SyringePump::run() {   
+/*! Queues a reply to the current message, there is always room for one frame */
+void SyringePump::sendReply(const void* data, int length) {
+    _connection->send(data, length);
+}
+
+/*! Length of a reply whose fields from legacyLength on were added after the first
+ *  release. Plain frames get the original layout, which clients like the LabVIEW
+ *  tester parse with fixed lengths, extended frames get the whole reply */
+int SyringePump::compatLength(int length, int legacyLength) {
+    return (_connection->frameVersion() == 0) ? legacyLength : length;
+}
+
+/*! Adds a pump which is served by the TCP server of this one, returns its channel
+ *  or -1 if all channels are taken */
+int SyringePump::addChannel(SyringePump* pump) {
+    if (_channelCount >= PUMP_MAX_CHANNELS) {
+        return -1;
+    }
+    
+    _channels[_channelCount] = pump;
+    pump->_comServer = this;
+    return _channelCount++;
+}
+
+/*! Setting up the hardware of a pump, before the network is up */
+void SyringePump::initPump() {
     // Indicate initialising state of a system
     setPumpState(SYS_INIT);
  
@@ -797,6 +1693,9 @@ void SyringePump::run() {
     // Motion controller's callback
     // _motionController.callbackPumpingDone.attach(this, &SyringePump::pumpingFinished);
     _motionController.callbackPumpingDone = mbed::callback(this, &SyringePump::pumpingFinished);
+    _motionController.callbackStep = mbed::callback(this, &SyringePump::stepTaken);
+    _motionController.callbackStateChange = mbed::callback(this, &SyringePump::rampStateChanged);
+    _stallDetector.callbackStall = mbed::callback(this, &SyringePump::stallDetected);
     
     // Limit switches interrupt setup
     _maxLimSwPin.mode(PullUp);
@@ -826,70 +1725,529 @@ void SyringePump::run() {
                 
     // Indicate state of a system
     setPumpState(WAIT_FOR_CONNECTION);
+}
+
+/*! Stopping and resetting a pump after the client disconnected */
+void SyringePump::clientDisconnected() {
+    // Stop the pump
+    disablePump();
+    
+    // Disable AMIS30543 driver
+    _stepperDriver.disableDriver();
+    
+    // Reinitialise hardware
+    initHardware();
+}
+
+/*! Handling a message addressed to this pump */
+void SyringePump::handleMessage(char* data) {
+    const ComMessage* comMessage = getComFromHeader((MessageHeader*)data);
+            
+    if(comMessage != NULL && comMessage->replyFunc != NULL) {
+        // D(printf("FID to call: %d\n", comMessage->fid));
+        // Allow only the WHILE_RUNNING commands (stop, reads) when pump is running
+        if ((_pumpState == PUMP_RUNNING) && (comMessage->running != WHILE_RUNNING) && (_pumpError == 0)) {
+            comReturn(data, MSG_ERROR_PUMP_RUNNING);
+        } else {
+            (this->*comMessage->replyFunc)((void*)data);
+        }
+    } else {
+        comReturn(data, MSG_ERROR_NOT_SUPPORTED);
+    }
+}
+
+/*! Main function */
+void SyringePump::run() {   
+    for (int i = 0; i < _channelCount; i++) {
+        _channels[i]->initPump();
+    }
         
     // D(printf("Initialising Ethernet Interface...\n"));
     initEthernet();
     // D(printf("Starting up...\n"));
 
-    // Initialise data buffer (receive)
-    char data[256];
-    // Create pointer to header data
-    MessageHeader* header;
-
-    while (true) {
+    // Allocated once, connections are reused
+    _eventQueue = new EventQueue(COM_EVENT_QUEUE_SIZE);
+    _connections = new ComConnection[COM_MAX_CONNECTIONS];
+    _perfStats = new PerfStats[_fidCount];
+    clearPerfStats();
+    _deviceClock.start();
+    for (int i = 0; i < _channelCount; i++) {
         // Indicate state of a system
-        setPumpState(WAIT_FOR_CONNECTION);
-        
-        // // D(printf("\nWaiting for new connection...\n"));
-        // _server.accept(&_socket, &_clientAddr);	
-        // // D(printf("accept %s:%d\n", _clientAddr.get_ip_address(), _clientAddr.get_port()));
-        _socket = _server.accept();
-        _socket->getpeername(&_clientAddr);
-
-        // Indicate the state of a system
-        setPumpState(IDLE);
-                
-        while(true) {
-            // Wait for a header
-            // if (_socket.recv(data, _msgHeaderLength) <= 0) break;
-            _socketBytes = _socket->recv(data, _msgHeaderLength);
-            if (_socketBytes <= 0) break;
+        _channels[i]->setPumpState(WAIT_FOR_CONNECTION);
+    }
+
+    // Accepting, receiving and sending are driven by sigio, a client may be waiting already
+    _server.sigio(callback(this, &SyringePump::comEvent));
+    if (UDP_PORT != 0) _udpServer.sigio(callback(this, &SyringePump::comEvent));
+    comEvent();
+    _eventQueue->call_every(std::chrono::milliseconds(STATUS_STREAM_TICK_MS), this, &SyringePump::streamStatus);
+
+    _eventQueue->dispatch_forever();
+}
+
+/*! sigio of the server and the client sockets, called by the network stack. The work
+ *  is done on the event queue, one posted event covers any number of signals */
+void SyringePump::comEvent() {
+    if (!core_util_atomic_flag_test_and_set(&_comPending)) {
+        _eventQueue->call(this, &SyringePump::serviceCom);
+    }
+}
 
-            header = (MessageHeader*)data;
+/*! Accepts, receives, handles and replies as far as possible without blocking */
+void SyringePump::serviceCom() {
+    core_util_atomic_flag_clear(&_comPending);
 
-            if (header->packetLength != _msgHeaderLength) {
-                if (_socket->recv(data + _msgHeaderLength, header->packetLength - _msgHeaderLength) <= 0) break;
+    // Datagrams first, they are the fast path
+    if (UDP_PORT != 0) serviceUdp();
+    acceptClients();
+
+    // Replies of the stepper driver accesses which completed meanwhile
+    for (int i = 0; i < _channelCount; i++) {
+        _channels[i]->finishDriverJob();
+    }
+
+    // Round robin, one client with many frames does not starve the others
+    bool busy;
+    do {
+        busy = false;
+        for (int i = 0; i < COM_MAX_CONNECTIONS; i++) {
+            if (_connections[i].isOpen() && serviceConnection(&_connections[i])) busy = true;
+        }
+    } while (busy);
+}
+
+/*! Takes the waiting clients while there are free connections, the others stay in the
+ *  backlog of the server */
+void SyringePump::acceptClients() {
+    for (int i = 0; i < COM_MAX_CONNECTIONS; i++) {
+        if (_connections[i].isOpen()) continue;
+
+        nsapi_error_t error;
+        TCPSocket* socket = _server.accept(&error);
+        if (socket == NULL) return;
+
+        socket->getpeername(&_clientAddr);
+        _connections[i].open(socket, callback(this, &SyringePump::comEvent));
+
+        if (_openConnections++ == 0) {
+            for (int j = 0; j < _channelCount; j++) {
+                // Indicate the state of a system
+                _channels[j]->setPumpState(IDLE);
             }
-                                
-            const ComMessage* comMessage = getComFromHeader(header);
-                    
-            if(comMessage != NULL && comMessage->replyFunc != NULL) {
-                // D(printf("FID to call: %d\n", comMessage->fid));
-                // Allow only pump stop and status commands when pump is running
-                // Fact: comMessage->fid is equivalent to (*comMessage).fid
-                if ((_pumpState == PUMP_RUNNING) && (comMessage->fid != FID_STOP_PUMP) && (comMessage->fid != FID_GET_STATUS) &&  (_pumpError == 0)) {
-                    comReturn(data, MSG_ERROR_PUMP_RUNNING);
-                } else {
-                    (this->*comMessage->replyFunc)((void*)data);
+        }
+    }
+}
+
+/*! One round of receiving, handling and sending, returns whether frames were handled */
+bool SyringePump::serviceConnection(ComConnection* connection) {
+    if (!connection->receive()) {
+        closeClient(connection);
+        return false;
+    }
+    int handled = dispatchFrames(connection);
+    if (!connection->flush()) {
+        closeClient(connection);
+        return false;
+    }
+
+    return handled > 0;
+}
+
+/*! The pumps are stopped and reset when the client in control leaves, or the last one */
+void SyringePump::closeClient(ComConnection* connection) {
+    bool inControl = (_controller == connection);
+    if (inControl) setController(NULL);
+
+    // Its deferred messages do not run anymore
+    for (int i = 0; i < _channelCount; i++) {
+        if (_channels[i]->_asyncConnection == connection) {
+            _eventQueue->cancel(_channels[i]->_asyncEvent);
+            _channels[i]->_asyncConnection = NULL;
+        }
+        // The driver access completes without a reply
+        if (_channels[i]->_driverConnection == connection) {
+            _channels[i]->_driverConnection = NULL;
+        }
+    }
+
+    connection->close();
+    _openConnections--;
+
+    // Its status streams end with it
+    int index = connection - _connections;
+    for (int i = 0; i < _channelCount; i++) {
+        _channels[i]->_subscriptions[index].active = false;
+    }
+
+    if (inControl || (_openConnections == 0)) {
+        // D(printf("Client disconnected, stopping and resetting the pumps\n"));
+        for (int i = 0; i < _channelCount; i++) {
+            _channels[i]->clientDisconnected();
+        }
+    }
+
+    if (_openConnections == 0) {
+        // Indicate disconnected state
+        for (int i = 0; i < _channelCount; i++) {
+            _channels[i]->setPumpState(WAIT_FOR_CONNECTION);
+        }
+    }
+
+    // Another client may be waiting in the backlog
+    comEvent();
+}
+
+/*! Hands control to the connection if nobody has it, returns whether it is in control */
+bool SyringePump::grantControl(ComConnection* connection) {
+    if (_controller == NULL) setController(connection);
+
+    return _controller == connection;
+}
+
+/*! Every client in control gets a new session token, it is not a password but keeps
+ *  datagrams of earlier sessions and other clients from stopping the pumps */
+void SyringePump::setController(ComConnection* connection) {
+    static uint32_t seed = 0x9E3779B9u;
+
+    _controller = connection;
+    if (connection == NULL) {
+        _sessionToken = 0;
+        return;
+    }
+
+    // xorshift over the time control was taken
+    seed ^= (uint32_t)_deviceClock.read_high_resolution_us();
+    do {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+    } while (seed == 0);
+    _sessionToken = seed;
+}
+
+/*! Microseconds since the server started, one clock for all pumps of the board */
+us_timestamp_t SyringePump::deviceTime() {
+    return _comServer->_deviceClock.read_high_resolution_us();
+}
+
+/*! Handles the waiting datagrams of the UDP fast path */
+void SyringePump::serviceUdp() {
+    static char datagram[COM_MAX_FRAME_SIZE];
+    SocketAddress peer;
+
+    while (true) {
+        nsapi_size_or_error_t bytes = _udpServer.recvfrom(&peer, datagram, sizeof(datagram));
+        if (bytes < 0) return;
+
+        handleDatagram(&peer, datagram, bytes, deviceTime());
+    }
+}
+
+/*! FID_GET_STATUS and FID_SYNC_CLOCK from anyone, FID_STOP_PUMP with the session token
+ *  of the client in control. Other messages and datagrams which are not one whole
+ *  message are ignored or refused, the reply goes back to the sender */
+void SyringePump::handleDatagram(const SocketAddress* peer, char* data, int length, us_timestamp_t received_us) {
+    static SystemStatus status; // static is needed to avoid memory allocation every time the function is called
+    static SyncClock sync;
+    MessageHeader* header = (MessageHeader*)data;
+
+    if ((length < _msgHeaderLength) || (header->packetLength != length)) return;
+
+    int channel = header->fid >> FID_CHANNEL_SHIFT;
+    int fid = header->fid & FID_MASK;
+    int error = MSG_OK;
+
+    if (channel >= _channelCount) {
+        error = MSG_ERROR_NOT_SUPPORTED;
+    } else if (fid == FID_GET_STATUS) {
+        status.header.packetLength = sizeof(SystemStatus);
+        status.header.fid = header->fid;
+        status.header.error = MSG_OK;
+        _channels[channel]->readStatus(&status.status);
+        _udpServer.sendto(*peer, &status, sizeof(SystemStatus));
+        return;
+    } else if ((fid == FID_SYNC_CLOCK) && (length == _msgHeaderLength + (int)sizeof(uint64_t))) {
+        stampSyncClock(&sync, (const SyncClock*)data, received_us);
+        _udpServer.sendto(*peer, &sync, sizeof(SyncClock));
+        return;
+    } else if (fid == FID_STOP_PUMP) {
+        if (length < (int)sizeof(SessionToken)) {
+            error = MSG_ERROR_INVALID_PARAMETER;
+        } else if ((_sessionToken == 0) || (((SessionToken*)data)->token != _sessionToken)) {
+            error = MSG_ERROR_NO_CONTROL;
+        } else {
+            _channels[channel]->haltPump();
+        }
+    } else {
+        error = MSG_ERROR_NOT_SUPPORTED;
+    }
+
+    header->packetLength = _msgHeaderLength;
+    header->error = error;
+    _udpServer.sendto(*peer, header, _msgHeaderLength);
+}
+
+/*! Handles the complete frames of a connection, returns how many. A frame is only
+ *  taken while its reply fits into the send buffer, so a client which does not read
+ *  its replies holds back its own commands and nobody else's */
+int SyringePump::dispatchFrames(ComConnection* connection) {
+    int handled = 0;
+    char* data;
+
+    _connection = connection;
+
+    while ((data = connection->nextFrame()) != NULL) {
+        if (connection->txFree() < COM_MIN_TX_FREE) {
+            connection->holdBack();
+            break;
+        }
+        // Its pump is busy with a deferred message, the rest of the frames waits
+        if (waitsForAsync((MessageHeader*)data)) break;
+        // As they do for the reply of a stepper driver access
+        if (waitsForDriver(connection)) break;
+
+        if (connection->isStreamed()) {
+            if (!connection->isStreaming()) {
+                int error = MSG_OK;
+                connection->startStream(streamDestination(connection, (MessageHeader*)data, &error));
+                if (error != MSG_OK) {
+                    // Refused right away, the payload is dropped as it arrives
+                    int mark = connection->beginReply();
+                    comReturn(data, error);
+                    connection->endReply(mark);
                 }
-            } else {
+            }
+            // The rest of the payload comes with later signals
+            if (!connection->streamDone()) break;
+        }
+
+        if (!connection->isStreamed() || !connection->streamDropped()) {
+            int mark = connection->beginReply();
+            if (connection->frameVersion() > COM_EXTENDED_VERSION) {
                 comReturn(data, MSG_ERROR_NOT_SUPPORTED);
+            } else if ((connection->frameVersion() != 0) && deferMessage(connection, data)) {
+                // The reply follows when it ran, with the request ID
+            } else {
+                _replyDeferrable = true;
+                dispatchMessage(connection, data);
+                _replyDeferrable = false;
             }
-        }			
-        // Client disconnected        
-        // D(printf("Client disconnected, stopping and resetting the pump\n"));
-        
-        // Stop the pump
-        disablePump();
-        
-        // Disable AMIS30543 driver
-        _stepperDriver.disableDriver();
-        
-        // Reinitialise hardware
-        initHardware();
-        
-        _socket->close();
-        // Indicate disconnected state
-        setPumpState(WAIT_FOR_CONNECTION);
+            connection->endReply(mark);
+        }
+
+        connection->frameDone();
+        handled++;
+    }
+
+    return handled;
+}
+
+/*! Slow messages in extended frames run in their own event, so the frames behind them
+ *  do not wait for them and their replies can overtake. Returns whether the message
+ *  was deferred */
+bool SyringePump::deferMessage(ComConnection* connection, const char* data) {
+    const MessageHeader* header = (const MessageHeader*)data;
+    int channel = header->fid >> FID_CHANNEL_SHIFT;
+    int fid = header->fid & FID_MASK;
+
+    // The SPI reconfiguration and verification of the driver
+    if ((fid != FID_SET_HARDWARE_CONFIG) && (fid != FID_RESET_PUMP)) return false;
+    // Errors are replied right away
+    if ((channel >= _channelCount) || !grantControl(connection)) return false;
+
+    SyringePump* pump = _channels[channel];
+    memcpy(pump->_asyncMessage, data, header->packetLength);
+    pump->_asyncEvent = _eventQueue->call(pump, &SyringePump::runAsync);
+    if (pump->_asyncEvent == 0) return false;
+
+    pump->_asyncConnection = connection;
+    pump->_asyncRequestId = connection->requestId();
+    return true;
+}
+
+/*! Motion and configuration messages wait while a deferred message of their pump has
+ *  not run yet, or its driver is configured in the background, so they take effect in
+ *  order. Batches wait for all pumps */
+bool SyringePump::waitsForAsync(const MessageHeader* header) {
+    int channel = header->fid >> FID_CHANNEL_SHIFT;
+    const ComMessage* comMessage = getComFromHeader(header);
+
+    if ((channel >= _channelCount) || (comMessage == NULL)) return false;
+
+    if (comMessage->fid == FID_BATCH) {
+        for (int i = 0; i < _channelCount; i++) {
+            if ((_channels[i]->_asyncConnection != NULL) || (_channels[i]->_driverJob == DRIVER_CONFIG)) return true;
+        }
+        return false;
+    }
+
+    return (comMessage->access == ACCESS_CONTROL)
+        && ((_channels[channel]->_asyncConnection != NULL) || (_channels[channel]->_driverJob == DRIVER_CONFIG));
+}
+
+/*! Whether a reply to the connection waits for a stepper driver access */
+bool SyringePump::waitsForDriver(ComConnection* connection) {
+    for (int i = 0; i < _channelCount; i++) {
+        if (_channels[i]->_driverConnection == connection) return true;
+    }
+    return false;
+}
+
+/*! Leaves the reply to the message to finishDriverJob(), if the message allows it.
+ *  The frames of the client behind this one wait for it */
+bool SyringePump::deferDriverReply(const MessageHeader* data) {
+    // The reply of the previous access may still wait for room
+    if (!_comServer->_replyDeferrable || (_driverConnection != NULL)) return false;
+
+    _driverConnection = _connection;
+    _driverHeader = *data;
+    _driverRequestId = (_connection->frameVersion() != 0) ? _connection->requestId() : -1;
+    return true;
+}
+
+/*! Completes the background access to the stepper driver of this pump once its
+ *  batch is done, the completion posts serviceCom(). Or right away, waiting for it */
+void SyringePump::finishDriverJob(bool wait) {
+    if ((_driverJob == DRIVER_IDLE) || (!wait && _stepperDriver.isBusy())) return;
+
+    _driverJob = DRIVER_IDLE;
+    flagDriverConfigured(_stepperDriver.finishUpdate());
+    replyDriverJob();
+}
+
+/*! Queues the deferred reply of the completed driver access. Status frames may have
+ *  filled the send buffer of the client meanwhile, then the reply waits for room like
+ *  the one of a deferred message, and the frames of the client wait for it. If the
+ *  retry cannot be queued the client is closed, its reply would not fit */
+void SyringePump::replyDriverJob() {
+    if ((_driverConnection == NULL) || (_driverJob != DRIVER_IDLE)) return;
+
+    ComConnection* connection = _driverConnection;
+    if (connection->txFree() < COM_MIN_TX_FREE) {
+        if (_comServer->_eventQueue->call_in(std::chrono::milliseconds(STATUS_STREAM_TICK_MS), this, &SyringePump::replyDriverJob) == 0) {
+            _comServer->closeClient(connection);
+            // The frames of the other clients which waited are taken up
+            _comServer->comEvent();
+        }
+        return;
+    }
+
+    ComConnection* current = _connection;
+    int mark = (_driverRequestId >= 0) ? connection->beginReply(_driverRequestId) : 0;
+
+    _connection = connection;
+    replyHardwareConfigured(&_driverHeader);
+    if (_driverRequestId >= 0) connection->endReply(mark);
+    _driverConnection = NULL;
+    _connection = current;
+
+    // Sends the reply and takes up the frames which waited
+    _comServer->comEvent();
+}
+
+/*! Runs the deferred message of this pump and queues its reply. If the event queue
+ *  cannot take the retry while the client has no room, the client is closed and the
+ *  message does not run */
+void SyringePump::runAsync() {
+    ComConnection* connection = _asyncConnection;
+
+    if (connection->txFree() < COM_MIN_TX_FREE) {
+        // The client does not read its replies, the message waits for room
+        _asyncEvent = _comServer->_eventQueue->call_in(std::chrono::milliseconds(STATUS_STREAM_TICK_MS), this, &SyringePump::runAsync);
+        if (_asyncEvent == 0) {
+            _comServer->closeClient(connection);
+            // The frames of the other clients which waited are taken up
+            _comServer->comEvent();
+        }
+        return;
+    }
+
+    int mark = connection->beginReply(_asyncRequestId);
+    _comServer->dispatchMessage(connection, _asyncMessage);
+    connection->endReply(mark);
+    _asyncConnection = NULL;
+
+    // Sends the reply and takes up the frames which waited
+    _comServer->comEvent();
+}
+
+/*! Destination of the payload of a message longer than a plain frame, NULL if it is
+ *  refused with the error. Only flow programs are uploaded this way, into the buffer
+ *  of the pump which does not hold the running program */
+void* SyringePump::streamDestination(ComConnection* connection, const MessageHeader* header, int* error) {
+    int channel = header->fid >> FID_CHANNEL_SHIFT;
+
+    if ((connection->frameVersion() > COM_EXTENDED_VERSION) || (channel >= _channelCount)
+        || ((header->fid & FID_MASK) != FID_UPLOAD_FLOW_PROGRAM)) {
+        *error = MSG_ERROR_NOT_SUPPORTED;
+    } else if (connection->messageLength() > _msgHeaderLength + sizeof(FlowProgram)) {
+        *error = MSG_ERROR_INVALID_PARAMETER;
+    } else if (!grantControl(connection)) {
+        *error = MSG_ERROR_NO_CONTROL;
+    } else {
+        return _channels[channel]->_flowUpload;
+    }
+
+    return NULL;
+}
+
+/*! Hands a message to the pump it addresses, if the client may send it. The time,
+ *  the replies and the driver SPI traffic are recorded per FID, a batch includes its
+ *  messages */
+void SyringePump::dispatchMessage(ComConnection* connection, char* data) {
+    // The top bits of the FID select the pump
+    int channel = ((MessageHeader*)data)->fid >> FID_CHANNEL_SHIFT;
+    int fid = ((MessageHeader*)data)->fid & FID_MASK;
+    const ComMessage* comMessage = getComFromHeader((MessageHeader*)data);
+    us_timestamp_t start = _deviceClock.read_high_resolution_us();
+    uint32_t spiStart = spiTransactionCount();
+    int mark = connection->replyMark();
+
+    _connection = connection;
+    if (channel >= _channelCount) {
+        comReturn(data, MSG_ERROR_NOT_SUPPORTED);
+    } else if ((comMessage != NULL) && (comMessage->access == ACCESS_CONTROL) && !grantControl(connection)) {
+        comReturn(data, MSG_ERROR_NO_CONTROL);
+    } else {
+        _channels[channel]->_connection = connection;
+        _channels[channel]->handleMessage(data);
+    }
+
+    if (comMessage != NULL) {
+        recordPerfStats(fid, _deviceClock.read_high_resolution_us() - start, connection->replyLength(mark),
+            spiTransactionCount() - spiStart);
+    }
+}
+
+void SyringePump::recordPerfStats(int fid, uint32_t time_us, int bytesSent, uint32_t spiTransactions) {
+    PerfStats* stats = &_perfStats[fid];
+
+    stats->calls++;
+    stats->total_us += time_us;
+    if (time_us < stats->min_us) stats->min_us = time_us;
+    if (time_us > stats->max_us) stats->max_us = time_us;
+    stats->bytesSent += bytesSent;
+    stats->spiTransactions += spiTransactions;
+}
+
+/*! Register reads and writes of all stepper drivers of the board so far */
+uint32_t SyringePump::spiTransactionCount() {
+    uint32_t count = 0;
+
+    for (int i = 0; i < _channelCount; i++) {
+        count += _channels[i]->_stepperDriver.driver.getTransactionCount();
+    }
+    return count;
+}
+
+void SyringePump::clearPerfStats() {
+    for (int i = 0; i < _fidCount; i++) {
+        _perfStats[i].calls = 0;
+        _perfStats[i].min_us = UINT32_MAX;
+        _perfStats[i].max_us = 0;
+        _perfStats[i].total_us = 0;
+        _perfStats[i].bytesSent = 0;
+        _perfStats[i].spiTransactions = 0;
     }
 }
@@ -1,3 +1,685 @@
-version https://git-lfs.github.com/spec/v1
-oid sha256:f9c553e5672650660bf95e2de51a605279d13cfca455e88d105c2f655cb38163
-size 9395
+#ifndef SYRINGEPUMP_H
+#define SYRINGEPUMP_H
+
+#include "mbed.h"
+#include "EthernetInterface.h"
+#include "../lib/AMIS30543/AMIS30543.h"
+#include "MotionController.h"
+#include "StallDetector.h"
+#include "DriverMonitor.h"
+#include "ComConnection.h"
+
+#define FW_VERSION "1.0"
+#define PUMP_ID "PUMP04"
+#define IP_ADDRESS "192.168.5.104"
+#define NETW_MASK "255.255.255.0"
+#define GATEAWAY "192.168.5.1"
+#define TCP_PORT 7851
+// Fast path for FID_GET_STATUS and FID_STOP_PUMP, 0 disables it
+#define UDP_PORT 7852
+// Events of the command server, sigio posts at most one at a time
+#define COM_EVENT_QUEUE_SIZE (8 * EVENTS_EVENT_SIZE)
+// Clients connected at the same time, one of them controls the pumps
+#define COM_MAX_CONNECTIONS 4
+// Status streams are checked on this tick, it is also the shortest period
+#define STATUS_STREAM_TICK_MS 10
+// Handler statistics per reply of FID_GET_PERF_STATS
+#define PERF_STATS_CHUNK 10
+// Scheduled starts lie this far ahead at least, the pump is prepared meanwhile, and
+// at most
+#define START_AT_MIN_LEAD_US 2000
+#define START_AT_MAX_LEAD_US 600000000ULL
+
+// Pumps on one board share the TCP server of the first one. The top bits of the
+// FID byte select the pump, channel 0 is the pump which runs the server
+#define PUMP_MAX_CHANNELS STEP_SCHEDULER_MAX_AXES
+#define FID_CHANNEL_SHIFT 6
+#define FID_MASK ((1 << FID_CHANNEL_SHIFT) - 1)
+
+// Flow programs, uploaded in chunks of up to FLOW_PROGRAM_CHUNK segments per packet
+// or in one extended frame
+#define FLOW_PROGRAM_MAX_SEGMENTS 64
+#define FLOW_PROGRAM_CHUNK 18
+
+class SyringePump {
+
+    // List of FIDs
+    enum FID_LIST {
+        FID_GET_STATUS,
+        FID_STOP_PUMP,
+        FID_START_PUMP,
+        FID_SET_HARDWARE_CONFIG,
+        FID_SET_FLOW_CONFIG,
+        FID_GET_HARDWARE_CONFIG,
+        FID_MAX_PULL,
+        FID_MAX_PUSH,
+        FID_DISABLE_MOTOR_HOLD,
+        FID_GET_STEPDRV_ERROR,
+        FID_GET_FLOW_CONFIG,
+        FID_RESET_PUMP,
+        FID_GET_PUMP_ERROR,
+        FID_GET_SYS_INFO,
+        FID_IDENTIFY_ITSELF,
+        FID_SET_FLOW_PROGRAM,
+        FID_START_FLOW_PROGRAM,
+        FID_SET_STEP_TIMING,
+        FID_GET_STEP_TIMING,
+        FID_SET_FLOW_RATE,
+        FID_SET_STALL_DETECTION,
+        FID_GET_STALL_DETECTION,
+        FID_GET_COM_TIMING,
+        FID_TAKE_CONTROL,
+        FID_RELEASE_CONTROL,
+        FID_SUBSCRIBE_STATUS,
+        FID_BATCH,
+        FID_GET_SESSION_TOKEN,
+        FID_UPLOAD_FLOW_PROGRAM,
+        FID_GET_PERF_STATS,
+        FID_RESET_PERF_STATS,
+        FID_SYNC_CLOCK,
+        FID_START_PUMP_AT,
+        FID_GET_SCHEDULED_START,
+        FID_SET_DRIVER_POLL,
+        FID_CLEAR_STEPDRV_ERROR,
+        FID_SET_CURRENT_PROFILE,
+        FID_GET_CURRENT_PROFILE,
+    };
+
+    // List of messages
+    enum MSG_LIST {
+        MSG_OK,
+        MSG_ERROR_INVALID_PARAMETER,
+        MSG_ERROR_NOT_SUPPORTED,
+        MSG_ERROR_PUMP_RUNNING,
+        MSG_ERROR_CHECK_POWER,
+        MSG_ERROR_FLOW_NOT_CONFIGURED,
+        MSG_ERROR_STEPDRV_NOT_CONFIGURED,
+        MSG_ERROR_LIMIT_SW_ACTIVE,
+        MSG_ERROR_STEPDRV_ERR,
+        MSG_ERROR_NO_I2C_COM,
+        MSG_ERROR_SWITCHING_OVER_MAX,
+        MSG_ERROR_NOT_AT_CONSTANT_SPEED,
+        MSG_ERROR_NO_CONTROL,
+        MSG_ERROR_REPLY_TOO_LARGE,
+    };
+
+    // Clients which may send a message
+    enum COM_ACCESS {
+        ACCESS_ANY, // Reads, accepted from every client
+        ACCESS_CONTROL, // Motion and configuration, only from the client in control
+    };
+
+    // Whether a message is handled while its pump is running
+    enum COM_RUNNING {
+        WHEN_IDLE, // Refused with MSG_ERROR_PUMP_RUNNING
+        WHILE_RUNNING, // Stop, reads and the changes a running move allows
+    };
+
+    enum PUMP_STATES {
+        SYS_INIT,
+        WAIT_FOR_CONNECTION,
+        IDLE,
+        PUMP_RUNNING,
+    };
+
+    enum PUMP_ERROR_STATES {
+        PUMP_MAXLIM,
+        PUMP_MINLIM,
+        PUMP_DRIVER_ERROR,
+        PUMP_STEPDRV_NOT_CONFIGURED,
+        PUMP_STALL,
+    };
+
+    // Stepper driver accesses running in the background
+    enum DRIVER_JOBS {
+        DRIVER_IDLE,
+        DRIVER_CONFIG, // Writes and verification of applyHardwareConfig()
+    };
+
+    // Levels of the motor current profile
+    enum CURRENT_LEVELS {
+        CURRENT_HOLD, // Standstill, the driver still enabled
+        CURRENT_CRUISE, // Constant speed
+        CURRENT_ACCEL, // Acceleration and deceleration
+    };
+
+    public:
+        SyringePump(
+            PinName mosi,
+            PinName miso,
+            PinName sclk,
+            PinName ss,
+            PinName dirPin,
+            PinName stepPin,
+            PinName maxLimSwPin,
+            PinName minLimSwPin,
+            PinName greenLED,
+            PinName yellowLED,
+            PinName redLED,
+            PinName stepperErrorPin,
+            PinName stepperResetPin,
+            PinName slaPin,
+            StepScheduler* stepScheduler = NULL); // Shared with the other pumps of the board
+
+        int addChannel(SyringePump* pump);
+        void run();
+
+    private:
+        // Message handler function pointer
+        typedef void (SyringePump::*messageHandlerFunc)(const void*);
+
+        typedef struct {
+            uint8_t packetLength;
+            uint8_t fid;
+            uint8_t error;
+        } __attribute__((__packed__)) MessageHeader;
+
+        typedef struct {
+            uint8_t fid;
+            messageHandlerFunc replyFunc;
+            uint8_t access;
+            uint8_t running;
+        } __attribute__((__packed__)) ComMessage;
+
+        typedef struct {
+            MessageHeader header;
+            // SR0
+            uint8_t OPENY;
+            uint8_t OPENX;
+            uint8_t WD;
+            uint8_t CPFAIL;
+            uint8_t TW;
+            // SR1 and SR2
+            uint8_t OVCXNB;
+            uint8_t OVCXNT;
+            uint8_t OVCXPB;
+            uint8_t OVCXPT;
+            uint8_t TSD;
+            uint8_t OVCYNB;
+            uint8_t OVCYNT;
+            uint8_t OVCYPB;
+            uint8_t OVCYPT;
+        } __attribute__((__packed__)) GetStepperDriverError;
+
+        typedef struct {
+            int stepperDriverError;
+            int stepperDriverNotConfigured;
+            int maxLimitSwitchActive;
+            int minLimitSwitchActive;
+            int stallDetected; // This one and those behind it are not in replies to plain frames
+            int stepperDriverWarning; // Thermal warning of the driver, clears itself. Not an error, pumpError stays 0
+        } __attribute__((__packed__)) PumpErrorList;
+
+        typedef struct {
+            MessageHeader header;
+            PumpErrorList pumpErrors;
+        } __attribute__((__packed__)) GetPumpError;
+
+        typedef struct {
+            uint8_t pwmFrequency;
+            uint8_t pwmSlope;
+            uint8_t pwmJitter;
+            uint8_t stepMode;
+            uint16_t maxDriverCurrent_mA;
+            int stepsPerRev;
+            float leadScrewPitch_mm;
+            float maxPullPushAcc_RevPerSecSec;
+            float maxPullPushVel_RevPerSec;
+            float pumpAcc_RevPerSecSec;
+            float pumpDec_RevPerSecSec;
+            uint8_t motionProfile; // 0 = trapezoidal, 1 = S-curve. Optional, not in replies to plain frames
+        } __attribute__((__packed__)) HardwareConfig;
+
+        typedef struct {
+            MessageHeader header;
+            HardwareConfig hardwareConfig;
+        } __attribute__((__packed__)) SetHardwareConfig;
+
+        typedef struct {
+            MessageHeader header;
+            HardwareConfig hardwareConfig;
+        } __attribute__((__packed__)) GetHardwareConfig;
+
+        typedef struct {
+            uint8_t direction;
+            float desVolume_ml;
+            float desFlowrate_mlpmin;
+            float syringeDiameter_mm;
+        } __attribute__((__packed__)) FlowConfig;
+
+        typedef struct {
+            MessageHeader header;
+            FlowConfig flowConfig;
+        } __attribute__((__packed__)) SetFlowConfig;
+
+        typedef struct {
+            MessageHeader header;
+            FlowConfig flowConfig;
+        } __attribute__((__packed__)) GetFlowConfig;
+
+        typedef struct {
+            uint8_t direction;
+            float volume_ml;
+            float flowrate_mlpmin;
+            uint32_t dwell_ms; // Pause after the segment
+        } __attribute__((__packed__)) FlowSegment;
+
+        typedef struct {
+            MessageHeader header;
+            float syringeDiameter_mm;
+            uint8_t firstSegment; // 0 starts a new program, otherwise appends
+            uint8_t segmentCount;
+            FlowSegment segments[FLOW_PROGRAM_CHUNK];
+        } __attribute__((__packed__)) SetFlowProgram;
+
+        // Payload of FID_UPLOAD_FLOW_PROGRAM, with segmentCount segments
+        typedef struct {
+            float syringeDiameter_mm;
+            uint16_t segmentCount;
+            FlowSegment segments[FLOW_PROGRAM_MAX_SEGMENTS];
+        } __attribute__((__packed__)) FlowProgram;
+
+        typedef struct {
+            int pumpState;
+            int pumpError;
+            float suppliedVolume_ml;
+            float flowRate_mlmin;
+            int flowSegment; // Running flow program segment, -1 if none. Not in replies to plain frames
+        } __attribute__((__packed__)) PumpStatus;
+
+        typedef struct {
+            MessageHeader header;
+            PumpStatus status;
+        } __attribute__((__packed__)) SystemStatus;
+
+        typedef struct {
+            MessageHeader header;
+            uint16_t period_ms; // 0 = no periodic frames
+            uint8_t onChange; // 1 = also a frame when the state, error or segment changes
+        } __attribute__((__packed__)) SubscribeStatus;
+
+        // Pushed with the FID of FID_SUBSCRIBE_STATUS
+        typedef struct {
+            MessageHeader header;
+            uint32_t sequence; // Counts every frame of the subscription, gaps are dropped frames
+            uint64_t timestamp_us; // Device time the status was taken
+            PumpStatus status;
+        } __attribute__((__packed__)) StatusFrame;
+
+        // Status stream of one client
+        typedef struct {
+            bool active;
+            uint16_t period_ms;
+            bool onChange;
+            uint8_t fid; // With the channel bits
+            uint32_t sequence;
+            uint64_t due_us; // Next periodic frame
+            PumpStatus last; // Status of the last frame
+        } StatusSubscription;
+
+        typedef struct {
+            MessageHeader header;
+            uint32_t token; // Session token of the client in control
+        } __attribute__((__packed__)) SessionToken;
+
+        typedef struct {
+            MessageHeader header;
+            char fwVersion[5];
+            char pumpId[8];
+            char macAddr[20];
+            char ipAddr[16];
+        } __attribute__((__packed__)) SystemInfo;
+
+        typedef struct {
+            MessageHeader header;
+            uint8_t enable; // 0 = off, 1 = on (clears the statistics)
+        } __attribute__((__packed__)) SetStepTiming;
+
+        typedef struct {
+            MessageHeader header;
+            StepTimingStats stats;
+        } __attribute__((__packed__)) GetStepTiming;
+
+        typedef struct {
+            MessageHeader header;
+            float flowrate_mlpmin;
+        } __attribute__((__packed__)) SetFlowRate;
+
+        typedef struct {
+            MessageHeader header;
+            uint8_t enable; // 0 = off, 1 = on (clears the status)
+            uint16_t threshold_mV;
+        } __attribute__((__packed__)) SetStallDetection;
+
+        typedef struct {
+            MessageHeader header;
+            StallStatus status;
+        } __attribute__((__packed__)) GetStallDetection;
+
+        typedef struct {
+            MessageHeader header;
+            ComTiming timing;
+        } __attribute__((__packed__)) GetComTiming;
+
+        // The request carries the header and hostTime_us only
+        typedef struct {
+            MessageHeader header;
+            uint64_t hostTime_us; // Echoed
+            uint64_t received_us; // Device time the request arrived
+            uint64_t sent_us; // Device time the reply left
+        } __attribute__((__packed__)) SyncClock;
+
+        typedef struct {
+            MessageHeader header;
+            uint64_t startTime_us; // Device time
+        } __attribute__((__packed__)) StartPumpAt;
+
+        typedef struct {
+            MessageHeader header;
+            uint64_t startTime_us; // Of the last FID_START_PUMP_AT
+            uint64_t startedAt_us; // Device time of the start, 0 until it happened
+        } __attribute__((__packed__)) ScheduledStart;
+
+        typedef struct {
+            MessageHeader header;
+            uint16_t period_ms; // Of the status register polls
+        } __attribute__((__packed__)) SetDriverPoll;
+
+        // Levels above maxDriverCurrent_mA are limited to it
+        typedef struct {
+            uint8_t enabled; // 0 = full current all the time, 1 = on
+            uint16_t hold_mA;
+            uint16_t cruise_mA;
+            uint16_t accel_mA;
+        } __attribute__((__packed__)) CurrentProfile;
+
+        typedef struct {
+            MessageHeader header;
+            CurrentProfile profile;
+        } __attribute__((__packed__)) SetCurrentProfile;
+
+        typedef struct {
+            MessageHeader header;
+            CurrentProfile profile;
+            uint16_t current_mA; // Set at the driver now
+        } __attribute__((__packed__)) GetCurrentProfile;
+
+        // Handlers of one FID, on all channels
+        typedef struct {
+            uint32_t calls;
+            uint32_t min_us;
+            uint32_t max_us;
+            uint64_t total_us;
+            uint32_t bytesSent;
+            uint32_t spiTransactions;
+        } PerfStats;
+
+        typedef struct {
+            uint8_t fid;
+            uint32_t calls;
+            uint32_t min_us;
+            uint32_t avg_us;
+            uint32_t max_us;
+            uint32_t bytesSent; // Replies, including their headers
+            uint32_t spiTransactions; // Register reads and writes of the stepper drivers
+        } __attribute__((__packed__)) PerfStatsEntry;
+
+        typedef struct {
+            MessageHeader header;
+            uint8_t firstFid;
+        } __attribute__((__packed__)) GetPerfStats;
+
+        typedef struct {
+            MessageHeader header;
+            uint8_t fidCount; // FIDs of the firmware
+            uint8_t count; // Entries in this reply, from firstFid on
+            PerfStatsEntry entries[PERF_STATS_CHUNK];
+        } __attribute__((__packed__)) PerfStatsReply;
+
+        // FID handlers
+        static const ComMessage comMessages[];
+
+        // Initialisation and communication
+        void initEthernet();
+        void initHardware();
+        void initPump();
+        void clientDisconnected();
+        void handleMessage(char* data);
+        void comReturn(const void* data, const int errorCode);
+        void sendReply(const void* data, int length);
+        int compatLength(int length, int legacyLength);
+
+        // Command server, runs on the event queue
+        void comEvent();
+        void serviceCom();
+        void acceptClients();
+        bool serviceConnection(ComConnection* connection);
+        void closeClient(ComConnection* connection);
+        int dispatchFrames(ComConnection* connection);
+        void* streamDestination(ComConnection* connection, const MessageHeader* header, int* error);
+        void dispatchMessage(ComConnection* connection, char* data);
+        void recordPerfStats(int fid, uint32_t time_us, int bytesSent, uint32_t spiTransactions);
+        uint32_t spiTransactionCount();
+        void clearPerfStats();
+        bool grantControl(ComConnection* connection);
+        bool deferMessage(ComConnection* connection, const char* data);
+        bool waitsForAsync(const MessageHeader* header);
+        void runAsync();
+        bool waitsForDriver(ComConnection* connection);
+        bool deferDriverReply(const MessageHeader* data);
+        void finishDriverJob(bool wait = false);
+        void replyDriverJob();
+        void setController(ComConnection* connection);
+        void serviceUdp();
+        void handleDatagram(const SocketAddress* peer, char* data, int length, us_timestamp_t received_us);
+        us_timestamp_t deviceTime();
+        void disablePump(bool calledFromIRQ = false);
+
+        const ComMessage* getComFromHeader(const MessageHeader* header);
+
+        void setPumpState(int state, bool calledFromIRQ = false);
+        void setPumpError(int error, bool calledFromIRQ = false);
+        void unsetPumpError(int error, bool calledFromIRQ = false);
+
+        // Interrupt callbacks
+        void pumpingFinished();
+        void nextFlowSegment();
+        void maxLimSwitchHit();
+        void minLimSwitchHit();
+        void maxLimSwitchNoHit();
+        void minLimSwitchNoHit();
+        void stepperDriverError();
+        void stepTaken();
+        void stallDetected();
+
+        // FIDs
+        void getStatus(const MessageHeader* data);
+        void readStatus(PumpStatus* status);
+        void stopPump(const MessageHeader* data);
+        void startPump(const MessageHeader* data);
+        int prepareStart(int currentLevel);
+        void setHardwareConfig(const SetHardwareConfig* data);
+        void setFlowConfig(const SetFlowConfig* data);
+        void getHardwareConfig(const MessageHeader* data);
+        void getFlowConfig(const MessageHeader* data);
+
+        void maxPull(const MessageHeader* data);
+        void maxPush(const MessageHeader* data);
+
+        void disableMotorHold(const MessageHeader* data);
+
+        void getStepDrvErrorId(const MessageHeader* data);
+        void setDriverPoll(const SetDriverPoll* data);
+        void clearStepDrvError(const MessageHeader* data);
+        void pollDriver(uint64_t now_us);
+        void driverStatusChanged();
+        void applyDriverStatus();
+        void setCurrentProfile(const SetCurrentProfile* data);
+        void getCurrentProfile(const MessageHeader* data);
+        uint16_t profileCurrent_mA(int level);
+        void setMotorCurrent(int level, bool calledFromIRQ = false);
+        void applyMotorCurrent();
+        void rampStateChanged(int state);
+        void getPumpErrorId(const MessageHeader* data);
+
+        void haltPump();
+
+        void resetPump(const MessageHeader* data);
+        void getSysInfo(const MessageHeader* data);
+        void identifyItself(const MessageHeader* data);
+
+        void setFlowProgram(const SetFlowProgram* data);
+        void startFlowProgram(const MessageHeader* data);
+        void uploadFlowProgram(const MessageHeader* data);
+
+        void setStepTiming(const SetStepTiming* data);
+        void getStepTiming(const MessageHeader* data);
+
+        void setFlowRate(const SetFlowRate* data);
+
+        void setStallDetection(const SetStallDetection* data);
+        void getStallDetection(const MessageHeader* data);
+
+        void getComTiming(const MessageHeader* data);
+        void getPerfStats(const GetPerfStats* data);
+        void resetPerfStats(const MessageHeader* data);
+
+        void syncClock(const SyncClock* data);
+        void stampSyncClock(SyncClock* reply, const SyncClock* request, us_timestamp_t received_us);
+        void startPumpAt(const StartPumpAt* data);
+        void getScheduledStart(const MessageHeader* data);
+        void scheduledStart();
+
+        void takeControl(const MessageHeader* data);
+        void releaseControl(const MessageHeader* data);
+        void getSessionToken(const MessageHeader* data);
+
+        void runBatch(const MessageHeader* data);
+
+        void subscribeStatus(const SubscribeStatus* data);
+        void streamStatus();
+        void sendStatusFrames(uint64_t now_us);
+
+        // LEDs
+        void flipYellowLED();
+        void flipGreenLED();
+
+        // Ethernet
+        EthernetInterface _eth;
+
+        // TCP server and its clients, run by channel 0
+        TCPSocket _server;
+        SocketAddress _clientAddr;
+        ComConnection* _connections; // Pool of COM_MAX_CONNECTIONS
+        int _openConnections;
+        ComConnection* _controller; // Client in control of all channels, NULL if none
+        uint32_t _sessionToken; // Of the client in control, 0 if none
+        UDPSocket _udpServer;
+        EventQueue* _eventQueue;
+        core_util_atomic_flag _comPending; // serviceCom() is posted
+
+        Timer _deviceClock; // Timestamps of the status streams
+
+        SyringePump* _comServer; // Pump which runs the server
+        ComConnection* _connection; // Client of the message being handled
+        StatusSubscription _subscriptions[COM_MAX_CONNECTIONS]; // By connection
+        PerfStats* _perfStats; // By FID, kept by the server
+
+        // Slow message of this pump which runs in its own event
+        char _asyncMessage[COM_MAX_FRAME_SIZE];
+        ComConnection* _asyncConnection; // NULL if none
+        uint16_t _asyncRequestId;
+        int _asyncEvent;
+
+        // Stepper driver
+        AMIS30543 _stepperDriver;
+        int _driverJob; // DRIVER_JOBS, completed by finishDriverJob()
+        ComConnection* _driverConnection; // Waits for the reply of the job, NULL if none
+        MessageHeader _driverHeader;
+        int _driverRequestId; // -1 for plain frames
+        bool _replyDeferrable; // The message being handled may be replied by finishDriverJob()
+        DriverMonitor _driverMonitor;
+        uint16_t _driverPoll_ms;
+        uint64_t _driverPollDue_us;
+        uint32_t _driverTimeouts; // Aborted SPI batches of the driver already flagged
+        CurrentProfile _currentProfile;
+        volatile int _currentLevel; // CURRENT_LEVELS
+        core_util_atomic_flag _currentPending; // applyMotorCurrent() is posted
+        core_util_atomic_flag _driverStatusPending; // applyDriverStatus() is posted
+        uint16_t _current_mA;
+
+        // Motion controller
+        MotionController _motionController;
+
+        // Inputs
+        InterruptIn _maxLimSwPin;
+        InterruptIn _minLimSwPin;
+        InterruptIn _stepperErrorPin;
+
+        // Outputs
+        DigitalOut _greenLED;
+        DigitalOut _yellowLED;
+        DigitalOut _redLED;
+        DigitalOut _dirPin;
+        DigitalOut _stepperResetPin;
+
+        // Stall detection on the SLA pin
+        StallDetector _stallDetector;
+
+        // Pumps served by this one's TCP server, including itself
+        SyringePump* _channels[PUMP_MAX_CHANNELS];
+        int _channelCount;
+
+        // Constants
+        const int _fidCount;
+        const int _msgHeaderLength;
+
+        // Network addresses
+        const char* _macAddr;
+
+        SocketAddress _ipAddr;
+
+        // Configuration
+        void setFlowConfigured(bool value, bool calledFromIRQ = false);
+        void applyHardwareConfig();
+        void flagDriverConfigured(bool configured);
+        void replyHardwareConfigured(const MessageHeader* data);
+        double calcStepsPer_ml(float syringeDiameter_mm);
+        int prepareFlowSegment(bool calledFromIRQ = false);
+        bool flowSegmentsValid(const FlowSegment* segments, int count);
+
+        // Pump status
+        int _pumpState;
+        double _stepsPer_ml; // Double, a move can have more steps than a float resolves
+        PumpErrorList* _pumpErrorList;
+        int _pumpError;
+
+        // Configuration storage
+        bool _flowConfigured;
+        volatile bool _flowPumping; // Pumping the flow config (FID_START_PUMP)
+        HardwareConfig* _hardwareConfig;
+        FlowConfig* _flowConfig;
+
+        // Flow program, uploads go to the other buffer and are swapped in
+        FlowProgram* _flowProgramBuffer;
+        FlowProgram* _flowUpload;
+        FlowSegment* _flowProgram; // Segments of _flowProgramBuffer
+        int _flowProgramLength;
+        float _flowProgramDiameter_mm;
+        volatile bool _flowProgramRunning;
+        volatile int _flowSegment;
+        double _flowStepRest; // Microsteps the program is behind its volume (push positive)
+        Timeout _flowSegmentTimeout;
+
+        // Start at a device time
+        Timeout _startTimeout;
+        volatile bool _startPending;
+        uint64_t _startTime_us;
+        volatile uint64_t _startedAt_us;
+
+        // LED tickers
+        Ticker _tickerGreenLED;
+        Ticker _tickerYellowLED;
+};
+
+#endif